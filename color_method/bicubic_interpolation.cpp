@@ -8,30 +8,15 @@
 // All rights reserved.
 
 
+#include <math.h>
+
 #include "bicubic_interpolation.h"
+#include "padded_image.h"
 #include "transformation.h"
 
-/**
-  *
-  * Neumann boundary condition test
-  *
-**/
-int
-neumann_bc (int x, int nx, bool & out)
-{
-  if (x<0)
-    {
-      if(x < -2) out = true;
-      x = 0;
-    }
-  else if (x >= nx)
-    {
-      if(x > nx+1) out = true;
-      x = nx - 1;
-    }
-  return x;
-}
-
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 /**
   *
@@ -72,13 +57,66 @@ bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Bicubic interpolation of a channel of a point whose 4x4 taps are inside
+  * the padded image, from the integer part of its coordinates
+  *
+**/
+static inline double bicubic_taps(
+  double *input, //padded image to be interpolated
+  double uu,     //x coordinate of the point
+  double vv,     //y coordinate of the point
+  int x,         //integer part of uu
+  int y,         //integer part of vv
+  int m,         //width of the rows of the padded image
+  int nz,        //number of channels of the image
+  int k          //actual channel
+)
+{
+  //obtain the interpolation points of the image
+  double *r=&(input[(y-1)*m+(x-1)*nz+k]);
+  double pol[4][4];
+  for(int c=0; c<4; c++)
+    for(int l=0; l<4; l++)
+      pol[c][l]=r[l*m+c*nz];
+
+  //return interpolation
+  return bicubic_interpolation (pol, uu - x, vv - y);
+}
+
+
+/**
+  *
+  * Check if a point is inside the image or less than one pixel away from
+  * it, so that its taps are inside the guard band. Otherwise, the point is
+  * moved to the nearest point of the border, unless it is put to zero
+  *
+**/
+static inline bool bicubic_inside(
+  double &uu,     //x coordinate of the point
+  double &vv,     //y coordinate of the point
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  if(uu>=-1 && vv>=-1 && uu<nx && vv<ny) return true;
+  if(border_out) return false;
+
+  uu=(uu<-1)?-1:(uu>nx-1)?nx-1:uu;
+  vv=(vv<-1)?-1:(vv>ny-1)?ny-1:vv;
+  return true;
+}
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 double
 bicubic_interpolation(
-  double *input,//image to be interpolated
+  double *input,//padded image to be interpolated
   double uu,    //x component of the vector field
   double vv,    //y component of the vector field
   int nx,       //width of the image
@@ -88,66 +126,213 @@ bicubic_interpolation(
   bool border_out //if true, put zeros outside the region
 )
 {
-  int sx = (uu < 0) ? -1 : 1;
-  int sy = (vv < 0) ? -1 : 1;
-
-  int x, y, mx, my, dx, dy, ddx, ddy;
-  bool out = false;
-
-  x = neumann_bc ((int) uu, nx, out);
-  y = neumann_bc ((int) vv, ny, out);
-  mx = neumann_bc ((int) uu - sx, nx, out);
-  my = neumann_bc ((int) vv - sx, ny, out);
-  dx = neumann_bc ((int) uu + sx, nx, out);
-  dy = neumann_bc ((int) vv + sy, ny, out);
-  ddx = neumann_bc ((int) uu + 2 * sx, nx, out);
-  ddy = neumann_bc ((int) vv + 2 * sy, ny, out);
-
-  if (out && border_out) 
-    return 0;
-  else
+  if(!bicubic_inside(uu, vv, nx, ny, border_out)) return 0;
+
+  //the points of the first pixel of the band use the taps to the left
+  int x=(uu<0)?-1:(int) uu;
+  int y=(vv<0)?-1:(int) vv;
+  return bicubic_taps(
+    input, uu, vv, x, y, (nx+2*IMAGE_BORDER)*nz, nz, k
+  );
+}
+
+
+/**
+  *
+  * Weights of the four taps of the cubic interpolation, so that
+  * cubic_interpolation(v, x) is the sum of w[k]*v[k]
+  *
+**/
+static inline void cubic_weights(
+  double x,  //position with respect to the second tap
+  double *w  //output weights of the taps
+)
+{
+  double x2=x*x;
+  double x3=x2*x;
+  w[0]=0.5*(-x+2.0*x2-x3);
+  w[1]=1.0+0.5*(3.0*x3-5.0*x2);
+  w[2]=0.5*(x+4.0*x2-3.0*x3);
+  w[3]=0.5*(x3-x2);
+}
+
+
+#if defined(__AVX2__) && defined(__FMA__)
+/**
+  *
+  * Bicubic interpolation of every channel of a point whose 4x4 taps are
+  * inside the padded image, with AVX2. The separable weights are computed
+  * once; the four rows of taps, 4*nz contiguous values each, are combined
+  * with the weights in y, and each channel is reduced with the weights in x
+  *
+**/
+static inline void bicubic_interpolation_avx(
+  double *input,  //padded image to be interpolated
+  double uu,      //x coordinate of the point
+  double vv,      //y coordinate of the point
+  int x,          //integer part of uu
+  int y,          //integer part of vv
+  int m,          //width of the rows of the padded image
+  int nz,         //number of channels of the image
+  double *output  //output interpolated value of each channel
+)
+{
+  double wx[4], wy[4], v[4*BICUBIC_MAX_CHANNELS];
+  cubic_weights(uu-x, wx);
+  cubic_weights(vv-y, wy);
+
+  double *r=&(input[(y-1)*m+(x-1)*nz]);
+
+  for(int j=0; j<4*nz; j+=4)
+  {
+    __m256d a=_mm256_mul_pd(_mm256_set1_pd(wy[0]), _mm256_loadu_pd(r+j));
+    a=_mm256_fmadd_pd(_mm256_set1_pd(wy[1]), _mm256_loadu_pd(r+m+j), a);
+    a=_mm256_fmadd_pd(_mm256_set1_pd(wy[2]), _mm256_loadu_pd(r+2*m+j), a);
+    a=_mm256_fmadd_pd(_mm256_set1_pd(wy[3]), _mm256_loadu_pd(r+3*m+j), a);
+    _mm256_storeu_pd(&(v[j]), a);
+  }
+
+  for(int k=0; k<nz; k++)
+    output[k]=wx[0]*v[k]+wx[1]*v[nz+k]+wx[2]*v[2*nz+k]+wx[3]*v[3*nz+k];
+}
+#endif
+
+
+/**
+  *
+  * Compute the bicubic interpolation of every channel of n points of a
+  * padded image. The taps of the points are read from the guard band near
+  * the border, so the same kernel is used for all the points. With AVX2,
+  * it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  double *input,  //padded image to be interpolated
+  double *uu,     //x coordinates of the points
+  double *vv,     //y coordinates of the points
+  double *output, //output interpolated values, nz per point
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  int nz,         //number of channels of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int m=(nx+2*IMAGE_BORDER)*nz; //width of the rows of the padded image
+
+  for(int i=0; i<n; i++)
+  {
+    double u=uu[i], v=vv[i];
+    if(!bicubic_inside(u, v, nx, ny, border_out))
+    {
+      for(int k=0; k<nz; k++)
+        output[i*nz+k]=0;
+      continue;
+    }
+
+    int x=(u<0)?-1:(int) u;
+    int y=(v<0)?-1:(int) v;
+#if defined(__AVX2__) && defined(__FMA__)
+    if(nz<=BICUBIC_MAX_CHANNELS)
     {
-      //obtain the interpolation points of the image
-      double p11 = input[(mx  + nx * my) * nz + k];
-      double p12 = input[(x   + nx * my) * nz + k];
-      double p13 = input[(dx  + nx * my) * nz + k];
-      double p14 = input[(ddx + nx * my) * nz + k];
-
-      double p21 = input[(mx  + nx * y) * nz + k];
-      double p22 = input[(x   + nx * y) * nz + k];
-      double p23 = input[(dx  + nx * y) * nz + k];
-      double p24 = input[(ddx + nx * y) * nz + k];
-
-      double p31 = input[(mx  + nx * dy) * nz + k];
-      double p32 = input[(x   + nx * dy) * nz + k];
-      double p33 = input[(dx  + nx * dy) * nz + k];
-      double p34 = input[(ddx + nx * dy) * nz + k];
-
-      double p41 = input[(mx  + nx * ddy) * nz + k];
-      double p42 = input[(x   + nx * ddy) * nz + k];
-      double p43 = input[(dx  + nx * ddy) * nz + k];
-      double p44 = input[(ddx + nx * ddy) * nz + k];
-
-      //create array
-      double pol[4][4] = { 
-        {p11, p21, p31, p41}, {p12, p22, p32, p42},
-        {p13, p23, p33, p43}, {p14, p24, p34, p44}
-      };
-
-      //return interpolation
-      return bicubic_interpolation (pol, (double) uu - x, (double) vv - y);
+      bicubic_interpolation_avx(input, u, v, x, y, m, nz, &(output[i*nz]));
+      continue;
     }
+#endif
+    for(int k=0; k<nz; k++)
+      output[i*nz+k]=bicubic_taps(input, u, v, x, y, m, nz, k);
+  }
 }
 
 
+/**
+  *
+  * Compute the bicubic interpolation of every channel of a run of len
+  * pixels of row i, starting at column j, warped with a translation, in a
+  * padded image. The subpixel offset is the same for every pixel, so the
+  * pixels whose taps are inside the padded image are a 4x4 separable
+  * convolution with constant weights, done as a vertical and a horizontal
+  * pass over the interleaved channels; for integer translations, it is a
+  * copy
+  *
+**/
+void bicubic_interpolation_translation(
+  double *input,  //padded image to be warped
+  double *output, //output interpolated values of the run, nz per pixel
+  double *params, //parameters of the translation
+  int i,          //row of the run
+  int j,          //first column of the run
+  int len,        //number of pixels of the run
+  int nx,         //width of the image
+  int ny,         //height of the image
+  int nz,         //number of channels of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int m=(nx+2*IMAGE_BORDER)*nz; //width of the rows of the padded image
+  int dx=(int) floor(params[0]);
+  int dy=(int) floor(params[1]);
+  int y=i+dy;
+  int P=BICUBIC_BLOCK/nz-3; //pixels of each block of the passes
+
+  //columns of the run whose taps are inside the padded image
+  int a=(-1-dx>j)?-1-dx:j;
+  int b=(nx-dx<j+len)?nx-dx:j+len;
+  if(y<-1 || y>ny-1 || a>b || P<1) a=b=j+len;
+
+  //pixels far from the image, or all of them if the blocks are too small
+  for(int n=j; n<a; n++)
+    for(int k=0; k<nz; k++)
+      output[(n-j)*nz+k]=bicubic_interpolation(
+        input, n+params[0], i+params[1], nx, ny, nz, k, border_out
+      );
+  for(int n=b; n<j+len; n++)
+    for(int k=0; k<nz; k++)
+      output[(n-j)*nz+k]=bicubic_interpolation(
+        input, n+params[0], i+params[1], nx, ny, nz, k, border_out
+      );
+
+  double tx=params[0]-dx;
+  double ty=params[1]-dy;
+
+  if(tx==0 && ty==0)
+  {
+    //integer translation
+    for(int n=a*nz; n<b*nz; n++)
+      output[n-j*nz]=input[y*m+dx*nz+n];
+    return;
+  }
+
+  double wx[4], wy[4];
+  cubic_weights(tx, wx);
+  cubic_weights(ty, wy);
+
+  for(int c=a; c<b; c+=P)
+  {
+    int np=(b-c<P)?b-c:P;
+    double v[BICUBIC_BLOCK];
+    double *r=&(input[(y-1)*m+(c+dx-1)*nz]);
+    double *o=&(output[(c-j)*nz]);
+
+    //vertical pass over the np+3 columns of taps
+    for(int k=0; k<(np+3)*nz; k++)
+      v[k]=wy[0]*r[k]+wy[1]*r[k+m]+wy[2]*r[k+2*m]+wy[3]*r[k+3*m];
+
+    //horizontal pass
+    for(int k=0; k<np*nz; k++)
+      o[k]=wx[0]*v[k]+wx[1]*v[k+nz]+wx[2]*v[k+2*nz]+wx[3]*v[k+3*nz];
+  }
+}
+
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,   //image to be warped
+  double *input,   //padded image to be warped
   double *output,  //warped output image with bicubic interpolation
   double *params,  //x component of the vector field
   int nparams,     //number of parameters of the transform
@@ -157,19 +342,31 @@ void bicubic_interpolation(
   bool border_out  //if true, put zeros outside the region
 )
 {
-  for (int i=0; i<ny; i++)
-    for (int j=0; j<nx; j++)
-    {
-      int p=i*nx+j;
-      double x, y;
-
-      //transform coordinates using the parametric model
-      project(j, i, params, x, y, nparams);
-      
-      //obtain the bicubic interpolation at position (uu, vv)
-      for(int k=0; k<nz; k++)
-        output[p*nz+k]=bicubic_interpolation(
-          input, x, y, nx, ny, nz, k, border_out
-        );
-    }
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM:
+      bicubic_interpolation<TRANSLATION_TRANSFORM>(
+        input, output, params, nx, ny, nz, border_out
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      bicubic_interpolation<EUCLIDEAN_TRANSFORM>(
+        input, output, params, nx, ny, nz, border_out
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      bicubic_interpolation<SIMILARITY_TRANSFORM>(
+        input, output, params, nx, ny, nz, border_out
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      bicubic_interpolation<AFFINITY_TRANSFORM>(
+        input, output, params, nx, ny, nz, border_out
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      bicubic_interpolation<HOMOGRAPHY_TRANSFORM>(
+        input, output, params, nx, ny, nz, border_out
+      );
+      break;
+  }
 }
@@ -11,16 +11,34 @@
 #ifndef BICUBIC_INTERPOLATION_H
 #define BICUBIC_INTERPOLATION_H
 
+#include "padded_image.h"
+#include "transformation.h"
+
+#define BICUBIC_BLOCK 256       //number of points interpolated in each call
+#define BICUBIC_MAX_CHANNELS 4  //channels of the vectorised interpolation
+
+
+/**
+  *
+  * Bicubic interpolation in one dimension
+  *
+**/
+double
+cubic_interpolation(
+  double v[4],  //interpolation points
+  double x      //point to be interpolated
+);
+
 
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 double
 bicubic_interpolation(
-  double *input,//image to be interpolated
+  double *input,//padded image to be interpolated
   double uu,    //x component of the vector field
   double vv,    //y component of the vector field
   int nx,       //width of the image
@@ -33,11 +51,53 @@ bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of every channel of n points of a
+  * padded image. The same kernel is used for all the points and, with
+  * AVX2, it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  double *input,  //padded image to be interpolated
+  double *uu,     //x coordinates of the points
+  double *vv,     //y coordinates of the points
+  double *output, //output interpolated values, nz per point
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  int nz,         //number of channels of the image
+  bool border_out=true //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of every channel of a run of len
+  * pixels of row i, starting at column j, warped with a translation, in a
+  * padded image. The pixels use constant weights, in two separable passes
+  *
+**/
+void bicubic_interpolation_translation(
+  double *input,  //padded image to be warped
+  double *output, //output interpolated values of the run, nz per pixel
+  double *params, //parameters of the translation
+  int i,          //row of the run
+  int j,          //first column of the run
+  int len,        //number of pixels of the run
+  int nx,         //width of the image
+  int ny,         //height of the image
+  int nz,         //number of channels of the image
+  bool border_out //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,        //image to be warped
+  double *input,        //padded image to be warped
   double *output,       //warped output image with bicubic interpolation
   double *params,       //x component of the vector field
   int nparams,          //number of parameters of the transform
@@ -48,4 +108,72 @@ void bicubic_interpolation(
 );
 
 
+/**
+  *
+  * Version of the warping for a transform fixed at compile time. The matrix
+  * of the transform is built once, and the coordinates are stepped along
+  * each row by adding its first column, so the loop has no trigonometric
+  * functions and only the homography needs a division per pixel. The
+  * points of each block of the row are interpolated in a single call
+  *
+**/
+template<int nparams>
+void bicubic_interpolation(
+  double *input,        //padded image to be warped
+  double *output,       //warped output image with bicubic interpolation
+  double *params,       //x component of the vector field
+  int nx,               //width of the image
+  int ny,               //height of the image
+  int nz,               //number of channels of the image
+  bool border_out=true  //if true, put zeros outside the region
+)
+{
+  //the translation uses the same weights for every pixel
+  if(nparams==TRANSLATION_TRANSFORM)
+  {
+    for (int i=0; i<ny; i++)
+      bicubic_interpolation_translation(
+        input, &(output[i*nx*nz]), params, i, 0, nx, nx, ny, nz, border_out
+      );
+    return;
+  }
+
+  double m[9];
+  params2matrix(params, m, nparams);
+
+  for (int i=0; i<ny; i++)
+  {
+    //numerators and denominator of the transform at the start of the row
+    double xn=m[1]*i+m[2];
+    double yn=m[4]*i+m[5];
+    double dn=m[7]*i+m[8];
+
+    for (int j=0; j<nx; j+=BICUBIC_BLOCK)
+    {
+      int len=(nx-j<BICUBIC_BLOCK)?nx-j:BICUBIC_BLOCK;
+      double x[BICUBIC_BLOCK], y[BICUBIC_BLOCK];
+
+      //transform coordinates using the parametric model
+      for (int n=0; n<len; n++)
+      {
+        x[n]=xn;
+        y[n]=yn;
+        if(nparams==HOMOGRAPHY_TRANSFORM)
+        {
+          x[n]/=dn;
+          y[n]/=dn;
+        }
+        xn+=m[0];
+        yn+=m[3];
+        dn+=m[6];
+      }
+      
+      //obtain the bicubic interpolation of the block of the row
+      bicubic_interpolation(
+        input, x, y, &(output[(i*nx+j)*nz]), len, nx, ny, nz, border_out
+      );
+    }
+  }
+}
+
 #endif
@@ -25,15 +25,27 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <omp.h>
+#include <algorithm>
+#include <vector>
+#include <random>
 
 #include "bicubic_interpolation.h"
 #include "inverse_compositional_algorithm.h"
 #include "matrix.h"
 #include "mask.h"
+#include "padded_image.h"
+#include "reference.h"
+#include "robust_function.h"
+#include "steepest_descent.h"
 #include "transformation.h"
+#include "workspace.h"
 #include "zoom.h"
 
 
+using namespace std;
+
+
 /**
  *
  *  Derivative of robust error functions
@@ -45,62 +57,170 @@ double rhop(
   int    type    //choice of the robust error function
 )
 {
-  double result=0.0;
   double lambda2=lambda*lambda;
   switch(type)
   {
     case QUADRATIC:
-      result=1;
-      break;
-    default: 
+      return Quadratic::weight(t2, lambda2);
+    default:
     case TRUNCATED_QUADRATIC:
-      if(t2<lambda2) result=1.0;
-      else result=0.0;
-      break;  
+      return TruncatedQuadratic::weight(t2, lambda2);
     case GERMAN_MCCLURE:
-      result=lambda2/((lambda2+t2)*(lambda2+t2));
-      break;
-    case LORENTZIAN: 
-      result=1/(lambda2+t2);
-      break;
+      return GemanMcClure::weight(t2, lambda2);
+    case LORENTZIAN:
+      return Lorentzian::weight(t2, lambda2);
     case CHARBONNIER:
-      result=1.0/(sqrt(t2+lambda2));
-      break;
+      return Charbonnier::weight(t2, lambda2);
+    case CHARBONNIER_FAST:
+      return CharbonnierFast::weight(t2, lambda2);
   }
-  return result;
 }
 
  
 /**
  *
  *  Function to compute DI^t*J
- *  from the gradient of the image and the Jacobian
+ *  from the gradient of the image and the analytic Jacobian
+ *  DIJ is stored as one plane per parameter (see steepest_descent.h), with
+ *  the channels of each pixel in consecutive samples
  *
  */
+template<int nparams>
 void steepest_descent_images
 (
   double *Ix,  //x derivate of the image
   double *Iy,  //y derivate of the image
-  double *J,   //Jacobian matrix
   double *DIJ, //output DI^t*J
-  int nparams, //number of parameters
+  const vector<int> &x, //selected pixels, empty if all are used
   int nx,      //number of columns
   int ny,      //number of rows
   int nz       //number of channels
 )
 {
-  int k=0;
+  if(x.empty())
+  {
+    int stride=sd_stride(nx*ny*nz);
+
+    for(int i=0; i<ny; i++)
+      for(int j=0; j<nx; j++)
+        for(int c=0; c<nz; c++)
+        {
+          int p=i*nx+j;
+          point_steepest_descent<nparams>(
+            j, i, Ix[p*nz+c], Iy[p*nz+c], &(DIJ[p*nz+c]), stride
+          );
+        }
+  }
+  else
+  {
+    //the values of the selected pixels are stored contiguously
+    int stride=sd_stride(x.size()*nz);
 
-  for(int i=0; i<ny; i++)
-    for(int j=0; j<nx; j++)
+    for(unsigned int n=0; n<x.size(); n++)
       for(int c=0; c<nz; c++)
       {
-        int p=i*nx+j;
-        for(int n=0; n<nparams; n++) {
-          DIJ[k++]=Ix[p*nz+c]*J[2*p*nparams+n]+
-                   Iy[p*nz+c]*J[2*p*nparams+n+nparams];
-	}
+        int p=x[n];
+        point_steepest_descent<nparams>(
+          p%nx, p/nx, Ix[p*nz+c], Iy[p*nz+c], &(DIJ[n*nz+c]), stride
+        );
       }
+  }
+}
+
+
+/**
+ *
+ *  Dispatch of steepest_descent_images to the version for
+ *  the transform chosen at run time
+ *
+ */
+void steepest_descent_images
+(
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  double *DIJ, //output DI^t*J
+  int nparams, //number of parameters
+  const vector<int> &x, //selected pixels, empty if all are used
+  int nx,      //number of columns
+  int ny,      //number of rows
+  int nz       //number of channels
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      steepest_descent_images<TRANSLATION_TRANSFORM>(
+        Ix, Iy, DIJ, x, nx, ny, nz
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      steepest_descent_images<EUCLIDEAN_TRANSFORM>(
+        Ix, Iy, DIJ, x, nx, ny, nz
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      steepest_descent_images<SIMILARITY_TRANSFORM>(
+        Ix, Iy, DIJ, x, nx, ny, nz
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      steepest_descent_images<AFFINITY_TRANSFORM>(
+        Ix, Iy, DIJ, x, nx, ny, nz
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      steepest_descent_images<HOMOGRAPHY_TRANSFORM>(
+        Ix, Iy, DIJ, x, nx, ny, nz
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Function to get the steepest descent values of a tile of pixels.
+ *  If DIJ is stored, it returns DIJ with its stride and the start of the
+ *  tile. In the matrix-free mode (DIJ is NULL), the values are computed
+ *  on the fly from the gradient in Dt, with a stride of SD_BLOCK. If a
+ *  subset of pixels is selected, the tile runs over the selected pixels
+ *
+ */
+template<int nparams>
+double *steepest_descent_tile
+(
+  double *DIJ, //stored steepest descent images or NULL
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *Dt,  //buffer of nparams*SD_BLOCK values for the tile
+  int nx,      //number of columns
+  int ny,      //number of rows
+  int nz,      //number of channels
+  int t,       //first pixel of the tile
+  int np,      //number of pixels of the tile
+  int &stride, //output stride of the returned values
+  int &start   //output position of the tile in the returned values
+)
+{
+  if(DIJ!=NULL)
+  {
+    stride=sd_stride((x.empty()?nx*ny:x.size())*nz);
+    start=t*nz;
+    return DIJ;
+  }
+
+  for(int n=0; n<np; n++)
+  {
+    int p=x.empty()?t+n:x[t+n];
+    for(int c=0; c<nz; c++)
+      point_steepest_descent<nparams>(
+        p%nx, p/nx, Ix[p*nz+c], Iy[p*nz+c], &(Dt[n*nz+c]), SD_BLOCK
+      );
+  }
+  stride=SD_BLOCK;
+  start=0;
+  return Dt;
 }
 
 /**
@@ -119,14 +239,8 @@ void hessian
   int nz       //number of channels
 ) 
 {
-  //initialize the hessian to zero
-  for(int k=0; k<nparams*nparams; k++)
-    H[k] = 0;
- 
-  //calculate the hessian in a neighbor window
-  for(int i=0; i<ny; i++)
-    for(int j=0; j<nx; j++)
-      AtA(&(DIJ[(i*nx+j)*nz*nparams]), H, nz, nparams);
+  //accumulate the upper triangle of the Hessian by tiles
+  sd_syrk(DIJ, NULL, H, nparams, nx*ny*nz);
 }
 
 
@@ -147,14 +261,34 @@ void hessian
   int nz       //number of channels
 ) 
 {
-  //initialize the hessian to zero
-  for(int k=0; k<nparams*nparams; k++)
-    H[k] = 0;
+  int N=nx*ny;
+  int stride=sd_stride(N*nz);
+  int P=SD_BLOCK/nz; //number of pixels of a tile
+  int nthreads;
+  double *partials=sd_partials_allocate(nthreads);
+
+  //accumulate the upper triangle of the Hessian by tiles of pixels,
+  //with the weight of each pixel repeated for its channels
+  #pragma omp parallel
+  {
+    double w[SD_BLOCK];
+    double *Hp=&(partials[omp_get_thread_num()*SD_PARTIAL+MAX_NPARAMS]);
 
-  //calculate the hessian in a neighbor window
-  for(int i=0; i<ny; i++)
-    for(int j=0; j<nx; j++)
-      sAtA(rho[i*nx+j], &(DIJ[(i*nx+j)*nz*nparams]), H, nz, nparams);
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=P)
+    {
+      int np=(N-t<P)?N-t:P;
+      for(int i=0; i<np; i++)
+        for(int c=0; c<nz; c++)
+          w[i*nz+c]=rho[t+i];
+      sd_accumulate_tile(
+        DIJ, NULL, w, NULL, Hp, nparams, stride, t*nz, np*nz
+      );
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, NULL, H, nparams);
+  sd_free(partials);
 }
 
 
@@ -213,14 +347,39 @@ void robust_error_function
   int nz        //number of channels
 ) 
 {
-  for(int i=0;i<ny;i++)
-    for(int j=0;j<nx;j++)
-    {
-      double norm=0.0;
-      for(int c=0;c<nz;c++)
-        norm+=DI[(i*nx+j)*nz+c]*DI[(i*nx+j)*nz+c];
-      rho[i*nx+j]=rhop(norm,lambda,type);
-    }
+  int size=nx*ny;
+  double lambda2=lambda*lambda;
+
+  for(int i=0;i<size;i++)
+  {
+    double norm=0.0;
+    for(int c=0;c<nz;c++)
+      norm+=DI[i*nz+c]*DI[i*nz+c];
+    rho[i]=norm;
+  }
+
+  //the robust function is chosen once for the whole image
+  switch(type)
+  {
+    case QUADRATIC:
+      robust_weights<Quadratic>(rho, rho, size, lambda2);
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_weights<TruncatedQuadratic>(rho, rho, size, lambda2);
+      break;
+    case GERMAN_MCCLURE:
+      robust_weights<GemanMcClure>(rho, rho, size, lambda2);
+      break;
+    case LORENTZIAN:
+      robust_weights<Lorentzian>(rho, rho, size, lambda2);
+      break;
+    case CHARBONNIER:
+      robust_weights<Charbonnier>(rho, rho, size, lambda2);
+      break;
+    case CHARBONNIER_FAST:
+      robust_weights<CharbonnierFast>(rho, rho, size, lambda2);
+      break;
+  }
 }
 
 
@@ -240,18 +399,7 @@ void independent_vector
   int nz       //number of channels
 )
 {
-  //initialize the vector to zero
-  for(int k=0; k<nparams; k++)
-    b[k]=0;
-
-  for(int i=0; i<ny; i++)
-    for(int j=0; j<nx; j++)
-    {
-      Atb(
-        &(DIJ[(i*nx+j)*nparams*nz]), 
-        &(DI[(i*nx+j)*nz]), b, nz, nparams
-      );
-    }
+  sd_gemv(DIJ, DI, NULL, b, nparams, nx*ny*nz);
 }
 
 
@@ -273,212 +421,1336 @@ void independent_vector
   int nz       //number of channels
 )
 {
-  //initialize the vector to zero
-  for(int k=0; k<nparams; k++)
-    b[k]=0;
+  int N=nx*ny;
+  int stride=sd_stride(N*nz);
+  int P=SD_BLOCK/nz; //number of pixels of a tile
+  int nthreads;
+  double *partials=sd_partials_allocate(nthreads);
+
+  //accumulate by tiles of pixels, with the weight of each pixel
+  //repeated for its channels
+  #pragma omp parallel
+  {
+    double w[SD_BLOCK];
+    double *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
 
-  for(int i=0; i<ny; i++)
-    for(int j=0; j<nx; j++)
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=P)
     {
-      sAtb(
-        rho[i*nx+j], &(DIJ[(i*nx+j)*nparams*nz]), 
-        &(DI[(i*nx+j)*nz]), b, nz, nparams
+      int np=(N-t<P)?N-t:P;
+      for(int i=0; i<np; i++)
+        for(int c=0; c<nz; c++)
+          w[i*nz+c]=rho[t+i];
+      sd_accumulate_tile(
+        DIJ, &(DI[t*nz]), w, bt, NULL, nparams, stride, t*nz, np*nz
       );
     }
+  }
+
+  sd_partials_reduce(partials, nthreads, b, NULL, nparams);
+  sd_free(partials);
 }
 
 
 /**
  *
- *  Function to solve for dp
- *  
+ *  Function to compute b=Sum(DIJ^t * DI) and H=Sum(DIJ^t*DIJ) by tiles,
+ *  with stored or matrix-free steepest descent images. If DI is NULL, only
+ *  the Hessian is computed; if H is NULL, only the independent vector
+ *
  */
-double parametric_solve
+template<int nparams>
+void quadratic_accumulate
 (
-  double *H_1, //inverse Hessian
-  double *b,   //independent vector
-  double *dp,  //output parameters increment 
-  int nparams  //number of parameters
+  double *DIJ, //stored steepest descent images or NULL
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DI,  //I2(x'(x;p))-I1(x) 
+  double *b,   //output independent vector
+  double *H,   //output Hessian matrix
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,      //number of columns
+  int ny,      //number of rows
+  int nz       //number of channels
 )
 {
-  double error=0.0;
-  Axb(H_1, b, dp, nparams);
-  for(int i=0; i<nparams; i++) error+=dp[i]*dp[i];
-  return sqrt(error);
+  int N=x.empty()?nx*ny:x.size();
+  int P=SD_BLOCK/nz; //number of pixels of a tile
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
+  {
+    double Dt[MAX_NPARAMS*SD_BLOCK];
+    double *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    double *Hp=(H==NULL)?NULL:bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=P)
+    {
+      int np=(N-t<P)?N-t:P;
+      int stride, start;
+
+      double *D=steepest_descent_tile<nparams>(
+        DIJ, Ix, Iy, x, Dt, nx, ny, nz, t, np, stride, start
+      );
+      sd_accumulate_tile<nparams>(
+        D, (DI==NULL)?NULL:&(DI[t*nz]), NULL, bt, Hp,
+        stride, start, np*nz
+      );
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, (DI==NULL)?NULL:b, H, nparams);
 }
 
 
 /**
-  *
-  *  Inverse compositional algorithm
-  *  Quadratic version - L2 norm
-  * 
-  *
-**/
-void inverse_compositional_algorithm(
-  double *I1,   //first image
-  double *I2,   //second image
-  double *p,    //parameters of the transform (output)
-  int nparams,  //number of parameters of the transform
-  int nx,       //number of columns of the image
-  int ny,       //number of rows of the image
-  int nz,       //number of channels of the images
-  double TOL,   //Tolerance used for the convergence in the iterations
-  int verbose   //enable verbose mode
+ *
+ *  Dispatch of quadratic_accumulate to the version for
+ *  the transform chosen at run time
+ *
+ */
+void quadratic_accumulate
+(
+  double *DIJ, //stored steepest descent images or NULL
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DI,  //I2(x'(x;p))-I1(x) 
+  double *b,   //output independent vector
+  double *H,   //output Hessian matrix
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams, //number of parameters
+  int nx,      //number of columns
+  int ny,      //number of rows
+  int nz       //number of channels
 )
 {
-  int size1=nx*ny*nz;        //size of the image with channels
-  int size2=size1*nparams;   //size of the image with transform parameters
-  int size3=nparams*nparams; //size for the Hessian
-  int size4=2*nx*ny*nparams; 
-  
-  double *Ix =new double[size1];   //x derivate of the first image
-  double *Iy =new double[size1];   //y derivate of the first image
-  double *Iw =new double[size1];   //warp of the second image/
-  double *DI =new double[size1];   //error image (I2(w)-I1)
-  double *DIJ=new double[size2];   //steepest descent images
-  double *dp =new double[nparams]; //incremental solution
-  double *b  =new double[nparams]; //steepest descent images
-  double *J  =new double[size4];   //jacobian matrix for all points
-  double *H  =new double[size3];   //Hessian matrix
-  double *H_1=new double[size3];   //inverse Hessian matrix
-
-   
-  //Evaluate the gradient of I1
-  gradient(I1, Ix, Iy, nx, ny, nz);
-  
-  //Evaluate the Jacobian
-  jacobian(J, nparams, nx, ny);
-
-  //Compute the steepest descent images
-  steepest_descent_images(Ix, Iy, J, DIJ, nparams, nx, ny, nz);
-
-  //Compute the Hessian matrix
-  hessian(DIJ, H, nparams, nx, ny, nz);
-  inverse_hessian(H, H_1, nparams);
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      quadratic_accumulate<TRANSLATION_TRANSFORM>(
+        DIJ, Ix, Iy, x, DI, b, H, partials, nthreads, nx, ny, nz
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      quadratic_accumulate<EUCLIDEAN_TRANSFORM>(
+        DIJ, Ix, Iy, x, DI, b, H, partials, nthreads, nx, ny, nz
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      quadratic_accumulate<SIMILARITY_TRANSFORM>(
+        DIJ, Ix, Iy, x, DI, b, H, partials, nthreads, nx, ny, nz
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      quadratic_accumulate<AFFINITY_TRANSFORM>(
+        DIJ, Ix, Iy, x, DI, b, H, partials, nthreads, nx, ny, nz
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      quadratic_accumulate<HOMOGRAPHY_TRANSFORM>(
+        DIJ, Ix, Iy, x, DI, b, H, partials, nthreads, nx, ny, nz
+      );
+      break;
+  }
+}
 
-  //Iterate
-  double error=1E10;
-  int niter=0;
-  
-  do{     
-    //Warp image I2
-    bicubic_interpolation(I2, Iw, p, nparams, nx, ny, nz);
 
-    //Compute the error image (I1-I2w)
-    difference_image(I1, Iw, DI, nx, ny, nz);
+/**
+ *
+ *  Function to warp a tile of the second image, I2(x'(x;p)), for the
+ *  pixels from t to t+np-1. The tile is split in runs of pixels of the
+ *  same row, which are warped with constant weights for translations.
+ *  The selected pixels, if any, are projected one by one
+ *
+ */
+template<int nparams>
+void warp_tile
+(
+  double *I2, //second image, padded
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *p,  //parameters of the transform
+  double *m,  //matrix of the transform
+  double *xw, //buffer for the x coordinates of the tile
+  double *yw, //buffer for the y coordinates of the tile
+  double *Iw, //output warped values of the tile
+  int t,      //first pixel of the tile
+  int np,     //number of pixels of the tile
+  int nx,     //number of columns
+  int ny,     //number of rows
+  int nz      //number of channels
+)
+{
+  if(!x.empty())
+  {
+    for(int n=0; n<np; n++)
+    {
+      int q=x[t+n];
+      project_matrix<nparams>(q%nx, q/nx, m, xw[n], yw[n]);
+    }
 
-    //Compute the independent vector
-    independent_vector(DIJ, DI, b, nparams, nx, ny, nz);
+    //warp the tile: I2(x'(x;p))
+    bicubic_interpolation(I2, xw, yw, Iw, np, nx, ny, nz, true);
+  }
+  else if(nparams==TRANSLATION_TRANSFORM)
+  {
+    //warp each run of a row of the tile with constant weights
+    for(int n=0; n<np;)
+    {
+      int i=(t+n)/nx;
+      int j=(t+n)%nx;
+      int end=(np-n<nx-j)?np:n+nx-j;
 
-    //Solve equation and compute increment of the motion 
-    error=parametric_solve(H_1, b, dp, nparams);
+      bicubic_interpolation_translation(
+        I2, &(Iw[n*nz]), p, i, j, end-n, nx, ny, nz, true
+      );
+      n=end;
+    }
+  }
+  else
+  {
+    //the tile is split in runs of pixels of the same row
+    for(int n=0; n<np;)
+    {
+      int i=(t+n)/nx;
+      int j=(t+n)%nx;
+      int end=(np-n<nx-j)?np:n+nx-j;
 
-    //Update the warp x'(x;p) := x'(x;p) * x'(x;dp)^-1
-    update_transform(p, dp, nparams);
+      //numerators and denominator of the transform at the run start
+      double xn=m[0]*j+m[1]*i+m[2];
+      double yn=m[3]*j+m[4]*i+m[5];
+      double dn=m[6]*j+m[7]*i+m[8];
 
-    if(verbose)
-    {
-      printf("|Dp|=%f: p=(",error);
-      for(int i=0;i<nparams-1;i++)
-        printf("%f ",p[i]);
-      printf("%f)\n",p[nparams-1]);
+      for(; n<end; n++)
+      {
+        xw[n]=xn;
+        yw[n]=yn;
+        if(nparams==HOMOGRAPHY_TRANSFORM)
+        {
+          xw[n]/=dn;
+          yw[n]/=dn;
+        }
+
+        //step to the next pixel of the row
+        xn+=m[0];
+        yn+=m[3];
+        dn+=m[6];
+      }
     }
-    niter++;    
+
+    //warp the tile: I2(x'(x;p))
+    bicubic_interpolation(I2, xw, yw, Iw, np, nx, ny, nz, true);
   }
-  while(error>TOL && niter<MAX_ITER);
-  
-  //delete allocated memory
-  delete []DI;
-  delete []Ix;
-  delete []Iy;
-  delete []Iw;
-  delete []DIJ;
-  delete []dp;
-  delete []b;
-  delete []J;
-  delete []H;
-  delete []H_1;
 }
 
 
-
 /**
-  *
-  *  Inverse compositional algorithm 
-  *  Version with robust error functions
-  * 
-**/
-void robust_inverse_compositional_algorithm(
-  double *I1,    //first image
-  double *I2,    //second image
-  double *p,     //parameters of the transform (output)
-  int nparams,   //number of parameters of the transform
-  int nx,        //number of columns of the image
-  int ny,        //number of rows of the image
-  int nz,        //number of channels of the images
-  double TOL,    //Tolerance used for the convergence in the iterations
-  int    robust, //robust error function
-  double lambda, //parameter of robust error function
-  int verbose    //enable verbose mode
+ *
+ *  Function to compute I2(W(x;p))-I1(x) for the selected pixels, which
+ *  are warped by tiles. DI is stored in the order of the pixels in x
+ *
+ */
+template<int nparams>
+void difference_selected
+(
+  double *I1, //first image I1(x)
+  double *I2, //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels
+  double *p,  //parameters of the transform
+  double *DI, //output difference array
+  int nx,     //number of columns
+  int ny,     //number of rows
+  int nz      //number of channels
 )
 {
-  int size0=nx*ny;           //size of the image 
-  int size1=nx*ny*nz;        //size of the image with channels
-  int size2=size1*nparams;   //size of the image with transform parameters
-  int size3=nparams*nparams; //size for the Hessian
-  int size4=2*nx*ny*nparams; 
-  
-  double *Ix =new double[size1];   //x derivate of the first image
-  double *Iy =new double[size1];   //y derivate of the first image
-  double *Iw =new double[size1];   //warp of the second image/
-  double *DI =new double[size1];   //error image (I2(w)-I1)
-  double *DIJ=new double[size2];   //steepest descent images
-  double *dp =new double[nparams]; //incremental solution
-  double *b  =new double[nparams]; //steepest descent images
-  double *J  =new double[size4];   //jacobian matrix for all points
-  double *H  =new double[size3];   //Hessian matrix
-  double *H_1=new double[size3];   //inverse Hessian matrix
-  double *rho=new double[size0];   //robust function
-   
-  //Evaluate the gradient of I1
-  gradient(I1, Ix, Iy, nx, ny, nz);
-  
-  //Evaluate the Jacobian
-  jacobian(J, nparams, nx, ny);
+  int N=x.size();
+  int P=SD_BLOCK/nz; //number of pixels of a tile
 
-  //Compute the steepest descent images
-  steepest_descent_images(Ix, Iy, J, DIJ, nparams, nx, ny, nz);
-  
-  //Iterate
-  double error=1E10;
-  int niter=0;
-  double lambda_it;
-  
-  if(lambda>0) lambda_it=lambda;
-  else lambda_it=LAMBDA_0;
-  
-  do{     
-    //Warp image I2
-    bicubic_interpolation(I2, Iw, p, nparams, nx, ny, nz);
+  //matrix of the transform, built once for all the pixels
+  double m[9];
+  params2matrix(p, m, nparams);
 
-    //Compute the error image (I1-I2w)
-    difference_image(I1, Iw, DI, nx, ny, nz);
+  #pragma omp parallel for schedule(static)
+  for(int t=0; t<N; t+=P)
+  {
+    double xw[SD_BLOCK], yw[SD_BLOCK];
+    int np=(N-t<P)?N-t:P;
 
-    //compute robustifiction function
-    robust_error_function(DI, rho, lambda_it, robust, nx, ny, nz);
-    if(lambda<=0 && lambda_it>LAMBDA_N) 
-    {
-      lambda_it*=LAMBDA_RATIO;
-      if(lambda_it<LAMBDA_N) lambda_it=LAMBDA_N;
-    }
+    warp_tile<nparams>(
+      I2, x, p, m, xw, yw, &(DI[t*nz]), t, np, nx, ny, nz
+    );
+    for(int n=0; n<np; n++)
+      for(int c=0; c<nz; c++)
+        DI[(t+n)*nz+c]-=I1[x[t+n]*nz+c];
+  }
+}
 
-    //Compute the independent vector
-    independent_vector(DIJ, DI, rho, b, nparams, nx, ny, nz);
 
-    //Compute the Hessian matrix
-    hessian(DIJ, rho, H, nparams, nx, ny, nz);
+/**
+ *
+ *  Function to compute b=Sum(rho'*DIJ^t * DI) and H=Sum(rho'*DIJ^t*DIJ) 
+ *  in a single pass: the pixels are warped by tiles, and the differences
+ *  and robust weights of each tile are accumulated while in cache, without
+ *  storing Iw, DI or rho for the whole image
+ *
+ */
+template<int nparams, class Robust>
+void robust_accumulate
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //output Hessian matrix
+  double lambda, //threshold used in the robust functions
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  int N=x.empty()?nx*ny:x.size();
+  int P=SD_BLOCK/nz; //number of pixels of a tile
+  double lambda2=lambda*lambda;
+
+  //matrix of the transform, built once for all the pixels
+  double m[9];
+  params2matrix(p, m, nparams);
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
+  {
+    double xw[SD_BLOCK], yw[SD_BLOCK], DI[SD_BLOCK], rho[SD_BLOCK];
+    double w[SD_BLOCK];
+    double Dt[MAX_NPARAMS*SD_BLOCK];
+    double *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    double *Hp=bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=P)
+    {
+      int np=(N-t<P)?N-t:P;
+
+      //warp the tile: I2(x'(x;p))
+      warp_tile<nparams>(I2, x, p, m, xw, yw, DI, t, np, nx, ny, nz);
+
+      //difference of every channel
+      for(int n=0; n<np; n++)
+      {
+        int q=x.empty()?t+n:x[t+n];
+        double norm=0.0;
+        for(int c=0; c<nz; c++)
+        {
+          DI[n*nz+c]-=I1[q*nz+c];
+          norm+=DI[n*nz+c]*DI[n*nz+c];
+        }
+        w[n]=norm;
+      }
+
+      //the robust weight is shared by the channels of the pixel
+      robust_weights<Robust>(w, w, np, lambda2);
+      for(int n=0; n<np; n++)
+        for(int c=0; c<nz; c++)
+          rho[n*nz+c]=w[n];
+
+      //accumulate the independent vector and the Hessian of the tile
+      int stride, start;
+      double *D=steepest_descent_tile<nparams>(
+        DIJ, Ix, Iy, x, Dt, nx, ny, nz, t, np, stride, start
+      );
+      sd_accumulate_tile<nparams>(D, DI, rho, bt, Hp, stride, start, np*nz);
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, b, H, nparams);
+}
+
+
+/**
+ *
+ *  Dispatch of robust_accumulate to the version for
+ *  the robust function chosen at run time
+ *
+ */
+template<int nparams>
+void robust_accumulate
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //output Hessian matrix
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  switch(type)
+  {
+    case QUADRATIC:
+      robust_accumulate<nparams, Quadratic>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_accumulate<nparams, TruncatedQuadratic>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_accumulate<nparams, GemanMcClure>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+    case LORENTZIAN:
+      robust_accumulate<nparams, Lorentzian>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+    case CHARBONNIER:
+      robust_accumulate<nparams, Charbonnier>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_accumulate<nparams, CharbonnierFast>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, partials, nthreads, nx, ny,
+        nz
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Dispatch of robust_accumulate to the version for
+ *  the transform chosen at run time
+ *
+ */
+void robust_accumulate
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //output Hessian matrix
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_accumulate<TRANSLATION_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, type, partials, nthreads,
+        nx, ny, nz
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_accumulate<EUCLIDEAN_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, type, partials, nthreads,
+        nx, ny, nz
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_accumulate<SIMILARITY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, type, partials, nthreads,
+        nx, ny, nz
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_accumulate<AFFINITY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, type, partials, nthreads,
+        nx, ny, nz
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_accumulate<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, lambda, type, partials, nthreads,
+        nx, ny, nz
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Version of robust_accumulate that keeps the Hessian across iterations.
+ *  rho0 holds the weights of the pixels with which H was built. If
+ *  rebuild is set, H is computed from scratch and its weights are stored
+ *  in rho0. Otherwise, b is computed with the new weights and H is updated
+ *  only with the pixels whose weights changed, with rank-one updates, if
+ *  the weights are binary (truncated quadratic), or kept as it is for the
+ *  smooth robust functions
+ *
+ */
+template<int nparams, class Robust>
+void robust_update
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //Hessian matrix, updated with the new weights
+  double *rho0,  //weights of the Hessian, updated with the new weights
+  double lambda, //threshold used in the robust functions
+  bool rebuild,  //compute the Hessian from scratch
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  int N=x.empty()?nx*ny:x.size();
+  int P=SD_BLOCK/nz; //number of pixels of a tile
+  double lambda2=lambda*lambda;
+  bool hessian=rebuild || Robust::binary;
+
+  //matrix of the transform, built once for all the pixels
+  double m[9];
+  params2matrix(p, m, nparams);
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
+  {
+    double xw[SD_BLOCK], yw[SD_BLOCK], DI[SD_BLOCK], rho[SD_BLOCK];
+    double w[SD_BLOCK];
+    double Dt[MAX_NPARAMS*SD_BLOCK], Dc[MAX_NPARAMS*SD_BLOCK];
+    double *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    double *Hp=bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=P)
+    {
+      int np=(N-t<P)?N-t:P;
+
+      //warp the tile: I2(x'(x;p))
+      warp_tile<nparams>(I2, x, p, m, xw, yw, DI, t, np, nx, ny, nz);
+
+      //difference of every channel
+      for(int n=0; n<np; n++)
+      {
+        int q=x.empty()?t+n:x[t+n];
+        double norm=0.0;
+        for(int c=0; c<nz; c++)
+        {
+          DI[n*nz+c]-=I1[q*nz+c];
+          norm+=DI[n*nz+c]*DI[n*nz+c];
+        }
+        w[n]=norm;
+      }
+
+      //the robust weight is shared by the channels of the pixel
+      robust_weights<Robust>(w, w, np, lambda2);
+      for(int n=0; n<np; n++)
+        for(int c=0; c<nz; c++)
+          rho[n*nz+c]=w[n];
+
+      int stride, start;
+      double *D=steepest_descent_tile<nparams>(
+        DIJ, Ix, Iy, x, Dt, nx, ny, nz, t, np, stride, start
+      );
+
+      if(rebuild)
+      {
+        //independent vector and Hessian with the weights of the tile
+        sd_accumulate_tile<nparams>(
+          D, DI, rho, bt, Hp, stride, start, np*nz
+        );
+        for(int n=0; n<np; n++)
+          rho0[t+n]=w[n];
+      }
+      else
+      {
+        sd_accumulate_tile<nparams>(
+          D, DI, rho, bt, NULL, stride, start, np*nz
+        );
+
+        if(Robust::binary)
+        {
+          //gather the channels of the pixels that flipped, weighted by the
+          //change (+1 or -1), reusing xw for the weights
+          int nc=0;
+          for(int n=0; n<np; n++)
+            if(w[n]!=rho0[t+n])
+            {
+              for(int c=0; c<nz; c++)
+              {
+                for(int k=0; k<nparams; k++)
+                  Dc[k*SD_BLOCK+nc]=D[k*stride+start+n*nz+c];
+                xw[nc++]=w[n]-rho0[t+n];
+              }
+              rho0[t+n]=w[n];
+            }
+
+          if(nc>0)
+            sd_accumulate_tile<nparams>(
+              Dc, NULL, xw, NULL, Hp, SD_BLOCK, 0, nc
+            );
+        }
+      }
+    }
+  }
+
+  double dH[MAX_NPARAMS*MAX_NPARAMS];
+  sd_partials_reduce(partials, nthreads, b, hessian?dH:NULL, nparams);
+
+  if(rebuild)
+    for(int i=0; i<nparams*nparams; i++) H[i]=dH[i];
+  else if(Robust::binary)
+    for(int i=0; i<nparams*nparams; i++) H[i]+=dH[i];
+}
+
+
+/**
+ *
+ *  Dispatch of robust_update to the version for
+ *  the robust function chosen at run time
+ *
+ */
+template<int nparams>
+void robust_update
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //Hessian matrix, updated with the new weights
+  double *rho0,  //weights of the Hessian, updated with the new weights
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  bool rebuild,  //compute the Hessian from scratch
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  switch(type)
+  {
+    case QUADRATIC:
+      robust_update<nparams, Quadratic>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_update<nparams, TruncatedQuadratic>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_update<nparams, GemanMcClure>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+    case LORENTZIAN:
+      robust_update<nparams, Lorentzian>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+    case CHARBONNIER:
+      robust_update<nparams, Charbonnier>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_update<nparams, CharbonnierFast>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny, nz
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Dispatch of robust_update to the version for
+ *  the transform chosen at run time
+ *
+ */
+void robust_update
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //Hessian matrix, updated with the new weights
+  double *rho0,  //weights of the Hessian, updated with the new weights
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  bool rebuild,  //compute the Hessian from scratch
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz         //number of channels
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_update<TRANSLATION_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, type, rebuild,
+        partials, nthreads, nx, ny, nz
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_update<EUCLIDEAN_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, type, rebuild,
+        partials, nthreads, nx, ny, nz
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_update<SIMILARITY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, type, rebuild,
+        partials, nthreads, nx, ny, nz
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_update<AFFINITY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, type, rebuild,
+        partials, nthreads, nx, ny, nz
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_update<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, x, DIJ, Ix, Iy, p, b, H, rho0, lambda, type, rebuild,
+        partials, nthreads, nx, ny, nz
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Function to solve for dp
+ *  
+ */
+double parametric_solve
+(
+  double *H_1, //inverse Hessian
+  double *b,   //independent vector
+  double *dp,  //output parameters increment 
+  int nparams  //number of parameters
+)
+{
+  double error=0.0;
+  Axb(H_1, b, dp, nparams);
+  for(int i=0; i<nparams; i++) error+=dp[i]*dp[i];
+  return sqrt(error);
+}
+
+
+/**
+ *
+ *  Number of pixels used for a subset parameter: a fraction of the N
+ *  pixels, if it is in (0,1], or a number of pixels, if it is greater.
+ *  At least SUBSET_MIN_PIXELS pixels are used, if the image has them
+ *
+ */
+int subset_size(
+  double subset, //fraction or number of pixels
+  int N          //number of pixels of the image
+)
+{
+  int K=(subset>1)?(int)subset:(int)(subset*N+0.5);
+  if(subset<=0 || K>N) K=N;
+
+  //the coarse scales keep enough pixels to estimate the transform
+  if(K<SUBSET_MIN_PIXELS) K=(N<SUBSET_MIN_PIXELS)?N:SUBSET_MIN_PIXELS;
+  return K;
+}
+
+
+/**
+ *
+ *  Function to select the K pixels with the largest gradient, Ix²+Iy²
+ *  summed over the channels. The norm of the steepest descent images is
+ *  not used because the Jacobian grows with the coordinates, which would
+ *  take the pixels of one corner only. The threshold is found with a
+ *  partial selection, in linear time, and the pixels are stored in x in
+ *  the order of the image
+ *
+ */
+void select_pixels(
+  double *Ix,    //x derivate of the image
+  double *Iy,    //y derivate of the image
+  double *score, //buffer for the magnitude of each pixel
+  double *tmp,   //buffer for the partial selection
+  vector<int> &x, //output selected pixels
+  int K,         //number of pixels to select
+  int nx,        //number of columns
+  int ny,        //number of rows
+  int nz,        //number of channels
+  int verbose    //enable verbose mode
+)
+{
+  int N=nx*ny;
+
+  //magnitude of the gradient of each pixel
+  for(int q=0; q<N; q++)
+  {
+    double s=0.0;
+    for(int c=0; c<nz; c++)
+      s+=Ix[q*nz+c]*Ix[q*nz+c]+Iy[q*nz+c]*Iy[q*nz+c];
+    score[q]=tmp[q]=s;
+  }
+
+  //the K largest values are placed after the threshold
+  nth_element(tmp, tmp+N-K, tmp+N);
+  double threshold=tmp[N-K];
+
+  //the pixels equal to the threshold are taken until there are K
+  int ties=K;
+  for(int q=N-K; q<N; q++)
+    if(tmp[q]>threshold) ties--;
+
+  x.clear();
+  for(int q=0; q<N; q++)
+    if(score[q]>threshold || (score[q]==threshold && ties-->0))
+      x.push_back(q);
+
+  if(verbose)
+    printf("Number of selected pixels: %ld of %d\n", x.size(), N);
+}
+
+/**
+ *
+ *  Function to draw a stratified random sample of K of the N pixels used:
+ *  the pixels are split in K strata of consecutive positions and one is
+ *  drawn from each stratum, so that the sample covers the image evenly
+ *  and it is stored in the order of the image
+ *
+ */
+void sample_pixels(
+  const vector<int> &x, //selected pixels, empty if all are used
+  vector<int> &xs,      //output drawn pixels
+  int K,                //number of pixels to draw
+  int N,                //number of pixels used
+  mt19937 &rng          //random number generator
+)
+{
+  xs.clear();
+  for(int k=0; k<K; k++)
+  {
+    int begin=(int)((long)k*N/K);
+    int end  =(int)((long)(k+1)*N/K);
+    int q=begin+rng()%(end-begin);
+    xs.push_back(x.empty()?q:x[q]);
+  }
+}
+
+
+/**
+ *
+ *  Number of pixels drawn in the next iteration of the stochastic mode.
+ *  It grows towards the N pixels as |Dp| approaches TOL, when the steps
+ *  become comparable to the error of the sample. It is also doubled when
+ *  |Dp| stalls, not falling below BATCH_STALL times the previous one,
+ *  since the steps are then dominated by the error of the sample, and
+ *  when the doublings left to reach N would not fit in MAX_ITER
+ *
+ */
+int batch_size(
+  int K,         //number of pixels drawn in this iteration
+  int K0,        //number of pixels drawn in the first iteration
+  int N,         //number of pixels used
+  double error,  //|Dp| of this iteration
+  double error0, //|Dp| of the previous iteration
+  double TOL,    //tolerance used for the convergence
+  int niter      //number of this iteration, from 0
+)
+{
+  double target=(error<=TOL)?N:K0+(N-K0)*TOL/error;
+
+  int doublings=0;
+  for(long k=K; k<N; k*=2) doublings++;
+  if(error>BATCH_STALL*error0 || niter+doublings>=MAX_ITER-1)
+    target=max(target, 2.*K);
+
+  if(target>K) K=(target<N)?(int)target:N;
+  return K;
+}
+
+
+/**
+ *
+ *  Function to compact the active pixels: the pixels whose weight is
+ *  below ACTIVE_WEIGHT times the weight of a zero difference, mostly
+ *  occlusions, are dropped, since they do not contribute to b and H. It
+ *  returns false if less than ACTIVE_MIN_DROP of the pixels are dropped,
+ *  since the steepest descent images of the active pixels are computed
+ *  on the fly, and that would cost more than the pixels saved
+ *
+ */
+template<class Robust>
+bool compact_active(
+  const vector<int> &x, //selected pixels, empty if all are used
+  vector<int> &xa,      //output active pixels
+  double *rho,          //weights of the pixels, in the order of x
+  double lambda,        //threshold used in the robust functions
+  int N                 //number of pixels used
+)
+{
+  double w=ACTIVE_WEIGHT*Robust::weight(0, lambda*lambda);
+
+  xa.clear();
+  for(int n=0; n<N; n++)
+    if(rho[n]>=w)
+      xa.push_back(x.empty()?n:x[n]);
+
+  return N-(int)xa.size()>=ACTIVE_MIN_DROP*N;
+}
+
+
+
+/**
+  *
+  *  Function to compute the data of the first image that does not depend
+  *  on the second image: the gradient, with a replicated border, the N
+  *  pixels with the largest gradient, if not all are used, the steepest
+  *  descent images, unless DIJ is NULL, and the inverse Hessian of the
+  *  quadratic version, unless H_1 is NULL
+  *
+**/
+template<int nparams>
+void template_data(
+  double *I1,     //first image
+  double *Ix,     //output x derivate of the image
+  double *Iy,     //output y derivate of the image
+  double *DIJ,    //output steepest descent images, or NULL
+  vector<int> &x, //output selected pixels, empty if all are used
+  double *H_1,    //output inverse Hessian, or NULL
+  int N,          //number of pixels used
+  int nx,         //number of columns of the image
+  int ny,         //number of rows of the image
+  int nz,         //number of channels of the image
+  int verbose,    //enable verbose mode
+  IcaWorkspace *ws //buffers of the padded image and the partial sums
+)
+{
+  //Evaluate the gradient of I1, with a replicated border
+  gradient(pad_image(I1, ws->Ip, nx, ny, nz), Ix, Iy, nx, ny, nz);
+
+  //Select the pixels with the largest steepest descent images
+  x.clear();
+  if(N<nx*ny)
+    select_pixels(Ix, Iy, ws->DI, ws->Iw, x, N, nx, ny, nz, verbose);
+
+  //Compute the steepest descent images, unless they are computed on the fly
+  if(DIJ!=NULL)
+    steepest_descent_images<nparams>(Ix, Iy, DIJ, x, nx, ny, nz);
+
+  //Compute the Hessian matrix and its inverse
+  if(H_1!=NULL)
+  {
+    double H[MAX_NPARAMS*MAX_NPARAMS];
+    quadratic_accumulate<nparams>(
+      DIJ, Ix, Iy, x, NULL, NULL, H, ws->partials, ws->nthreads,
+      nx, ny, nz
+    );
     inverse_hessian(H, H_1, nparams);
+  }
+}
+
+
+/**
+  *
+  *  Inverse compositional algorithm
+  *  Quadratic version - L2 norm
+  * 
+  *
+**/
+template<int nparams>
+void inverse_compositional_algorithm(
+  double *I1,   //first image
+  double *I2,   //second image
+  double *p,    //parameters of the transform (output)
+  int nx,       //number of columns of the image
+  int ny,       //number of rows of the image
+  int nz,       //number of channels of the images
+  double TOL,   //Tolerance used for the convergence in the iterations
+  bool matrix_free, //compute the steepest descent images on the fly
+  double subset, //fraction or number of pixels used, 1 for all
+  double batch,  //fraction or number of pixels drawn per iteration
+  int verbose,  //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
+)
+{
+  int size1=nx*ny*nz; //size of the image with channels
+  int N=subset_size(subset, nx*ny); //number of pixels used
+  int K=subset_size(batch, N); //number of pixels drawn per iteration
+  int K0=K;
+  mt19937 rng; //random numbers of the stochastic mode
+
+  //the steepest descent images of the drawn pixels are computed on the fly
+  bool stochastic=(K<N);
+  if(stochastic) matrix_free=true;
+
+  //use a temporary workspace if none is given
+  IcaWorkspace tmp;
+  workspace_init(tmp);
+  if(ws==NULL) ws=&tmp;
+
+  //the selected pixels, if not all are used, and the drawn pixels
+  vector<int> &xs=ws->xs;
+  xs.clear();
+  if(N<nx*ny && tpl==NULL) ws->x.reserve(N);
+  if(stochastic) xs.reserve(N);
+  workspace_reserve(
+    *ws, size1, (matrix_free || tpl!=NULL)?0:nparams*sd_stride(N*nz)
+  );
+  workspace_reserve_padded(*ws, nx, ny, nz);
+  
+  double *Ix =ws->Ix; //x derivate of the first image
+  double *Iy =ws->Iy; //y derivate of the first image
+  double *Iw =ws->Iw; //warp of the second image/
+  double *DI =ws->DI; //error image (I2(w)-I1)
+  double *DIJ=matrix_free?NULL:ws->DIJ; //steepest descent images
+  double dp[MAX_NPARAMS];  //incremental solution
+  double b[MAX_NPARAMS];   //steepest descent images
+  double H[MAX_NPARAMS*MAX_NPARAMS];   //Hessian matrix
+  double H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian matrix
+
+  //Compute the gradient of I1, the selected pixels, the steepest descent
+  //images and the inverse Hessian, unless it changes with the drawn
+  //pixels, or take them from the precomputed data
+  if(tpl==NULL)
+    template_data<nparams>(
+      I1, Ix, Iy, DIJ, ws->x, stochastic?NULL:H_1, N, nx, ny, nz,
+      verbose, ws
+    );
+  else
+  {
+    Ix =tpl->Ix;
+    Iy =tpl->Iy;
+    DIJ=tpl->DIJ;
+    if(!stochastic)
+      for(int i=0; i<nparams*nparams; i++)
+        H_1[i]=tpl->H_1[i];
+  }
+  const vector<int> &x=(tpl==NULL)?ws->x:tpl->x;
+
+  //I2 is warped with its border replicated
+  double *I2p=pad_image(I2, ws->Ip, nx, ny, nz);
+
+  //Iterate
+  double error=1E10, error0=1E10; //|Dp| of this and the last iteration
+  int niter=0;
+  
+  do{     
+    //Draw the pixels of this iteration in the stochastic mode
+    stochastic=(K<N);
+    if(stochastic)
+      sample_pixels(x, xs, K, N, rng);
+    const vector<int> &xi=stochastic?xs:x;
+
+    //Warp image I2 and compute the error image (I1-I2w)
+    if(xi.empty())
+    {
+      bicubic_interpolation<nparams>(I2p, Iw, p, nx, ny, nz);
+      difference_image(I1, Iw, DI, nx, ny, nz);
+    }
+    else
+      difference_selected<nparams>(I1, I2p, xi, p, DI, nx, ny, nz);
+
+    //Compute the independent vector, and the Hessian of the drawn pixels
+    quadratic_accumulate<nparams>(
+      DIJ, Ix, Iy, xi, DI, b, stochastic?H:NULL, ws->partials,
+      ws->nthreads, nx, ny, nz
+    );
+    if(stochastic)
+      inverse_hessian(H, H_1, nparams);
+
+    //Solve equation and compute increment of the motion 
+    error=parametric_solve(H_1, b, dp, nparams);
+
+    //Update the warp x'(x;p) := x'(x;p) * x'(x;dp)^-1
+    update_transform(p, dp, nparams);
+
+    if(verbose)
+    {
+      if(stochastic) printf("Drawn pixels: %d of %d, ", K, N);
+      printf("|Dp|=%f: p=(",error);
+      for(int i=0;i<nparams-1;i++)
+        printf("%f ",p[i]);
+      printf("%f)\n",p[nparams-1]);
+    }
+
+    //Grow the sample and use the Hessian of all the pixels at the end
+    if(stochastic)
+    {
+      K=batch_size(K, K0, N, error, error0, TOL, niter);
+      error0=error;
+      if(K==N)
+      {
+        quadratic_accumulate<nparams>(
+          DIJ, Ix, Iy, x, NULL, NULL, H, ws->partials, ws->nthreads,
+          nx, ny, nz
+        );
+        inverse_hessian(H, H_1, nparams);
+      }
+    }
+    niter++;    
+  }
+  while((error>TOL || stochastic) && niter<MAX_ITER);
+  
+  //delete the temporary workspace
+  workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void inverse_compositional_algorithm(
+  double *I1,   //first image
+  double *I2,   //second image
+  double *p,    //parameters of the transform (output)
+  int nparams,  //number of parameters of the transform
+  int nx,       //number of columns of the image
+  int ny,       //number of rows of the image
+  int nz,       //number of channels of the images
+  double TOL,   //Tolerance used for the convergence in the iterations
+  bool matrix_free, //compute the steepest descent images on the fly
+  double subset, //fraction or number of pixels used, 1 for all
+  double batch,  //fraction or number of pixels drawn per iteration
+  int verbose,  //enable verbose mode
+  IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, matrix_free, subset, batch, verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, matrix_free, subset, batch, verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, matrix_free, subset, batch, verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, matrix_free, subset, batch, verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, matrix_free, subset, batch, verbose, ws
+      );
+      break;
+  }
+}
+
+
+
+/**
+  *
+  *  Inverse compositional algorithm 
+  *  Version with robust error functions
+  * 
+**/
+template<int nparams, class Robust>
+void robust_inverse_compositional_algorithm(
+  double *I1,    //first image
+  double *I2,    //second image
+  double *p,     //parameters of the transform (output)
+  int nx,        //number of columns of the image
+  int ny,        //number of rows of the image
+  int nz,        //number of channels of the images
+  double TOL,    //Tolerance used for the convergence in the iterations
+  double lambda, //parameter of robust error function
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int active_check,  //iterations between full checks of the outliers
+  double subset, //fraction or number of pixels used, 1 for all
+  double batch,  //fraction or number of pixels drawn per iteration
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
+)
+{
+  int size1=nx*ny*nz; //size of the image with channels
+  int N=subset_size(subset, nx*ny); //number of pixels used
+  int K=subset_size(batch, N); //number of pixels drawn per iteration
+  int K0=K;
+  mt19937 rng; //random numbers of the stochastic mode
+
+  //the steepest descent images of the drawn pixels are computed on the fly
+  bool stochastic=(K<N);
+  if(stochastic) matrix_free=true;
+
+  //use a temporary workspace if none is given
+  IcaWorkspace tmp;
+  workspace_init(tmp);
+  if(ws==NULL) ws=&tmp;
+
+  //the selected pixels, if not all are used, the drawn pixels and the
+  //active pixels
+  vector<int> &xs=ws->xs;
+  vector<int> &xa=ws->xa;
+  xs.clear();
+  xa.clear();
+  if(N<nx*ny && tpl==NULL) ws->x.reserve(N);
+  if(stochastic) xs.reserve(N);
+  if(active_check>0) xa.reserve(N);
+  workspace_reserve(
+    *ws, size1, (matrix_free || tpl!=NULL)?0:nparams*sd_stride(N*nz)
+  );
+  workspace_reserve_padded(*ws, nx, ny, nz);
+  
+  double *Ix =ws->Ix; //x derivate of the first image
+  double *Iy =ws->Iy; //y derivate of the first image
+  double *DIJ=matrix_free?NULL:ws->DIJ; //steepest descent images
+  double dp[MAX_NPARAMS];  //incremental solution
+  double b[MAX_NPARAMS];   //steepest descent images
+  double H[MAX_NPARAMS*MAX_NPARAMS];   //Hessian matrix
+  double H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian matrix
+
+  //Compute the gradient of I1, the selected pixels and the steepest
+  //descent images, or take them from the precomputed data. The Hessian
+  //depends on the weights of the robust function
+  if(tpl==NULL)
+    template_data<nparams>(
+      I1, Ix, Iy, DIJ, ws->x, NULL, N, nx, ny, nz, verbose, ws
+    );
+  else
+  {
+    Ix =tpl->Ix;
+    Iy =tpl->Iy;
+    DIJ=tpl->DIJ;
+  }
+  const vector<int> &x=(tpl==NULL)?ws->x:tpl->x;
+
+  //I2 is warped with its border replicated
+  double *I2p=pad_image(I2, ws->Ip, nx, ny, nz);
+  
+  //Iterate
+  double error=1E10, error0=1E10; //|Dp| of this and the last iteration
+  int niter=0, nfull=0, nannealed=0;
+  bool active=false;
+  double lambda_it;
+  
+  if(lambda>0) lambda_it=lambda;
+  else lambda_it=LAMBDA_0;
+  
+  do{     
+    //Draw the pixels of this iteration in the stochastic mode
+    stochastic=(K<N);
+    if(stochastic)
+      sample_pixels(x, xs, K, N, rng);
+
+    //Once the threshold is annealed, all the pixels are checked every
+    //active_check iterations and only the active ones are used in between
+    bool check=false;
+    if(!stochastic && active_check>0 && (lambda>0 || lambda_it<=LAMBDA_N))
+      check=(nannealed++%active_check==0);
+
+    //Warp image I2 and compute the independent vector and the Hessian
+    //with the robust function in a single pass. If the Hessian is reused,
+    //it is rebuilt every hessian_reuse iterations and updated in between,
+    //once all the pixels are used
+    bool rebuild=(hessian_reuse<=0 || nfull%hessian_reuse==0);
+    if(check)
+    {
+      //the weights of all the pixels are kept to compact the active ones
+      robust_update<nparams, Robust>(
+        I1, I2p, x, DIJ, Ix, Iy, p, b, H, ws->rho, lambda_it, true,
+        ws->partials, ws->nthreads, nx, ny, nz
+      );
+      active=compact_active<Robust>(x, xa, ws->rho, lambda_it, N);
+    }
+    else if(active)
+      robust_accumulate<nparams, Robust>(
+        I1, I2p, xa, NULL, Ix, Iy, p, b, H, lambda_it,
+        ws->partials, ws->nthreads, nx, ny, nz
+      );
+    else if(hessian_reuse<=0 || stochastic)
+      robust_accumulate<nparams, Robust>(
+        I1, I2p, stochastic?xs:x, DIJ, Ix, Iy, p, b, H, lambda_it,
+        ws->partials, ws->nthreads, nx, ny, nz
+      );
+    else
+      robust_update<nparams, Robust>(
+        I1, I2p, x, DIJ, Ix, Iy, p, b, H, ws->rho, lambda_it, rebuild,
+        ws->partials, ws->nthreads, nx, ny, nz
+      );
+    if(lambda<=0 && lambda_it>LAMBDA_N) 
+    {
+      lambda_it*=LAMBDA_RATIO;
+      if(lambda_it<LAMBDA_N) lambda_it=LAMBDA_N;
+    }
+
+    //Compute the inverse of the Hessian matrix, unless it is kept
+    if(stochastic || check || active || rebuild || Robust::binary)
+      inverse_hessian(H, H_1, nparams);
 
     //Solve equation and compute increment of the motion 
     error=parametric_solve(H_1, b, dp, nparams);
@@ -488,27 +1760,180 @@ void robust_inverse_compositional_algorithm(
 
     if(verbose) 
     {
+      if(stochastic) printf("Drawn pixels: %d of %d, ", K, N);
+      if(active) printf("Active pixels: %ld of %d, ", xa.size(), N);
       printf("|Dp|=%f: p=(",error);
       for(int i=0;i<nparams-1;i++)
         printf("%f ",p[i]);
       printf("%f), lambda=%f\n",p[nparams-1],lambda_it);
     }
+
+    //Grow the sample until all the pixels are used
+    if(stochastic)
+    {
+      K=batch_size(K, K0, N, error, error0, TOL, niter);
+      error0=error;
+    }
+    else nfull++;
     niter++;    
   }
-  while(error>TOL && niter<MAX_ITER);
+  while((error>TOL || stochastic) && niter<MAX_ITER);
   
-  //delete allocated memory
-  delete []DI;
-  delete []Ix;
-  delete []Iy;
-  delete []Iw;
-  delete []DIJ;
-  delete []dp;
-  delete []b;
-  delete []J;
-  delete []H;
-  delete []H_1;
-  delete []rho;
+  //delete the temporary workspace
+  workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of robust_inverse_compositional_algorithm to the version for
+  *  the robust function chosen at run time
+  *
+**/
+template<int nparams>
+void robust_inverse_compositional_algorithm(
+  double *I1,    //first image
+  double *I2,    //second image
+  double *p,     //parameters of the transform (output)
+  int nx,        //number of columns of the image
+  int ny,        //number of rows of the image
+  int nz,        //number of channels of the images
+  double TOL,    //Tolerance used for the convergence in the iterations
+  int    robust, //robust error function
+  double lambda, //parameter of robust error function
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int active_check,  //iterations between full checks of the outliers
+  double subset, //fraction or number of pixels used, 1 for all
+  double batch,  //fraction or number of pixels drawn per iteration
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
+)
+{
+  switch(robust)
+  {
+    case QUADRATIC:
+      robust_inverse_compositional_algorithm<nparams, Quadratic>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_inverse_compositional_algorithm<nparams, TruncatedQuadratic>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_inverse_compositional_algorithm<nparams, GemanMcClure>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+    case LORENTZIAN:
+      robust_inverse_compositional_algorithm<nparams, Lorentzian>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+    case CHARBONNIER:
+      robust_inverse_compositional_algorithm<nparams, Charbonnier>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_inverse_compositional_algorithm<nparams, CharbonnierFast>(
+        I1, I2, p, nx, ny, nz, TOL, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws, tpl
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Dispatch of robust_inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void robust_inverse_compositional_algorithm(
+  double *I1,    //first image
+  double *I2,    //second image
+  double *p,     //parameters of the transform (output)
+  int nparams,   //number of parameters of the transform
+  int nx,        //number of columns of the image
+  int ny,        //number of rows of the image
+  int nz,        //number of channels of the images
+  double TOL,    //Tolerance used for the convergence in the iterations
+  int    robust, //robust error function
+  double lambda, //parameter of robust error function
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int active_check,  //iterations between full checks of the outliers
+  double subset, //fraction or number of pixels used, 1 for all
+  double batch,  //fraction or number of pixels drawn per iteration
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, robust, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, robust, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, robust, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, robust, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, nx, ny, nz, TOL, robust, lambda, matrix_free, hessian_reuse,
+        active_check, subset, batch, verbose, ws
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Coarsest scale at which a motion of residual pixels at the finest
+  *  scale is at most WARM_START_RANGE pixels
+  *
+**/
+static int start_scale(
+  double residual, //motion at the finest scale, in pixels
+  double nu,       //downsampling factor
+  int nscales      //number of scales
+)
+{
+  int s=0;
+  while(s<nscales-1 && residual>WARM_START_RANGE)
+  {
+    residual*=nu;
+    s++;
+  }
+  return s;
 }
 
 
@@ -517,11 +1942,11 @@ void robust_inverse_compositional_algorithm(
   *  Multiscale approach for computing the optical flow
   *
 **/
+template<int nparams>
 void pyramidal_inverse_compositional_algorithm(
     double *I1,     //first image
     double *I2,     //second image
     double *p,      //parameters of the transform
-    int    nparams, //number of parameters
     int    nxx,     //image width
     int    nyy,     //image height
     int    nzz,     //number of color channels in image  
@@ -530,57 +1955,99 @@ void pyramidal_inverse_compositional_algorithm(
     double TOL,     //stopping criterion threshold
     int    robust,  //robust error function
     double lambda,  //parameter of robust error function
-    bool   verbose  //switch on messages
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    active_check,  //iterations between full checks of the outliers
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws, //buffers reused across calls, or NULL
+    double *p0,       //initial transform, or NULL to start from zero
+    double residual,  //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref //precomputed data of I1, or NULL
 )
 {
     int size=nxx*nyy*nzz;
 
-    double **I1s=new double*[nscales];
-    double **I2s=new double*[nscales];
-    double **ps =new double*[nscales];
-
-    int *nx=new int[nscales];
-    int *ny=new int[nscales];
-
-    I1s[0]=new double[size];
-    I2s[0]=new double[size];
-
-    //copy the input images
-    for(int i=0;i<size;i++)
-    {
-      I1s[0][i]=I1[i];
-      I2s[0][i]=I2[i];
-    }
-
+    //use a temporary workspace if none is given
+    IcaWorkspace tmp;
+    workspace_init(tmp);
+    if(ws==NULL) ws=&tmp;
+
+    //with an initial transform, the scales coarser than those needed for
+    //the residual motion are skipped
+    int nlevels=nscales;
+    if(p0!=NULL && residual>=0)
+      nlevels=start_scale(residual, nu, nscales)+1;
+
+    //the stochastic mode computes the steepest descent images on the fly
+    int N=subset_size(subset, nxx*nyy);
+    if(subset_size(batch, N)<N) matrix_free=true;
+
+    //the reference is only used if it was built with the same options
+    if(
+      ref!=NULL && !reference_compatible(
+        *ref, nparams, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch
+      )
+    )
+      ref=NULL;
+
+    //the pyramid of the first image is kept from the last call if it was
+    //rolled, for the same size (see workspace_roll_pyramid)
+    bool rolled=nlevels<=ws->rolled && nxx==ws->nx[0] && nyy==ws->ny[0];
+    ws->rolled=0;
+
+    //size the buffers for the finest scale, so that they do not grow
+    //while going through the scales
+    workspace_reserve_pyramid(*ws, nxx, nyy, nzz, nscales, nu);
+    workspace_reserve(
+      *ws, size, (matrix_free || ref!=NULL)?0:nparams*sd_stride(size)
+    );
+    workspace_reserve_padded(*ws, nxx, nyy, nzz);
+
+    //the pyramid of the first image is that of the reference, if given
+    double **I1s=(ref==NULL)?ws->I1s:ref->I1s;
+    double **I2s=ws->I2s;
+    double **ps =ws->ps;
+
+    int *nx=ws->nx;
+    int *ny=ws->ny;
+
+    //the finest scale uses the input images
+    if(ref==NULL) I1s[0]=I1;
+    I2s[0]=I2;
     ps[0]=p;
-    nx[0]=nxx;
-    ny[0]=nyy;
 
     //initialization of the transformation parameters at the finest scale
     for(int i=0; i<nparams; i++)
-      p[i]=0.0;
+      p[i]=(p0==NULL)?0.0:p0[i];
 
     //create the scales
-    for(int s=1; s<nscales; s++)
+    for(int s=1; s<nlevels; s++)
     {
-      zoom_size(nx[s-1], ny[s-1], nx[s], ny[s], nu);
-
-      const int size=nx[s]*ny[s];
-
-      I1s[s]=new double[size*nzz];
-      I2s[s]=new double[size*nzz];
-      ps[s] =new double[nparams];
-      
-      for(int i=0; i<nparams; i++)
-        ps[s][i]=0.0;
+      //down-project the initial transform, or start from zero
+      if(p0==NULL)
+        for(int i=0; i<nparams; i++)
+          ps[s][i]=0.0;
+      else
+        zoom_out_parameters(
+          ps[s-1], ps[s], nparams, nx[s-1], ny[s-1], nx[s], ny[s]
+        );
 
-      //zoom the images from the previous scale
-      zoom_out(I1s[s-1], I1s[s], nx[s-1], ny[s-1], nzz, nu);
-      zoom_out(I2s[s-1], I2s[s], nx[s-1], ny[s-1], nzz, nu);
+      //zoom the images from the previous scale, or only the second one
+      if(rolled || ref!=NULL)
+        zoom_out(
+          I2s[s-1], NULL, I2s[s], NULL, nx[s-1], ny[s-1], nzz, nu, ws->Is
+        );
+      else
+        zoom_out(
+          I1s[s-1], I2s[s-1], I1s[s], I2s[s], nx[s-1], ny[s-1], nzz, nu, ws->Is
+        );
     }  
+    ws->levels=nlevels;
 
     //pyramidal approach for computing the transformation
-    for(int s=nscales-1; s>=0; s--)
+    for(int s=nlevels-1; s>=0; s--)
     {
       if(verbose) printf("Scale: %d ",s);
 
@@ -589,18 +2056,21 @@ void pyramidal_inverse_compositional_algorithm(
       {
         if(verbose) printf("(L2 norm)\n");
 
-        inverse_compositional_algorithm(
-          I1s[s], I2s[s], ps[s], nparams, nx[s], 
-          ny[s], nzz, TOL, verbose
+        inverse_compositional_algorithm<nparams>(
+          I1s[s], I2s[s], ps[s], nx[s], 
+          ny[s], nzz, TOL, matrix_free, subset, batch, verbose, ws,
+          (ref==NULL)?NULL:&(ref->scales[s])
         );
       }
       else
       {
         if(verbose) printf("(Robust error function %d)\n",robust);
 
-        robust_inverse_compositional_algorithm(
-          I1s[s], I2s[s], ps[s], nparams, nx[s], 
-          ny[s], nzz, TOL, robust, lambda,verbose
+        robust_inverse_compositional_algorithm<nparams>(
+          I1s[s], I2s[s], ps[s], nx[s], 
+          ny[s], nzz, TOL, robust, lambda, matrix_free, hessian_reuse,
+          active_check, subset, batch, verbose, ws,
+          (ref==NULL)?NULL:&(ref->scales[s])
         );
       }
 
@@ -611,18 +2081,258 @@ void pyramidal_inverse_compositional_algorithm(
         );
     }
 
-    //delete allocated memory
-    delete []I1s[0];
-    delete []I2s[0];
-    for(int i=1; i<nscales; i++)
+    //the input images do not belong to the workspace
+    ws->I1s[0]=I2s[0]=ps[0]=NULL;
+
+    //delete the temporary workspace
+    workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of pyramidal_inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void pyramidal_inverse_compositional_algorithm(
+    double *I1,     //first image
+    double *I2,     //second image
+    double *p,      //parameters of the transform
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image  
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    double TOL,     //stopping criterion threshold
+    int    robust,  //robust error function
+    double lambda,  //parameter of robust error function
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    active_check,  //iterations between full checks of the outliers
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws, //buffers reused across calls, or NULL
+    double *p0,       //initial transform, or NULL to start from zero
+    double residual,  //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref //precomputed data of I1, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nzz, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, active_check, subset, batch, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nzz, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, active_check, subset, batch, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nzz, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, active_check, subset, batch, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nzz, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, active_check, subset, batch, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nzz, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, active_check, subset, batch, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Build the pyramid of a reference image and its data at each scale,
+  *  in the same way as the estimation computes them for the first image
+  *
+**/
+template<int nparams>
+void reference_build(
+    IcaReference &ref, //output reference
+    double *I1,     //reference image
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+    int size=nxx*nyy*nzz;
+
+    //use a temporary workspace if none is given
+    IcaWorkspace tmp;
+    workspace_init(tmp);
+    if(ws==NULL) ws=&tmp;
+
+    //the stochastic mode computes the steepest descent images on the fly
+    int N=subset_size(subset, nxx*nyy);
+    if(subset_size(batch, N)<N) matrix_free=true;
+
+    workspace_reserve(*ws, size, 0);
+    workspace_reserve_padded(*ws, nxx, nyy, nzz);
+
+    reference_free(ref);
+    ref.nparams=nparams;
+    ref.nscales=nscales;
+    ref.nu=nu;
+    ref.matrix_free=matrix_free;
+    ref.subset=subset;
+    ref.batch=batch;
+    ref.checksum=reference_checksum(I1, size);
+    ref.I1s=new double*[nscales];
+    ref.nx=new int[nscales];
+    ref.ny=new int[nscales];
+    ref.nz=nzz;
+    ref.scales=new IcaTemplate[nscales];
+
+    //create the scales
+    ref.I1s[0]=I1;
+    ref.nx[0]=nxx;
+    ref.ny[0]=nyy;
+    for(int s=1; s<nscales; s++)
+    {
+      zoom_size(ref.nx[s-1], ref.ny[s-1], ref.nx[s], ref.ny[s], nu);
+      ref.I1s[s]=new double[ref.nx[s]*ref.ny[s]*nzz];
+      zoom_out(
+        ref.I1s[s-1], NULL, ref.I1s[s], NULL, ref.nx[s-1], ref.ny[s-1], nzz,
+        nu, ws->Is
+      );
+    }
+
+    //data of each scale, with the options of each scale of the estimation
+    for(int s=0; s<nscales; s++)
     {
-      delete []I1s[i];
-      delete []I2s[i];
-      delete []ps [i];
+      IcaTemplate &t=ref.scales[s];
+      int size1=ref.nx[s]*ref.ny[s];
+      int Ns=subset_size(subset, size1);
+      bool stochastic=(subset_size(batch, Ns)<Ns);
+
+      if(verbose) printf("Reference scale: %d\n", s);
+
+      t.Ix=new double[size1*nzz];
+      t.Iy=new double[size1*nzz];
+      t.DIJ=(matrix_free || stochastic)?NULL:sd_allocate(nparams, Ns*nzz);
+      if(Ns<size1) t.x.reserve(Ns);
+      template_data<nparams>(
+        ref.I1s[s], t.Ix, t.Iy, t.DIJ, t.x, stochastic?NULL:t.H_1, Ns,
+        ref.nx[s], ref.ny[s], nzz, verbose, ws
+      );
     }
-    delete []I1s;
-    delete []I2s;
-    delete []ps;
-    delete []nx;
-    delete []ny;
+
+    //delete the temporary workspace
+    workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of reference_build to the version for the transform chosen
+  *  at run time
+  *
+**/
+void reference_build(
+    IcaReference &ref, //output reference
+    double *I1,     //reference image
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      reference_build<TRANSLATION_TRANSFORM>(
+        ref, I1, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch,
+        verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      reference_build<EUCLIDEAN_TRANSFORM>(
+        ref, I1, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch,
+        verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      reference_build<SIMILARITY_TRANSFORM>(
+        ref, I1, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch,
+        verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      reference_build<AFFINITY_TRANSFORM>(
+        ref, I1, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch,
+        verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      reference_build<HOMOGRAPHY_TRANSFORM>(
+        ref, I1, nxx, nyy, nzz, nscales, nu, matrix_free, subset, batch,
+        verbose, ws
+      );
+      break;
+  }
+}
+
+/**
+  *
+  *  Check that a reference was built with the options of an estimation,
+  *  so that the estimation can use it
+  *
+**/
+bool reference_compatible(
+    const IcaReference &ref, //reference
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch    //fraction or number of pixels drawn per iteration
+)
+{
+  //the stochastic mode computes the steepest descent images on the fly
+  int N=subset_size(subset, nxx*nyy);
+  if(subset_size(batch, N)<N) matrix_free=true;
+
+  return
+    ref.nparams==nparams && ref.nscales==nscales && ref.nu==nu &&
+    ref.nx[0]==nxx && ref.ny[0]==nyy && ref.nz==nzz &&
+    ref.matrix_free==matrix_free && ref.subset==subset &&
+    ref.batch==batch;
 }
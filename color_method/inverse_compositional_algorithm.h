@@ -25,16 +25,25 @@
   * 
 **/
 
+#include "reference.h"
+#include "workspace.h"
+
 #define QUADRATIC 0
 #define TRUNCATED_QUADRATIC 1
 #define GERMAN_MCCLURE 2
 #define LORENTZIAN 3
 #define CHARBONNIER 4
+#define CHARBONNIER_FAST 5
 
 #define MAX_ITER 30
 #define LAMBDA_0 80
 #define LAMBDA_N 5
 #define LAMBDA_RATIO 0.90
+#define SUBSET_MIN_PIXELS 1024
+#define BATCH_STALL 1.0
+#define ACTIVE_WEIGHT 0.01
+#define ACTIVE_MIN_DROP 0.05
+#define WARM_START_RANGE 2.0
 
 /**
  *
@@ -64,7 +73,11 @@ void inverse_compositional_algorithm(
   int ny,       //number of rows of the image
   int nz,       //number of channels of the images
   double TOL,   //Tolerance used for the convergence in the iterations
-  int verbose=0 //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  double subset=1, //fraction or number of pixels used, 1 for all
+  double batch=0,  //pixels drawn per iteration, 0 to use all of them
+  int verbose=0, //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 
@@ -85,12 +98,23 @@ void robust_inverse_compositional_algorithm(
   double TOL,    //Tolerance used for the convergence in the iterations
   int    robust, //robust error function
   double lambda, //parameter of robust error function
-  int verbose=0  //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  int hessian_reuse=0, //iterations between rebuilds of the robust Hessian
+  int active_check=0,  //iterations between full checks of the outliers
+  double subset=1, //fraction or number of pixels used, 1 for all
+  double batch=0,  //pixels drawn per iteration, 0 to use all of them
+  int verbose=0,  //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 /**
   *
-  *  Multiscale approach for computing the optical flow
+  *  Multiscale approach for computing the optical flow. It starts from
+  *  the initial transform, if it is given, down-projected to the coarsest
+  *  scale at which the residual motion is at most WARM_START_RANGE pixels,
+  *  so that the coarser scales are skipped. With a reference built from I1
+  *  with the same options (see reference_build), its pyramid and data are
+  *  used instead of those of I1, which are not computed
   *
 **/
 void pyramidal_inverse_compositional_algorithm(
@@ -106,7 +130,75 @@ void pyramidal_inverse_compositional_algorithm(
     double TOL,     //stopping criterion threshold
     int    robust,  //robust error function
     double lambda,  //parameter of robust error function
-    bool   verbose  //switch on messages
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    active_check,  //iterations between full checks of the outliers
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL, //buffers reused across calls, or NULL
+    double *p0=NULL, //initial transform, or NULL to start from zero
+    double residual=-1, //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref=NULL //precomputed data of I1, or NULL
+);
+
+
+/**
+ *
+ *  Number of pixels used for a subset parameter: a fraction of the N
+ *  pixels, if it is in (0,1], or a number of pixels, if it is greater.
+ *  At least SUBSET_MIN_PIXELS pixels are used, if the image has them
+ *
+ */
+int subset_size(
+  double subset, //fraction or number of pixels
+  int N          //number of pixels of the image
+);
+
+
+/**
+  *
+  *  Build the pyramid of a reference image and its data at each scale,
+  *  for the options of the estimations that use it. The image is the
+  *  first scale of the reference and it must be kept while it is used.
+  *  The reference is initialized with reference_init and released with
+  *  reference_free
+  *
+**/
+void reference_build(
+    IcaReference &ref, //output reference
+    double *I1,     //reference image
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
+);
+
+
+/**
+  *
+  *  Check that a reference was built with the options of an estimation,
+  *  so that the estimation can use it
+  *
+**/
+bool reference_compatible(
+    const IcaReference &ref, //reference
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nzz,     //number of color channels in image
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch    //fraction or number of pixels drawn per iteration
 );
 
 #endif
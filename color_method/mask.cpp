@@ -8,9 +8,17 @@
 // All rights reserved.
 
 #include "mask.h"
+#include "padded_image.h"
 
 #include <math.h>
 #include <stdio.h>
+#include <vector>
+
+#define GAUSSIAN_BLOCK 64 //number of values convolved at once
+#define GAUSSIAN_ROWS 8   //number of rows filtered at once, recursively
+#define GAUSSIAN_LANES 64 //maximum number of lines filtered at once
+#define GAUSSIAN_PAD 32   //maximum extension of the recursive filter
+#define GAUSSIAN_RECURSIVE_PAD 4 //extension of the recursive filter, in sigmas
 
 
 /**
@@ -158,11 +166,13 @@ mask3x3 (double *input,         //input image
 
 /**
  *
- * Compute the gradient with central differences
+ * Compute the gradient with central differences. The input is a padded
+ * image, whose guard band replicates the border, so the differences at
+ * the border are taken with the same loop
  *
  */
 void
-gradient (double *input,        //input image
+gradient (double *input,        //input image, with a replicated border
           double *dx,           //computed x derivative
           double *dy,           //computed y derivative
           int nx,               //image width
@@ -171,80 +181,66 @@ gradient (double *input,        //input image
   )
 {
   int nx_rgb = nx * nz;
+  int w = (nx + 2 * IMAGE_BORDER) * nz; //width of the rows of the input
 
-  for (int index_color = 0; index_color < nz; index_color++)
+  for (int i = 0; i < ny; i++)
     {
-      //gradient in the center body of the image
-      for (int i = 1; i < ny - 1; i++)
-        {
-          for (int j = 1; j < nx - 1; j++)
-            {
-              int k = (i * nx + j) * nz + index_color;
+      double *r = &(input[i * w]);
 
-              dx[k] = 0.5 * (input[k + nz] - input[k - nz]);
-              dy[k] = 0.5 * (input[k + nx_rgb] - input[k - nx_rgb]);
-            }
-        }
-
-      //gradient in the first and last rows
-      for (int j = 1; j < nx - 1; j++)
+      for (int j = 0; j < nx_rgb; j++)
         {
+          int k = i * nx_rgb + j;
 
-          int index = j * nz + index_color;
-
-          dx[index] = 0.5 * (input[index + nz] - input[index - nz]);
-          dy[index] = 0.5 * (input[index + nx_rgb] - input[index]);
-
-          int k = ((ny - 1) * nx + j) * nz + index_color;
-
-          dx[k] = 0.5 * (input[k + nz] - input[k - nz]);
-          dy[k] = 0.5 * (input[k] - input[k - nx_rgb]);
+          dx[k] = 0.5 * (r[j + nz] - r[j - nz]);
+          dy[k] = 0.5 * (r[j + w] - r[j - w]);
         }
+    }
+}
 
-      //gradient in the first and last columns
-      for (int i = 1; i < ny - 1; i++)
-        {
-
-          int p = (i * nx_rgb) + index_color;
-
-          dx[p] = 0.5 * (input[p + nz] - input[p]);
-          dy[p] = 0.5 * (input[p + nx_rgb] - input[p - nx_rgb]);
-
-          int k = ((i + 1) * nx - 1) * nz + index_color;
 
-          dx[k] = 0.5 * (input[k] - input[k - nz]);
-          dy[k] = 0.5 * (input[k + nx_rgb] - input[k - nx_rgb]);
-        }
+/**
+ *
+ * Coefficients of the normalized 1D Gaussian kernel, from the center to
+ * the border of the window. The table is cached for each thread and only
+ * recomputed when sigma or the precision change, so the pointer is valid
+ * until the next call of the thread with other values
+ *
+ */
+double *
+gaussian_kernel (
+  double sigma, //Gaussian sigma
+  int &size,    //output number of coefficients
+  int precision //defines the size of the window
+)
+{
+  static thread_local std::vector<double> B;
+  static thread_local double last_sigma = -1;
+  static thread_local int last_precision = -1;
 
-      //calculate the gradient in the corners
-      dx[index_color] = 0.5 * (input[index_color + nz] - input[index_color]);
-      dy[index_color] =
-        0.5 * (input[nx_rgb + index_color] - input[index_color]);
+  size = (int) (precision * sigma) + 1;
+  if (sigma == last_sigma && precision == last_precision)
+    return B.data ();
 
-      int corner_up_right = (nx - 1) * nz + index_color;
+  double den = 2 * sigma * sigma;
+  B.resize (size);
+  for (int i = 0; i < size; i++)
+    B[i] = 1 / (sigma * sqrt (2.0 * 3.1415926)) * exp (-i * i / den);
 
-      dx[corner_up_right] =
-        0.5 * (input[corner_up_right] - input[corner_up_right - nz]);
-      dy[corner_up_right] =
-        0.5 * (input[(2 * nx_rgb) + index_color - nz] -
-               input[corner_up_right]);
+  double norm = 0;
 
-      int corner_down_left = ((ny - 1) * nx) * nz + index_color;
+  //normalize the 1D convolution kernel
+  for (int i = 0; i < size; i++)
+    norm += B[i];
 
-      dx[corner_down_left] =
-        0.5 * (input[corner_down_left + nz] - input[corner_down_left]);
-      dy[corner_down_left] =
-        0.5 * (input[corner_down_left] -
-               input[(ny - 2) * nx_rgb + index_color]);
+  norm *= 2;
+  norm -= B[0];
 
-      int corner_down_right = ny * nx_rgb - nz + index_color;
+  for (int i = 0; i < size; i++)
+    B[i] /= norm;
 
-      dx[corner_down_right] =
-        0.5 * (input[corner_down_right] - input[corner_down_right - nz]);
-      dy[corner_down_right] =
-        0.5 * (input[corner_down_right] -
-               input[(ny - 1) * nx_rgb - nz + index_color]);
-    }
+  last_sigma = sigma;
+  last_precision = precision;
+  return B.data ();
 }
 
 
@@ -266,35 +262,19 @@ gaussian (
 {
   int i, j, k;
   
-  double den = 2 * sigma * sigma;
   int size = (int) (precision * sigma) + 1;
   int bdx = xdim + size;
-  int bdy = ydim + size;
   
-  if (bc && size > xdim){
+  if (bc && (size > xdim || size > ydim)){
       printf("GaussianSmooth: sigma too large for this bc\n");
       throw 1;
   }
 
   //compute the coefficients of the 1D convolution kernel
-  double *B = new double[size];
-  for (int i = 0; i < size; i++)
-    B[i] = 1 / (sigma * sqrt (2.0 * 3.1415926)) * exp (-i * i / den);
-
-  double norm = 0;
-
-  //normalize the 1D convolution kernel
-  for (int i = 0; i < size; i++)
-    norm += B[i];
-
-  norm *= 2;
-  norm -= B[0];
-
-  for (int i = 0; i < size; i++)
-    B[i] /= norm;
+  double *B = gaussian_kernel (sigma, size, precision);
   
   double *R = new double[size + xdim + size]; 
-  double *T = new double[size + ydim + size];
+  double *T = new double[(size + ydim + size) * GAUSSIAN_BLOCK];
   
   //Loop for every channel
   for(int index_color = 0; index_color < zdim; index_color++){
@@ -339,48 +319,199 @@ gaussian (
           
         }
     }
+  }
 
-  //convolution of each column of the input image
-  for (k = 0; k < xdim; k++)
+  //convolution of the columns, by blocks of GAUSSIAN_BLOCK values that
+  //are copied with the boundary rows: the rows of a block are contiguous,
+  //so the block is traversed in cache and the taps are vectorised
+  int n = xdim * zdim;
+  for (k = 0; k < n; k += GAUSSIAN_BLOCK)
     {
-      for (i = size; i < bdy; i++)
-        T[i] = I[((i - size) * xdim + k) * zdim + index_color];
+      int w = (n - k < GAUSSIAN_BLOCK) ? n - k : GAUSSIAN_BLOCK;
 
-      switch (bc)
+      for (i = 1; i < size + ydim + size; i++)
         {
-        case 0: // Dirichlet boundary conditions
-          for (i = 0, j = bdy; i < size; i++, j++)
-            T[i] = T[j] = 0;
-          break;
-        case 1: // Reflecting boundary conditions
-          for (i = 0, j = bdy; i < size; i++, j++)
-            {
-              T[i] = I[((size - i) * xdim + k) * zdim + index_color];
-              T[j] = I[((ydim - i - 1) * xdim + k) * zdim + index_color];
-            }
-          break;
-        case 2: // Periodic boundary conditions
-          for (i = 0, j = bdx; i < size; i++, j++)
-            {
-              T[i] = I[((ydim - size + i) * xdim + k) * zdim + index_color];
-              T[j] = I[(i * xdim + k) * zdim + index_color];
-            }
-          break;
+          double *t = &T[i * w];
+          int r = i - size;
+
+          if (r < 0 || r >= ydim)
+            switch (bc)
+              {
+              case 0: // Dirichlet boundary conditions
+                for (j = 0; j < w; j++)
+                  t[j] = 0;
+                continue;
+              case 1: // Reflecting boundary conditions
+                r = (r < 0) ? -r : 2 * ydim - 1 - r;
+                break;
+              case 2: // Periodic boundary conditions
+                r = (r < 0) ? ydim + r : r - ydim;
+                break;
+              }
+
+          for (j = 0; j < w; j++)
+            t[j] = I[r * n + k + j];
         }
 
-      for (i = size; i < bdy; i++)
+      for (i = 0; i < ydim; i++)
         {
-          double sum = B[0] * T[i];
+          double *t = &T[(i + size) * w];
+          double *out = &I[i * n + k];
 
-          for (j = 1; j < size; j++)
-            sum += B[j] * (T[i - j] + T[i + j]);
+          for (int c = 0; c < w; c++)
+            out[c] = B[0] * t[c];
 
-          I[((i - size) * xdim + k) * zdim + index_color] = sum;
+          for (j = 1; j < size; j++)
+            {
+              double *tm = t - j * w;
+              double *tp = t + j * w;
+              for (int c = 0; c < w; c++)
+                out[c] += B[j] * (tm[c] + tp[c]);
+            }
         }
     }
-  }
   
-  delete[]B;
   delete[]R;
   delete[]T;
 }
+
+
+/**
+ *
+ * Coefficients of the recursive Gaussian of Young and van Vliet:
+ * w[n] = b * in[n] + a[0] * w[n-1] + a[1] * w[n-2] + a[2] * w[n-3]
+ *
+ */
+static double
+recursive_coefficients (
+  double sigma, //Gaussian sigma
+  double *a     //output feedback coefficients
+)
+{
+  double q;
+  if (sigma >= 2.5)
+    q = 0.98711 * sigma - 0.96330;
+  else
+    q = 3.97156 - 4.14554 * sqrt (1.0 - 0.26891 * sigma);
+
+  double q2 = q * q, q3 = q2 * q;
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+
+  a[0] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  a[1] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  a[2] = 0.422205 * q3 / b0;
+  return 1.0 - (a[0] + a[1] + a[2]);
+}
+
+
+/**
+ *
+ * Recursive Gaussian of a set of lines, processed together since their
+ * recursions are independent. The recursions start from a reflected
+ * extension of pad values at both ends, as in the reflecting boundary
+ * condition of gaussian
+ *
+ */
+static void
+recursive_lines (
+  double *I,     //first value of the first line
+  int n,         //number of values of each line
+  int step,      //distance between the values of a line
+  int lanes,     //number of lines, at most GAUSSIAN_LANES
+  int lane_step, //distance between the lines
+  double b,      //gain of the filter
+  double *a,     //feedback coefficients of the filter
+  int pad        //size of the extensions, at most GAUSSIAN_PAD
+)
+{
+  double w1[GAUSSIAN_LANES], w2[GAUSSIAN_LANES], w3[GAUSSIAN_LANES];
+  double ext[GAUSSIAN_PAD][GAUSSIAN_LANES];
+  int l;
+
+  if (n < 2)
+    return;
+  if (pad > n - 1)
+    pad = n - 1;
+
+  //save the values of the right extension
+  for (int i = 0; i < pad; i++)
+    for (l = 0; l < lanes; l++)
+      ext[i][l] = I[(n - 1 - i) * step + l * lane_step];
+
+  //causal filter, from the left extension
+  for (l = 0; l < lanes; l++)
+    w1[l] = w2[l] = w3[l] = I[pad * step + l * lane_step];
+  for (int i = -pad + 1; i < n + pad; i++)
+    {
+      double *x = (i < 0) ? &I[-i * step] : &I[i * step];
+      if (i >= n)
+        x = ext[i - n];
+      int ls = (i >= n) ? 1 : lane_step;
+
+      for (l = 0; l < lanes; l++)
+        {
+          double w = b * x[l * ls] + a[0] * w1[l] + a[1] * w2[l]
+            + a[2] * w3[l];
+          w3[l] = w2[l]; w2[l] = w1[l]; w1[l] = w;
+          if (i >= 0)
+            x[l * ls] = w;
+        }
+    }
+
+  //anti-causal filter, from the right extension
+  for (l = 0; l < lanes; l++)
+    w1[l] = w2[l] = w3[l] = ext[pad - 1][l];
+  for (int i = n + pad - 2; i >= 0; i--)
+    {
+      double *x = (i >= n) ? ext[i - n] : &I[i * step];
+      int ls = (i >= n) ? 1 : lane_step;
+
+      for (l = 0; l < lanes; l++)
+        {
+          double w = b * x[l * ls] + a[0] * w1[l] + a[1] * w2[l]
+            + a[2] * w3[l];
+          w3[l] = w2[l]; w2[l] = w1[l]; w1[l] = w;
+          x[l * ls] = w;
+        }
+    }
+}
+
+
+/**
+ *
+ * Convolution with a Gaussian with the recursive filter of Young and van
+ * Vliet, whose cost does not depend on sigma. It is applied forward and
+ * backward along the rows and the columns, with reflecting boundary
+ * conditions. The channels of each row are filtered together, and the
+ * columns by blocks, row by row, so the image is traversed contiguously
+ *
+ */
+void
+gaussian_recursive (
+  double *I,    //input/output image
+  int xdim,     //image width
+  int ydim,     //image height
+  int zdim,     //number of color channels in the image, at most 64
+  double sigma  //Gaussian sigma, at least 0.5
+)
+{
+  double a[3];
+  double b = recursive_coefficients (sigma, a);
+  int pad = (int) (GAUSSIAN_RECURSIVE_PAD * sigma) + 1;
+  if (pad > GAUSSIAN_PAD)
+    pad = GAUSSIAN_PAD;
+
+  //filter the rows
+  int n = xdim * zdim;
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < ydim; k++)
+    recursive_lines (&I[k * n], xdim, zdim, zdim, 1, b, a, pad);
+
+  //filter the columns
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < n; k += GAUSSIAN_LANES)
+    {
+      int w = (n - k < GAUSSIAN_LANES) ? n - k : GAUSSIAN_LANES;
+      recursive_lines (&I[k], ydim, n, w, 1, b, a, pad);
+    }
+}
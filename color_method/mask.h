@@ -27,11 +27,11 @@ void mask3x3(
 
 /**
  *
- * Compute the gradient with central differences
+ * Compute the gradient with central differences of a padded image
  *
  */
 void gradient(
-  double *input,  //input image
+  double *input,  //input image, with a replicated border
   double *dx,     //computed x derivative
   double *dy,     //computed y derivative
   int nx,         //image width
@@ -40,6 +40,21 @@ void gradient(
 );
 
 
+/**
+ *
+ * Coefficients of the normalized 1D Gaussian kernel, from the center to
+ * the border of the window. The table is cached for each thread, so the
+ * pointer is valid until the next call of the thread with other values
+ *
+ */
+double *
+gaussian_kernel (
+  double sigma,     //Gaussian sigma
+  int &size,        //output number of coefficients
+  int precision = 5 //defines the size of the window
+);
+
+
 /**
  *
  * Convolution with a Gaussian
@@ -56,4 +71,21 @@ gaussian (
   int precision = 5 //defines the size of the window
 );
 
+
+/**
+ *
+ * Convolution with a Gaussian with the recursive filter of Young and van
+ * Vliet, whose cost does not depend on sigma, with reflecting boundary
+ * conditions
+ *
+ */
+void
+gaussian_recursive (
+  double *I,    //input/output image
+  int xdim,     //image width
+  int ydim,     //image height
+  int zdim,     //number of color channels in the image, at most 64
+  double sigma  //Gaussian sigma, at least 0.5
+);
+
 #endif
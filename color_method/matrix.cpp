@@ -70,7 +70,9 @@ int inverse(
   int N        //matrix dimension
 ) 
 {
-  double *PASO=new double[2*N*N];
+  //small matrices, as the Hessians, use a buffer in the stack
+  double buffer[2*INVERSE_STACK_SIZE*INVERSE_STACK_SIZE];
+  double *PASO=(N<=INVERSE_STACK_SIZE)?buffer:new double[2*N*N];
 
   double max,paso,mul;
   int i,j,i_max,k;
@@ -94,7 +96,7 @@ int inverse(
     }
 
     if(max<10e-30){ 
-      delete []PASO;
+      if(PASO!=buffer) delete []PASO;
       return -1;
     }
     if(i_max>i){
@@ -112,7 +114,7 @@ int inverse(
   }
   
   if(fabs(PASO[(N-1)*2*N+N-1])<10e-30){ 
-      delete []PASO;
+      if(PASO!=buffer) delete []PASO;
       return -1;
   }
       
@@ -130,7 +132,7 @@ int inverse(
     for(j=0;j<N;j++)
       A_1[i*N+j]=PASO[i*2*N+j+N];
 
-  delete []PASO;
+  if(PASO!=buffer) delete []PASO;
   
   return 0;   
 }
@@ -13,6 +13,7 @@
 #include "bicubic_interpolation.h"
 #include "file.h"
 #include "inverse_compositional_algorithm.h"
+#include "padded_image.h"
 #include "transformation.h"
 
 
@@ -73,7 +74,9 @@ void print_output(
   double *Iw=new double[nx*ny*nz];
   double *rho1=new double[nx*ny];
   double *rho2=new double[nx*ny];
-  bicubic_interpolation(I2, Iw, p, nparams, nx, ny, nz);
+  double *B2=new double[padded_size(nx,ny,nz)];
+  double *I2p=pad_image(I2,B2,nx,ny,nz);
+  bicubic_interpolation(I2p, Iw, p, nparams, nx, ny, nz);
   char outfile[50]="output.png";
   save_image(outfile,Iw,nx,ny,nz);
 
@@ -147,6 +150,7 @@ void print_output(
   delete []Iw;
   delete []rho1;
   delete []rho2;
+  delete []B2;
 }
 
 
@@ -0,0 +1,127 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "transformation.h"
+
+//format of the files of the references (see reference_save)
+#define REFERENCE_MAGIC "ICA-COLR" //first eight bytes of the files
+#define REFERENCE_VERSION 1        //changed when the layout changes
+
+/**
+  *
+  *  Data of the first image at one scale, which does not depend on the
+  *  second image: its gradient, the selected pixels, the steepest descent
+  *  images and the inverse Hessian of the quadratic version
+  *
+**/
+struct IcaTemplate
+{
+  double *Ix;   //x derivate of the image
+  double *Iy;   //y derivate of the image
+  double *DIJ;  //steepest descent images, NULL in the matrix-free mode
+  std::vector<int> x; //selected pixels, empty if all are used
+  double H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian of the quadratic
+                                       //version, unless it is stochastic
+};
+
+
+/**
+  *
+  *  Pyramid of a reference image and its data at each scale, built once
+  *  to align many images to it. It is only read by the estimation, so
+  *  that several images can be aligned in parallel with the same
+  *  reference. The options that it is built with must be those of the
+  *  estimation, otherwise it is not used. A reference saved to a file is
+  *  mapped in memory when it is loaded, instead of being copied
+  *
+**/
+struct IcaReference
+{
+  int nparams;    //number of parameters of the transform
+  int nscales;    //number of scales
+  double nu;      //downsampling factor
+  bool matrix_free; //the steepest descent images are not stored
+  double subset;  //fraction or number of pixels used at each scale
+  double batch;   //fraction or number of pixels drawn per iteration
+  unsigned long long checksum; //checksum of the image it is built from
+
+  double **I1s;   //pyramid of the image; the first scale is the input image
+  int *nx;        //number of columns at each scale
+  int *ny;        //number of rows at each scale
+  int nz;         //number of channels of the image
+  IcaTemplate *scales; //data of the image at each scale
+
+  void *map;      //file mapped in memory, or NULL if the data is allocated
+  size_t map_size; //size of the mapped file
+};
+
+
+/**
+ *
+ *  Initialize an empty reference, without allocating memory
+ *
+ */
+void reference_init(
+  IcaReference &ref //reference
+);
+
+
+/**
+ *
+ *  Release the memory of the reference
+ *
+ */
+void reference_free(
+  IcaReference &ref //reference
+);
+
+
+/**
+ *
+ *  Checksum of an image, which identifies the image of a reference
+ *
+ */
+unsigned long long reference_checksum(
+  const double *I, //image
+  int size         //number of values of the image
+);
+
+
+/**
+ *
+ *  Save the reference to a binary file, which can be loaded by later
+ *  runs instead of building the reference again
+ *
+ */
+bool reference_save(
+  const IcaReference &ref, //reference
+  const char *name         //name of the file
+);
+
+
+/**
+ *
+ *  Load a reference saved with reference_save by mapping the file in
+ *  memory. It fails if the file does not exist, if it has another
+ *  format or version, or if it was not built from the given image
+ *
+ */
+bool reference_load(
+  IcaReference &ref, //output reference
+  const char *name,  //name of the file
+  const double *I1,  //image that the reference must be built from
+  int size           //number of values of the image
+);
+
+#endif
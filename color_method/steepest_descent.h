@@ -0,0 +1,205 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef STEEPEST_DESCENT_H
+#define STEEPEST_DESCENT_H
+
+//The steepest descent images are stored as one plane per parameter:
+//the value of parameter n for sample i is in D[n*stride+i], with the
+//stride padded so that every plane starts on an aligned address
+
+#define SD_ALIGN 64  //alignment of the planes in bytes
+#define SD_BLOCK 256 //number of samples accumulated in each tile
+
+#include "transformation.h"
+
+//The accumulation is split by tiles among the threads: each thread keeps
+//its partial b and packed Hessian in its own stripe of SD_PARTIAL values,
+//b first and the Hessian from MAX_NPARAMS. The stripes are padded to a
+//multiple of 64 bytes so that the threads do not share cache lines
+#define SD_PARTIAL \
+  ((MAX_NPARAMS+MAX_NPARAMS*(MAX_NPARAMS+1)/2+15)/16*16)
+
+
+/**
+ *
+ *  Length of each plane for n samples, padded to the alignment
+ *
+ */
+int sd_stride(
+  int n //number of samples
+);
+
+
+/**
+ *
+ *  Allocate the planes of the steepest descent images, set to zero
+ *
+ */
+double *sd_allocate(
+  int nparams, //number of parameters
+  int n        //number of samples
+);
+
+
+/**
+ *
+ *  Release the memory of the steepest descent images
+ *
+ */
+void sd_free(
+  double *D //steepest descent images
+);
+
+
+/**
+ *
+ *  Accumulate one tile of samples, from start to start+len-1:
+ *  b+=D^t*diag(rho)*DI and the packed upper triangle Hp+=D^t*diag(rho)*D.
+ *  DI and rho are indexed from the start of the tile. If rho is NULL, the
+ *  weights are one; if DI or b are NULL, only the Hessian is accumulated;
+ *  if Hp is NULL, only the independent vector is accumulated
+ *
+ */
+void sd_accumulate_tile(
+  double *D,   //steepest descent images
+  double *DI,  //differences of the tile
+  double *rho, //robust weights of the tile
+  double *b,   //independent vector to be accumulated
+  double *Hp,  //packed upper triangle of the Hessian to be accumulated
+  int nparams, //number of parameters
+  int stride,  //length of each plane
+  int start,   //first sample of the tile
+  int len      //number of samples of the tile (at most SD_BLOCK)
+);
+
+
+/**
+ *
+ *  Allocate the partial sums of the threads, set to zero
+ *
+ */
+double *sd_partials_allocate(
+  int &nthreads //output number of stripes, one per thread
+);
+
+
+/**
+ *
+ *  Combine the partial sums of the threads with a tree reduction, copy
+ *  the result to b and H, and set the partial sums to zero, so that they
+ *  can be reused in the next accumulation. b or H may be NULL if they are
+ *  not needed
+ *
+ */
+void sd_partials_reduce(
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads
+  double *b,        //output independent vector
+  double *H,        //output Hessian matrix
+  int nparams       //number of parameters
+);
+
+
+/**
+ *
+ *  Copy the packed upper triangle to the symmetric Hessian
+ *
+ */
+void sd_unpack_hessian(
+  double *Hp, //packed upper triangle of the Hessian
+  double *H,  //output Hessian matrix
+  int nparams //number of parameters
+);
+
+
+/**
+ *
+ *  Compute H=D^t*diag(rho)*D by tiles, in the same way as a DSYRK
+ *  rho may be NULL for the quadratic version
+ *
+ */
+void sd_syrk(
+  double *D,   //steepest descent images
+  double *rho, //robust weights
+  double *H,   //output Hessian matrix
+  int nparams, //number of parameters
+  int n        //number of samples
+);
+
+
+/**
+ *
+ *  Compute b=D^t*diag(rho)*DI by tiles, in the same way as a DGEMV
+ *  rho may be NULL for the quadratic version
+ *
+ */
+void sd_gemv(
+  double *D,   //steepest descent images
+  double *DI,  //differences
+  double *rho, //robust weights
+  double *b,   //output independent vector
+  int nparams, //number of parameters
+  int n        //number of samples
+);
+
+
+/**
+ *
+ *  Version of sd_accumulate_tile for a transform fixed at compile time:
+ *  the loops over the parameters have constant trip counts and unroll
+ *
+ */
+template<int nparams>
+inline void sd_accumulate_tile(
+  double *D,   //steepest descent images
+  double *DI,  //differences of the tile
+  double *rho, //robust weights of the tile
+  double *b,   //independent vector to be accumulated
+  double *Hp,  //packed upper triangle of the Hessian to be accumulated
+  int stride,  //length of each plane
+  int start,   //first sample of the tile
+  int len      //number of samples of the tile (at most SD_BLOCK)
+)
+{
+  double w[SD_BLOCK];
+  int c=0;
+
+  for(int k=0; k<nparams; k++)
+  {
+    double *Dk=&(D[k*stride+start]);
+
+    //weighted values of parameter k
+    if(rho==NULL)
+      for(int i=0; i<len; i++) w[i]=Dk[i];
+    else
+      for(int i=0; i<len; i++) w[i]=rho[i]*Dk[i];
+
+    //component k of the independent vector
+    if(DI!=NULL && b!=NULL)
+    {
+      double s=0.0;
+      #pragma omp simd reduction(+:s)
+      for(int i=0; i<len; i++) s+=w[i]*DI[i];
+      b[k]+=s;
+    }
+
+    //row k of the upper triangle of the Hessian
+    if(Hp!=NULL)
+      for(int l=k; l<nparams; l++)
+      {
+        double *Dl=&(D[l*stride+start]);
+        double s=0.0;
+        #pragma omp simd reduction(+:s)
+        for(int i=0; i<len; i++) s+=w[i]*Dl[i];
+        Hp[c++]+=s;
+      }
+  }
+}
+
+#endif
@@ -17,6 +17,8 @@
 #include "transformation.h"
 
 #define ZOOM_SIGMA_ZERO 0.6
+#define ZOOM_BLOCK 256 //number of values smoothed at once when re-sampling
+#define ZOOM_RECURSIVE_SIGMA 3.0 //larger sigmas use the recursive Gaussian
 
 /**
   *
@@ -38,72 +40,321 @@ void zoom_size
 
 /**
   *
-  * Function to downsample the image
+  * Reflecting boundary condition, as in the Gaussian convolution
   *
 **/
-void zoom_out
-(
-  double *I,    //input image
-  double *Iout, //output image
+static inline int reflect(
+  int i, //position
+  int n  //number of values
+)
+{
+  if(i<0) return -i;
+  if(i>=n) return 2*n-1-i;
+  return i;
+}
+
+
+/**
+  *
+  * Neumann boundary condition, as in the bicubic interpolation
+  *
+**/
+static inline int clamp(
+  int i, //position
+  int n  //number of values
+)
+{
+  if(i<0) return 0;
+  if(i>=n) return n-1;
+  return i;
+}
+
+
+/**
+  *
+  * Convolution of a row with the Gaussian kernel, only at the columns 0,
+  * step, 2*step... The taps are added in the same order as in gaussian,
+  * so the values are equal to those of the smoothed image. The columns
+  * far from the borders are computed tap by tap, which is vectorised
+  *
+**/
+static void convolve_row(
+  double *I,   //input row
+  double *out, //output values
+  double *B,   //coefficients of the Gaussian kernel
+  int size,    //number of coefficients
+  int nx,      //width of the row
+  int nz,      //number of color channels in image
+  int nout,    //number of output values
+  int step     //distance between the output columns
+)
+{
+  //output values whose taps are inside the row
+  int first=(size+step-2)/step;
+  int last=(nx-size)/step+1;
+  if(last>nout) last=nout;
+  if(first>last) first=last;
+
+  for(int k=first; k<last; k++)
+    for(int c=0; c<nz; c++)
+      out[k*nz+c]=B[0]*I[k*step*nz+c];
+  for(int j=1; j<size; j++)
+    for(int k=first; k<last; k++)
+      for(int c=0; c<nz; c++)
+        out[k*nz+c]+=B[j]*(I[(k*step-j)*nz+c]+I[(k*step+j)*nz+c]);
+
+  //output values near the borders
+  for(int k=0; k<nout; k++)
+  {
+    if(k==first) k=last;
+    if(k>=nout) break;
+
+    int m=k*step;
+    for(int c=0; c<nz; c++)
+    {
+      double sum=B[0]*I[m*nz+c];
+      for(int j=1; j<size; j++)
+        sum+=B[j]*(I[reflect(m-j, nx)*nz+c]+I[reflect(m+j, nx)*nz+c]);
+      out[k*nz+c]=sum;
+    }
+  }
+}
+
+
+/**
+  *
+  * Convolution of len values of a row with the Gaussian kernel along the
+  * columns, at row i. The rows are traversed contiguously, which is
+  * vectorised
+  *
+**/
+static void convolve_column(
+  double *I,   //input image, at the first value
+  double *out, //output values
+  double *B,   //coefficients of the Gaussian kernel
+  int size,    //number of coefficients
+  int i,       //row of the output values
+  int len,     //number of values
+  int stride,  //number of values of each row
+  int ny       //number of rows
+)
+{
+  double *I0=I+i*stride;
+  for(int k=0; k<len; k++)
+    out[k]=B[0]*I0[k];
+
+  for(int j=1; j<size; j++)
+  {
+    double *Im=I+reflect(i-j, ny)*stride;
+    double *Ip=I+reflect(i+j, ny)*stride;
+    for(int k=0; k<len; k++)
+      out[k]+=B[j]*(Im[k]+Ip[k]);
+  }
+}
+
+
+/**
+  *
+  * Resample row i of the zoomed image from an image smoothed along the
+  * rows: the four rows of the bicubic interpolation are smoothed along
+  * the columns by blocks, interpolated in y and then in x, in the same
+  * order as the bicubic interpolation of the smoothed image
+  *
+**/
+static void resample_row(
+  double *Is,   //image smoothed along the rows
+  double *Iout, //output row of the zoomed image
+  double *B,    //coefficients of the Gaussian kernel
+  int size,     //number of coefficients
+  int i,        //row of the zoomed image
+  double factor,//zoom factor between 0 and 1
   int nx,       //image width
   int ny,       //image height
-  int nz,       // number of color channels in image              
-  double factor //zoom factor between 0 and 1
+  int nz,       //number of color channels in image
+  int nxx       //width of the zoomed image
 )
 {
-  int nxx, nyy, original_size =nx*ny*nz; 
-  double *Is=new double[original_size];
+  double c[4][ZOOM_BLOCK], v[ZOOM_BLOCK], p[4];
 
-  for (int i=0; i<original_size; i++)
-    Is[i]=I[i];
+  double yy=(double)i/factor;
+  int y=(int)yy;
+
+  int j=0;
+  while(j<nxx)
+  {
+    //zoomed columns whose taps fit in a block of values
+    int k0=clamp((int)((double)j/factor)-1, nx);
+    int j1=j, k1=k0;
+    while(j1<nxx)
+    {
+      int k=clamp((int)((double)j1/factor)+2, nx);
+      if((k-k0+1)*nz>ZOOM_BLOCK) break;
+      k1=k;
+      j1++;
+    }
+    int len=(k1-k0+1)*nz;
+
+    //smooth the four rows along the columns and interpolate them in y
+    for(int t=0; t<4; t++)
+      convolve_column(
+        &(Is[k0*nz]), c[t], B, size, clamp(y-1+t, ny), len, nx*nz, ny
+      );
+    for(int k=0; k<len; k++)
+    {
+      p[0]=c[0][k]; p[1]=c[1][k]; p[2]=c[2][k]; p[3]=c[3][k];
+      v[k]=cubic_interpolation(p, yy-y);
+    }
+
+    //interpolate the block in x
+    for(; j<j1; j++)
+    {
+      double xx=(double)j/factor;
+      int x=(int)xx;
+      for(int index_color=0; index_color<nz; index_color++)
+      {
+        for(int t=0; t<4; t++)
+          p[t]=v[(clamp(x-1+t, nx)-k0)*nz+index_color];
+        Iout[j*nz+index_color]=cubic_interpolation(p, xx-x);
+      }
+    }
+  }
+}
+
+
+/**
+  *
+  * Function to downsample the two images, which are processed in the same
+  * parallel loops, or only the first one if the second is NULL. The images
+  * are smoothed and sampled with the bicubic interpolation; the smoothing is
+  * restricted to the values that are interpolated. With a factor of 0.5, the
+  * samples are the even pixels, where the interpolation is the smoothed
+  * image, so the rows are smoothed only at the even columns and the columns
+  * at the even rows
+  *
+**/
+void zoom_out
+(
+  double *I1,    //first input image
+  double *I2,    //second input image, or NULL
+  double *I1out, //first output image
+  double *I2out, //second output image, or NULL
+  int nx,        //image width
+  int ny,        //image height
+  int nz,        //number of color channels in image
+  double factor, //zoom factor between 0 and 1
+  double *buffer //2*nx*ny*nz values for the smoothed images, or NULL
+)
+{
+  int nxx, nyy, size;
+  double *Is=(buffer==NULL)?new double[2*nx*ny*nz]:buffer;
+  double *I[2]={I1, I2};
+  double *Iout[2]={I1out, I2out};
+  int nimages=(I2==NULL)?1:2; //number of images to downsample
 
   //calculate the size of the zoomed image
   zoom_size(nx, ny, nxx, nyy, factor);
   
   //compute the Gaussian sigma for smoothing
   double sigma=ZOOM_SIGMA_ZERO*sqrt(1.0/(factor*factor)-1.0);
+  double *B=gaussian_kernel(sigma, size);
 
-  //pre-smooth the image
-  gaussian(Is, nx, ny, nz, sigma);
-  
-  // re-sample the image using bicubic interpolation 
-  for(int index_color=0; index_color<nz; index_color++)
+  if(sigma<=ZOOM_RECURSIVE_SIGMA && (size>nx || size>ny))
   {
-    for (int i1=0; i1<nyy; i1++)
-      for (int j1=0; j1<nxx; j1++)
-      {
-        double i2=(double)i1/factor;
-        double j2=(double)j1/factor;
-        Iout[(i1*nxx+j1)*nz+index_color]=
-           bicubic_interpolation(Is, j2, i2, nx, ny, nz, index_color);  
-      }   
+    printf("GaussianSmooth: sigma too large for this bc\n");
+    throw 1;
   }
-  
-  delete []Is;
+  if(4*nz>ZOOM_BLOCK)
+  {
+    printf("zoom_out: too many channels\n");
+    throw 1;
+  }
+
+  int n1=nx*nz, n2=nxx*nz;
+  if(sigma>ZOOM_RECURSIVE_SIGMA)
+  {
+    //the window is large for small factors: the images are smoothed with
+    //the recursive filter and re-sampled with a unit kernel
+    double one=1.0;
+    for(int m=0; m<nimages; m++)
+    {
+      #pragma omp parallel for schedule(static)
+      for(int i=0; i<ny*n1; i++)
+        Is[m*ny*n1+i]=I[m][i];
+      gaussian_recursive(&(Is[m*ny*n1]), nx, ny, nz, sigma);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      resample_row(
+        &(Is[m*ny*n1]), &(Iout[m][i*n2]), &one, 1, i, factor, nx, ny, nz, nxx
+      );
+    }
+  }
+  else if(factor==0.5)
+  {
+    //smooth the rows at the even columns
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*ny; n++)
+    {
+      int m=n/ny, i=n%ny;
+      convolve_row(
+        &(I[m][i*n1]), &(Is[(m*ny+i)*n2]), B, size, nx, nz, nxx, 2
+      );
+    }
+
+    //smooth the columns at the even rows
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      convolve_column(
+        &(Is[m*ny*n2]), &(Iout[m][i*n2]), B, size, 2*i, n2, n2, ny
+      );
+    }
+  }
+  else
+  {
+    //smooth the rows
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*ny; n++)
+    {
+      int m=n/ny, i=n%ny;
+      convolve_row(
+        &(I[m][i*n1]), &(Is[(m*ny+i)*n1]), B, size, nx, nz, nx, 1
+      );
+    }
+
+    //smooth the columns and re-sample the image
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      resample_row(
+        &(Is[m*ny*n1]), &(Iout[m][i*n2]), B, size, i, factor, nx, ny, nz, nxx
+      );
+    }
+  }
+
+  if(buffer==NULL) delete []Is;
 }
 
 
 /**
   *
-  * Function to upsample the parameters of the transformation
+  * Scale the parameters of the transformation by the factor between the
+  * sizes of two scales
   *
 **/
-void zoom_in_parameters 
+static void scale_parameters
 (
-  double *p,    //input image
-  double *pout, //output image   
+  double *p,    //input parameters
+  double *pout, //output parameters, which can be p
   int nparams,  //number of parameters
-  int nx,       //width of the original image
-  int ny,       //height of the original image
-  int nxx,      //width of the zoomed image
-  int nyy       //height of the zoomed image
+  double nu     //factor between the scales
 )
 {
-  //compute the zoom factor
-  double factorx=((double)nxx/nx);
-  double factory=((double)nyy/ny);
-  double nu=(factorx>factory)?factorx:factory;
-
   switch(nparams) {
     default: case TRANSLATION_TRANSFORM: //p=(tx, ty) 
       pout[0]=p[0]*nu;
@@ -140,3 +391,54 @@ void zoom_in_parameters
       break;
   }
 }
+
+
+/**
+  *
+  * Function to upsample the parameters of the transformation
+  *
+**/
+void zoom_in_parameters 
+(
+  double *p,    //input image
+  double *pout, //output image   
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+)
+{
+  //compute the zoom factor
+  double factorx=((double)nxx/nx);
+  double factory=((double)nyy/ny);
+  double nu=(factorx>factory)?factorx:factory;
+
+  scale_parameters(p, pout, nparams, nu);
+}
+
+
+/**
+  *
+  * Function to downsample the parameters of the transformation, the
+  * inverse of zoom_in_parameters from the smaller to the larger scale
+  *
+**/
+void zoom_out_parameters 
+(
+  double *p,    //input parameters
+  double *pout, //output parameters
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+)
+{
+  //compute the zoom factor of zoom_in_parameters
+  double factorx=((double)nx/nxx);
+  double factory=((double)ny/nyy);
+  double nu=(factorx>factory)?factorx:factory;
+
+  scale_parameters(p, pout, nparams, 1/nu);
+}
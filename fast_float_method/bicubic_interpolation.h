@@ -13,15 +13,32 @@
 
 #include <vector>
 
+#include "padded_image.h"
+#include "transformation.h"
+
+#define BICUBIC_BLOCK 256 //number of points interpolated in each call
+
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Bicubic interpolation in one dimension
+  *
+**/
+float
+cubic_interpolation(
+  float v[4],  //interpolation points
+  float x      //point to be interpolated
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 float
 bicubic_interpolation(
-  float *input,//image to be interpolated
+  float *input,//padded image to be interpolated
   float uu,    //x component of the vector field
   float vv,    //y component of the vector field
   int nx,       //width of the image
@@ -32,14 +49,54 @@ bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of n points of a padded image. The
+  * same kernel is used for all the points and, with AVX2, it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  float *input,  //padded image to be interpolated
+  float *uu,     //x coordinates of the points
+  float *vv,     //y coordinates of the points
+  float *output, //output interpolated values
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out=true //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of n points of a padded image warped
+  * with a translation, with the same weights for all the points
+  *
+**/
+void bicubic_interpolation_translation(
+  float *input,  //padded image to be warped
+  float *x,      //x coordinates of the points
+  float *y,      //y coordinates of the points
+  float *output, //output interpolated values
+  float *params, //parameters of the translation
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out=true //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  float *input,        //image to be warped
-  std::vector<int> &x, //selected points
+  float *input,        //padded image to be warped
+  float *x,            //x coordinates of the points
+  float *y,            //y coordinates of the points
   float *output,       //warped output image with bicubic interpolation
   float *params,       //x component of the vector field
+  int N,                //number of points
   int nparams,          //number of parameters of the transform
   int nx,               //width of the image
   int ny,               //height of the image
@@ -50,11 +107,12 @@ void bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  float *input,        //image to be warped
+  float *input,        //padded image to be warped
   float *output,       //warped output image with bicubic interpolation
   float *params,       //x component of the vector field
   int nparams,          //number of parameters of the transform
@@ -64,6 +122,111 @@ void bicubic_interpolation(
 );
 
 
+/**
+  *
+  * Version of the warping of the selected points for a transform fixed at
+  * compile time. The matrix of the transform is built once for all the
+  * points, so the loop has no trigonometric functions. The points are
+  * interpolated by blocks in a single call
+  *
+**/
+template<int nparams>
+void bicubic_interpolation(
+  float *input,        //padded image to be warped
+  float *x,            //x coordinates of the points
+  float *y,            //y coordinates of the points
+  float *output,       //warped output image with bicubic interpolation
+  float *params,       //x component of the vector field
+  int N,                //number of points
+  int nx,               //width of the image
+  int ny,               //height of the image
+  bool border_out=true  //if true, put zeros outside the region
+)
+{
+  //the translation uses the same weights for every point
+  if(nparams==TRANSLATION_TRANSFORM)
+  {
+    bicubic_interpolation_translation(
+      input, x, y, output, params, N, nx, ny, border_out
+    );
+    return;
+  }
+
+  float m[9];
+  params2matrix(params, m, nparams);
+
+  for (int i=0; i<N; i+=BICUBIC_BLOCK)
+  {
+    int len=(N-i<BICUBIC_BLOCK)?N-i:BICUBIC_BLOCK;
+    float xw[BICUBIC_BLOCK], yw[BICUBIC_BLOCK];
+
+    //transform coordinates using the parametric model
+    for (int n=0; n<len; n++)
+      project_matrix<nparams>(x[i+n], y[i+n], m, xw[n], yw[n]);
+    
+    //obtain the bicubic interpolation of the block of points
+    bicubic_interpolation(
+      input, xw, yw, &(output[i]), len, nx, ny, border_out
+    );
+  }
+}
+
+
+/**
+  *
+  * Version of the warping of the image for a transform fixed at compile
+  * time. The coordinates are stepped along each row by adding the first
+  * column of the matrix of the transform, so the loop has no trigonometric
+  * functions and only the homography needs a division per pixel. The
+  * points of each block of the row are interpolated in a single call
+  *
+**/
+template<int nparams>
+void bicubic_interpolation(
+  float *input,        //padded image to be warped
+  float *output,       //warped output image with bicubic interpolation
+  float *params,       //x component of the vector field
+  int nx,               //width of the image
+  int ny,               //height of the image
+  bool border_out=true  //if true, put zeros outside the region
+)
+{
+  float m[9];
+  params2matrix(params, m, nparams);
+
+  for (int i=0; i<ny; i++)
+  {
+    //numerators and denominator of the transform at the start of the row
+    float xn=m[1]*i+m[2];
+    float yn=m[4]*i+m[5];
+    float dn=m[7]*i+m[8];
+
+    for (int j=0; j<nx; j+=BICUBIC_BLOCK)
+    {
+      int len=(nx-j<BICUBIC_BLOCK)?nx-j:BICUBIC_BLOCK;
+      float x[BICUBIC_BLOCK], y[BICUBIC_BLOCK];
 
+      //transform coordinates using the parametric model
+      for (int n=0; n<len; n++)
+      {
+        x[n]=xn;
+        y[n]=yn;
+        if(nparams==HOMOGRAPHY_TRANSFORM)
+        {
+          x[n]/=dn;
+          y[n]/=dn;
+        }
+        xn+=m[0];
+        yn+=m[3];
+        dn+=m[6];
+      }
+      
+      //obtain the bicubic interpolation of the block of the row
+      bicubic_interpolation(
+        input, x, y, &(output[i*nx+j]), len, nx, ny, border_out
+      );
+    }
+  }
+}
 
 #endif
@@ -25,13 +25,20 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <omp.h>
 #include <vector>
+#include <algorithm>
 
 #include "bicubic_interpolation.h"
 #include "inverse_compositional_algorithm.h"
 #include "matrix.h"
 #include "mask.h"
+#include "padded_image.h"
+#include "reference.h"
+#include "robust_function.h"
+#include "steepest_descent.h"
 #include "transformation.h"
+#include "workspace.h"
 #include "zoom.h"
 #include "file.h"
 
@@ -50,112 +57,120 @@ float rhop(
   int    type    //choice of the robust error function
 )
 {
-  float result=0.0;
   float lambda2=lambda*lambda;
   switch(type)
   {
     case QUADRATIC:
-      result=1;
-      break;
-    default: 
+      return Quadratic::weight(t2, lambda2);
+    default:
     case TRUNCATED_QUADRATIC:
-      if(t2<lambda2) result=1.0;
-      else result=0.0;
-      break;  
+      return TruncatedQuadratic::weight(t2, lambda2);
     case GERMAN_MCCLURE:
-      result=lambda2/((lambda2+t2)*(lambda2+t2));
-      break;
-    case LORENTZIAN: 
-      result=1/(lambda2+t2);
-      break;
+      return GemanMcClure::weight(t2, lambda2);
+    case LORENTZIAN:
+      return Lorentzian::weight(t2, lambda2);
     case CHARBONNIER:
-      result=1.0/(sqrt(t2+lambda2));
-      break;
+      return Charbonnier::weight(t2, lambda2);
+    case CHARBONNIER_FAST:
+      return CharbonnierFast::weight(t2, lambda2);
   }
-  return result;
 }
 
  
 /**
  *
  *  Function to compute DI^t*J
- *  from the gradient of the image and the Jacobian
+ *  from the gradient of the image and the analytic Jacobian
+ *  DIJ is stored as one plane per parameter (see steepest_descent.h)
  *
  */
+template<int nparams>
 void steepest_descent_images
 (
-  float *Ix,  //x derivate of the image
-  float *Iy,  //y derivate of the image
-  float *J,   //Jacobian matrix
-  float *DIJ, //output DI^t*J
-  int nparams, //number of parameters
-  vector<int> &x //corner positions
+  const PatchPixels &pts, //pixels of the patches
+  float *DIJ  //output DI^t*J
 )
 {
+  int stride=sd_stride(pts.N);
+
 #pragma omp parallel for
-  for(unsigned int p=0; p<x.size(); p++)
-    for(int n=0; n<nparams; n++)
-      DIJ[p*nparams+n]=Ix[x[p]]*J[2*p*nparams+n]+Iy[x[p]]*J[2*p*nparams+n+nparams];
+  for(int p=0; p<pts.N; p++)
+    point_steepest_descent<nparams>(
+      pts.x[p], pts.y[p], pts.Ix[p], pts.Iy[p], &(DIJ[p]), stride
+    );
 }
 
+
 /**
  *
- *  Function to compute the Hessian matrix
- *  the Hessian is equal to DIJ^t*DIJ
+ *  Dispatch of steepest_descent_images to the version for
+ *  the transform chosen at run time
  *
  */
-void hessian
+void steepest_descent_images
 (
-  float *DIJ, //the steepest descent image
-  float *H,   //output Hessian matrix
-  int nparams, //number of parameters
-  int N        //number of values
-) 
+  const PatchPixels &pts, //pixels of the patches
+  float *DIJ, //output DI^t*J
+  int nparams  //number of parameters
+)
 {
-  //initialize the hessian to zero
-#pragma omp parallel for
-  for(int k=0; k<nparams*nparams; k++)
-    H[k] = 0;
- 
-  //calculate the hessian in a neighbor window
-#pragma omp parallel for
-  for(int k=0; k<nparams; k++)
-    for(int l=0; l<nparams; l++)
-      for(int i=0; i<N; i++)
-	H[k*nparams+l]+=DIJ[i*nparams+k]*DIJ[i*nparams+l];
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      steepest_descent_images<TRANSLATION_TRANSFORM>(pts, DIJ);
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      steepest_descent_images<EUCLIDEAN_TRANSFORM>(pts, DIJ);
+      break;
+    case SIMILARITY_TRANSFORM:
+      steepest_descent_images<SIMILARITY_TRANSFORM>(pts, DIJ);
+      break;
+    case AFFINITY_TRANSFORM:
+      steepest_descent_images<AFFINITY_TRANSFORM>(pts, DIJ);
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      steepest_descent_images<HOMOGRAPHY_TRANSFORM>(pts, DIJ);
+      break;
+  }
 }
 
 
 /**
  *
- *  Function to compute the Hessian matrix with robust error functions
- *  the Hessian is equal to rho'*DIJ^t*DIJ
+ *  Function to get the steepest descent values of a tile of points.
+ *  If DIJ is stored, it returns DIJ with its stride and the start of the
+ *  tile. In the matrix-free mode (DIJ is NULL), the values are computed
+ *  on the fly from the gradient in Dt, with a stride of SD_BLOCK
  *
  */
-void hessian
+template<int nparams>
+float *steepest_descent_tile
 (
-  float *DIJ, //the steepest descent image
-  float *rho, //robust function
-  float *H,   //output Hessian matrix
-  int nparams, //number of parameters
-  int N        //number of values
-) 
+  float *DIJ, //stored steepest descent images or NULL
+  const PatchPixels &pts, //pixels of the patches
+  float *Dt,  //buffer of nparams*SD_BLOCK values for the tile
+  int t,       //first point of the tile
+  int len,     //number of points of the tile
+  int &stride, //output stride of the returned values
+  int &start   //output position of the tile in the returned values
+)
 {
-  //initialize the hessian to zero
-#pragma omp parallel for
-  for(int k=0; k<nparams*nparams; k++)
-    H[k]=0;
+  if(DIJ!=NULL)
+  {
+    stride=sd_stride(pts.N);
+    start=t;
+    return DIJ;
+  }
 
-  //calculate the hessian in a neighbor window
-#pragma omp parallel for
-  for(int k=0; k<nparams; k++)
-    for(int l=0; l<nparams; l++)
-      for(int i=0; i<N; i++)
-	H[k*nparams+l]+=rho[i]*DIJ[i*nparams+k]*DIJ[i*nparams+l];
+  for(int n=0; n<len; n++)
+    point_steepest_descent<nparams>(
+      pts.x[t+n], pts.y[t+n], pts.Ix[t+n], pts.Iy[t+n], &(Dt[n]), SD_BLOCK
+    );
+  stride=SD_BLOCK;
+  start=0;
+  return Dt;
 }
 
-
-
 /**
  *
  *  Function to compute the inverse of the Hessian
@@ -181,90 +196,572 @@ void inverse_hessian
  */
 void difference_image
 (
-  float *I,  //first image I1(x)
+  float *I,  //first image I1(x) at the pixels of the patches
   float *Iw, //second warped image I2(x'(x;p)) 
-  vector<int> &x,
-  float *DI  //output difference array
+  float *DI, //output difference array
+  int N       //number of pixels
 ) 
 {
 #pragma omp parallel for
-  for(unsigned int i=0; i<x.size(); i++)
-    DI[i]=Iw[i]-I[x[i]];
+  for(int i=0; i<N; i++)
+    DI[i]=Iw[i]-I[i];
 }
 
 
 /**
  *
- *  Function to store the values of p'((I2(x'(x;p))-I1(x))²)
+ *  Function to compute b=Sum(DIJ^t * DI) and H=Sum(DIJ^t*DIJ) by tiles,
+ *  with stored or matrix-free steepest descent images. If DI is NULL, only
+ *  the Hessian is computed; if H is NULL, only the independent vector
  *
  */
-void robust_error_function
+template<int nparams>
+void quadratic_accumulate
 (
-  float *DI,   //input difference array
-  float *rho,  //output robust function
-  float lambda,//threshold used in the robust functions
-  int    type,  //choice of robust error function
-  int N         //number of values
+  float *DIJ, //stored steepest descent images or NULL
+  const PatchPixels &pts, //pixels of the patches
+  float *DI,  //I2(x'(x;p))-I1(x) 
+  float *b,   //output independent vector
+  float *H,   //output Hessian matrix
+  float *partials, //partial sums of the threads
+  int nthreads      //number of threads of the partial sums
 )
 {
-#pragma omp parallel for
-  for(int i=0;i<N;i++)
+  int N=pts.N;
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
   {
-    float norm=DI[i]*DI[i];
-    rho[i]=rhop(norm,lambda,type);
+    float Dt[MAX_NPARAMS*SD_BLOCK];
+    float *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    float *Hp=(H==NULL)?NULL:bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=SD_BLOCK)
+    {
+      int len=(N-t<SD_BLOCK)?N-t:SD_BLOCK;
+      int stride, start;
+
+      float *D=steepest_descent_tile<nparams>(
+        DIJ, pts, Dt, t, len, stride, start
+      );
+      sd_accumulate_tile<nparams>(
+        D, (DI==NULL)?NULL:&(DI[t]), NULL, bt, Hp,
+        stride, start, len
+      );
+    }
   }
+
+  sd_partials_reduce(partials, nthreads, (DI==NULL)?NULL:b, H, nparams);
 }
 
 
 /**
  *
- *  Function to compute b=Sum(DIJ^t * DI)
+ *  Dispatch of quadratic_accumulate to the version for
+ *  the transform chosen at run time
  *
  */
-void independent_vector
+void quadratic_accumulate
 (
-  float *DIJ, //the steepest descent image
+  float *DIJ, //stored steepest descent images or NULL
+  const PatchPixels &pts, //pixels of the patches
   float *DI,  //I2(x'(x;p))-I1(x) 
   float *b,   //output independent vector
-  int nparams, //number of parameters
-  int N        //number of columns
+  float *H,   //output Hessian matrix
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams  //number of parameters
 )
 {
-  //initialize the vector to zero
-  for(int k=0; k<nparams; k++)
-    b[k]=0;
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      quadratic_accumulate<TRANSLATION_TRANSFORM>(
+        DIJ, pts, DI, b, H, partials, nthreads
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      quadratic_accumulate<EUCLIDEAN_TRANSFORM>(
+        DIJ, pts, DI, b, H, partials, nthreads
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      quadratic_accumulate<SIMILARITY_TRANSFORM>(
+        DIJ, pts, DI, b, H, partials, nthreads
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      quadratic_accumulate<AFFINITY_TRANSFORM>(
+        DIJ, pts, DI, b, H, partials, nthreads
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      quadratic_accumulate<HOMOGRAPHY_TRANSFORM>(
+        DIJ, pts, DI, b, H, partials, nthreads
+      );
+      break;
+  }
+}
 
-#pragma omp parallel for
-  for(int k=0; k<nparams; k++)
-    for(int i=0; i<N; i++)
-      b[k]+=DIJ[i*nparams+k]*DI[i];
+
+/**
+ *
+ *  Function to warp a tile of the second image, I2(x'(x;p)), for the
+ *  points from t to t+len-1. The points are warped with constant weights
+ *  for translations
+ *
+ */
+template<int nparams>
+void warp_tile
+(
+  float *I2,  //second image
+  const PatchPixels &pts, //pixels of the patches
+  float *p,   //parameters of the transform
+  float *m,   //matrix of the transform
+  float *xw,  //buffer for the x coordinates of the tile
+  float *yw,  //buffer for the y coordinates of the tile
+  float *Iw,  //output warped values of the tile
+  int t,      //first point of the tile
+  int len,    //number of points of the tile
+  int nx,     //number of columns
+  int ny      //number of rows
+)
+{
+  if(nparams==TRANSLATION_TRANSFORM)
+    bicubic_interpolation_translation(
+      I2, &(pts.x[t]), &(pts.y[t]), Iw, p, len, nx, ny, true
+    );
+  else
+  {
+    for(int n=0; n<len; n++)
+      project_matrix<nparams>(pts.x[t+n], pts.y[t+n], m, xw[n], yw[n]);
+    bicubic_interpolation(I2, xw, yw, Iw, len, nx, ny, true);
+  }
 }
 
 
 /**
  *
- *  Function to compute b=Sum(rho'*DIJ^t * DI)
- *  with robust error functions
+ *  Function to compute b=Sum(rho'*DIJ^t * DI) and H=Sum(rho'*DIJ^t*DIJ) 
+ *  in a single pass: the points are warped by tiles, and the differences
+ *  and robust weights of each tile are accumulated while in cache, without
+ *  storing Iw, DI or rho for all the points
  *
  */
-void independent_vector
+template<int nparams, class Robust>
+void robust_accumulate
 (
-  float *DIJ, //the steepest descent image
-  float *DI,  //I2(x'(x;p))-I1(x) 
-  float *rho, //robust function
-  float *b,   //output independent vector
-  int nparams, //number of parameters
-  int N        //number of values
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //output Hessian matrix
+  float lambda, //threshold used in the robust functions
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny         //number of rows
 )
 {
-  //initialize the vector to zero
-  for(int k=0; k<nparams; k++)
-    b[k]=0;
+  int N=pts.N;
+  float lambda2=lambda*lambda;
 
-#pragma omp parallel for
-  for(int k=0; k<nparams; k++)
-    for(int i=0; i<N; i++)
-      b[k]+=rho[i]*DIJ[i*nparams+k]*DI[i];
+  //matrix of the transform, built once for all the points
+  float m[9];
+  params2matrix(p, m, nparams);
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
+  {
+    float xw[SD_BLOCK], yw[SD_BLOCK], DI[SD_BLOCK], rho[SD_BLOCK];
+    float Dt[MAX_NPARAMS*SD_BLOCK];
+    float *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    float *Hp=bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=SD_BLOCK)
+    {
+      int len=(N-t<SD_BLOCK)?N-t:SD_BLOCK;
+
+      //warp the points of the tile: I2(x'(x;p))
+      warp_tile<nparams>(I2, pts, p, m, xw, yw, DI, t, len, nx, ny);
+
+      //difference and robust weights of the tile
+      for(int n=0; n<len; n++)
+      {
+        DI[n]-=pts.I1[t+n];
+        rho[n]=DI[n]*DI[n];
+      }
+      robust_weights<Robust>(rho, rho, len, lambda2);
+
+      //accumulate the independent vector and the Hessian of the tile
+      int stride, start;
+      float *D=steepest_descent_tile<nparams>(
+        DIJ, pts, Dt, t, len, stride, start
+      );
+      sd_accumulate_tile<nparams>(D, DI, rho, bt, Hp, stride, start, len);
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, b, H, nparams);
+}
+
+
+/**
+ *
+ *  Dispatch of robust_accumulate to the version for
+ *  the robust function chosen at run time
+ *
+ */
+template<int nparams>
+void robust_accumulate
+(
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //output Hessian matrix
+  float lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny         //number of rows
+)
+{
+  switch(type)
+  {
+    case QUADRATIC:
+      robust_accumulate<nparams, Quadratic>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_accumulate<nparams, TruncatedQuadratic>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_accumulate<nparams, GemanMcClure>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+    case LORENTZIAN:
+      robust_accumulate<nparams, Lorentzian>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+    case CHARBONNIER:
+      robust_accumulate<nparams, Charbonnier>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_accumulate<nparams, CharbonnierFast>(
+        pts, I2, DIJ, p, b, H, lambda, partials, nthreads, nx, ny
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Dispatch of robust_accumulate to the version for
+ *  the transform chosen at run time
+ *
+ */
+void robust_accumulate
+(
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //output Hessian matrix
+  float lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny         //number of rows
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_accumulate<TRANSLATION_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, lambda, type, partials, nthreads, nx,
+        ny
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_accumulate<EUCLIDEAN_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, lambda, type, partials, nthreads, nx,
+        ny
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_accumulate<SIMILARITY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, lambda, type, partials, nthreads, nx,
+        ny
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_accumulate<AFFINITY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, lambda, type, partials, nthreads, nx,
+        ny
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_accumulate<HOMOGRAPHY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, lambda, type, partials, nthreads, nx,
+        ny
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Version of robust_accumulate that keeps the Hessian across iterations.
+ *  rho0 holds the weights of the points with which H was built. If
+ *  rebuild is set, H is computed from scratch and its weights are stored
+ *  in rho0. Otherwise, b is computed with the new weights and H is updated
+ *  only with the points whose weights changed, with rank-one updates, if
+ *  the weights are binary (truncated quadratic), or kept as it is for the
+ *  smooth robust functions
+ *
+ */
+template<int nparams, class Robust>
+void robust_update
+(
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //Hessian matrix, updated with the new weights
+  float *rho0, //weights of the Hessian, updated with the new weights
+  float lambda, //threshold used in the robust functions
+  bool rebuild, //compute the Hessian from scratch
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny         //number of rows
+)
+{
+  int N=pts.N;
+  float lambda2=lambda*lambda;
+  bool hessian=rebuild || Robust::binary;
+
+  //matrix of the transform, built once for all the points
+  float m[9];
+  params2matrix(p, m, nparams);
+
+  //each thread accumulates its tiles in its own partial sums
+  #pragma omp parallel num_threads(nthreads)
+  {
+    float xw[SD_BLOCK], yw[SD_BLOCK], DI[SD_BLOCK], rho[SD_BLOCK];
+    float Dt[MAX_NPARAMS*SD_BLOCK], Dc[MAX_NPARAMS*SD_BLOCK];
+    float *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+    float *Hp=bt+MAX_NPARAMS;
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<N; t+=SD_BLOCK)
+    {
+      int len=(N-t<SD_BLOCK)?N-t:SD_BLOCK;
+
+      //warp the points of the tile: I2(x'(x;p))
+      warp_tile<nparams>(I2, pts, p, m, xw, yw, DI, t, len, nx, ny);
+
+      //difference and robust weights of the tile
+      for(int n=0; n<len; n++)
+      {
+        DI[n]-=pts.I1[t+n];
+        rho[n]=DI[n]*DI[n];
+      }
+      robust_weights<Robust>(rho, rho, len, lambda2);
+
+      int stride, start;
+      float *D=steepest_descent_tile<nparams>(
+        DIJ, pts, Dt, t, len, stride, start
+      );
+
+      if(rebuild)
+      {
+        //independent vector and Hessian with the weights of the tile
+        sd_accumulate_tile<nparams>(D, DI, rho, bt, Hp, stride, start, len);
+        for(int n=0; n<len; n++)
+          rho0[t+n]=rho[n];
+      }
+      else
+      {
+        sd_accumulate_tile<nparams>(D, DI, rho, bt, NULL, stride, start, len);
+
+        if(Robust::binary)
+        {
+          //gather the points that flipped, weighted by the change (+1 or
+          //-1), reusing xw for the weights
+          int nc=0;
+          for(int n=0; n<len; n++)
+            if(rho[n]!=rho0[t+n])
+            {
+              for(int k=0; k<nparams; k++)
+                Dc[k*SD_BLOCK+nc]=D[k*stride+start+n];
+              xw[nc++]=rho[n]-rho0[t+n];
+              rho0[t+n]=rho[n];
+            }
+
+          if(nc>0)
+            sd_accumulate_tile<nparams>(
+              Dc, NULL, xw, NULL, Hp, SD_BLOCK, 0, nc
+            );
+        }
+      }
+    }
+  }
+
+  float dH[MAX_NPARAMS*MAX_NPARAMS];
+  sd_partials_reduce(partials, nthreads, b, hessian?dH:NULL, nparams);
+
+  if(rebuild)
+    for(int i=0; i<nparams*nparams; i++) H[i]=dH[i];
+  else if(Robust::binary)
+    for(int i=0; i<nparams*nparams; i++) H[i]+=dH[i];
+}
+
+
+/**
+ *
+ *  Dispatch of robust_update to the version for
+ *  the robust function chosen at run time
+ *
+ */
+template<int nparams>
+void robust_update
+(
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //Hessian matrix, updated with the new weights
+  float *rho0, //weights of the Hessian, updated with the new weights
+  float lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  bool rebuild, //compute the Hessian from scratch
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nx,        //number of columns
+  int ny         //number of rows
+)
+{
+  switch(type)
+  {
+    case QUADRATIC:
+      robust_update<nparams, Quadratic>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_update<nparams, TruncatedQuadratic>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_update<nparams, GemanMcClure>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case LORENTZIAN:
+      robust_update<nparams, Lorentzian>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case CHARBONNIER:
+      robust_update<nparams, Charbonnier>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_update<nparams, CharbonnierFast>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Dispatch of robust_update to the version for
+ *  the transform chosen at run time
+ *
+ */
+void robust_update
+(
+  const PatchPixels &pts, //pixels of the patches
+  float *I2,   //second image, to be warped with p
+  float *DIJ,  //the steepest descent image, NULL if matrix-free
+  float *p,    //parameters of the transform
+  float *b,    //output independent vector
+  float *H,    //Hessian matrix, updated with the new weights
+  float *rho0, //weights of the Hessian, updated with the new weights
+  float lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  bool rebuild, //compute the Hessian from scratch
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny         //number of rows
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_update<TRANSLATION_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, type, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_update<EUCLIDEAN_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, type, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_update<SIMILARITY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, type, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_update<AFFINITY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, type, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_update<HOMOGRAPHY_TRANSFORM>(
+        pts, I2, DIJ, p, b, H, rho0, lambda, type, rebuild, partials,
+        nthreads, nx, ny
+      );
+      break;
+  }
 }
 
 
@@ -290,51 +787,238 @@ float parametric_solve
 
 /**
   *
-  *  Select points
+  *  Select the corner points: the image is divided in cells and the point
+  *  with the strongest corner response of each cell is taken, if its
+  *  response is above CORNER_THRESHOLD times the largest one. If there
+  *  are more than npoints, the strongest are kept. The first pixel of the
+  *  patch around each point is stored in x
+  *
+**/
+static void select_corners(
+  float *R,           //corner response
+  float *score,       //buffer for the response of the corners
+  vector<int> &corners, //buffer for the best point of each cell
+  vector<int> &x, //output first pixel of the patch of each point
+  int npoints,    //number of points
+  int nx,         //number of columns
+  int ny          //number of rows
+)
+{
+  const int radius=PATCH_RADIUS;
+  const int m=2*radius; //margin of the points, as in corner_response
+
+  //the size of the cells is chosen to have about npoints cells
+  int cell=(int)sqrt((nx-2*m)*(double)(ny-2*m)/npoints);
+  if(cell<2*radius+1) cell=2*radius+1;
+  const int cx=(nx-2*m+cell-1)/cell;
+  const int cy=(ny-2*m+cell-1)/cell;
+  const int ncells=cx*cy;
+  corners.resize(ncells);
+
+  //best point of each cell
+  #pragma omp parallel for
+  for(int c=0; c<ncells; c++)
+  {
+    const int i0=m+(c/cx)*cell, i1=min(i0+cell, ny-m);
+    const int j0=m+(c%cx)*cell, j1=min(j0+cell, nx-m);
+    int best=i0*nx+j0;
+    for(int i=i0; i<i1; i++)
+      for(int j=j0; j<j1; j++)
+        if(R[i*nx+j]>R[best]) best=i*nx+j;
+    corners[c]=best;
+  }
+
+  //the cells in flat regions are discarded
+  float Rmax=0;
+  for(int c=0; c<ncells; c++)
+    if(R[corners[c]]>Rmax) Rmax=R[corners[c]];
+  const float threshold=CORNER_THRESHOLD*Rmax;
+
+  int n=0;
+  for(int c=0; c<ncells; c++)
+    if(R[corners[c]]>threshold) score[n++]=R[corners[c]];
+
+  //if there are more corners than npoints, the strongest are kept and
+  //the ones equal to the last response are taken until there are npoints
+  float kth=threshold;
+  int ties=n;
+  if(n>npoints)
+  {
+    nth_element(score, score+n-npoints, score+n);
+    kth=score[n-npoints];
+    ties=npoints;
+    for(int q=n-npoints; q<n; q++)
+      if(score[q]>kth) ties--;
+  }
+
+  //store the patches of the selected corners
+  for(int c=0; c<ncells; c++)
+  {
+    const float r=R[corners[c]];
+    if(r>threshold && (r>kth || (r==kth && ties-->0)))
+      x.push_back(corners[c]-radius*nx-radius);
+  }
+}
+
+
+/**
+  *
+  *  Select the points: a regular grid of GRID_STEP pixels, whatever the
+  *  content of the image, or npoints corners if npoints is positive. The
+  *  first pixel of the patch around each point is stored in x
   *
 **/
 void select_points(
-  float *I,
-  vector<int> &x,
-  int nx,
-  int ny,
-  int verbose
+  float *I,           //image, only used in verbose mode
+  float *R,           //corner response, only used with npoints
+  float *score,       //buffer for the response of the corners
+  vector<int> &corners, //buffer for the best point of each cell
+  vector<int> &x, //output first pixel of the patch of each point
+  int npoints,    //number of points, 0 for a grid of GRID_STEP pixels
+  int nx,         //number of columns
+  int ny,         //number of rows
+  int verbose     //enable verbose mode
 )
 {
   static int s=0;
-  int radius=3;
-  
-  /*for(int i=2*radius;i<ny-2*radius;i+=radius*5)
-    for(int j=2*radius;j<nx-2*radius;j+=radius*5)
-    {
-      for(int k=i-radius;k<=i+radius; k++)
-	for(int l=j-radius;l<=j+radius; l++)
-	  x.push_back(k*nx+l);
-    }
-*/
-
-  for(int i=radius;i<ny-radius;i+=radius)
-    for(int j=radius;j<nx-radius;j+=radius)
-	  x.push_back(i*nx+j);
+  const int radius=PATCH_RADIUS;
+  const int m=2*radius; //margin of the points, as in corner_response
+  if(nx<=2*m || ny<=2*m) return;
 
-  
+  if(npoints>0)
+    select_corners(R, score, corners, x, npoints, nx, ny);
+  else
+    for(int i=m; i<ny-m; i+=GRID_STEP)
+      for(int j=m; j<nx-m; j+=GRID_STEP)
+        x.push_back((i-radius)*nx+j-radius);
 
   if(verbose) 
   {
     float *A=new float[nx*ny]();
-    printf("Number of Harris points: %ld \n", x.size());
-    #pragma omp parallel for
+    printf(
+      "Number of Harris points: %ld (%ld pixels)\n", 
+      x.size(), x.size()*PATCH_SIZE*PATCH_SIZE
+    );
+    //#pragma omp parallel for
     for(int i=0;i<nx*ny;i++) A[i]=I[i];
-    #pragma omp parallel for
+    //#pragma omp parallel for
     for(unsigned int i=0;i<x.size();i++)
-      A[x[i]]=255;
+      for(int k=0; k<PATCH_SIZE; k++)
+        for(int l=0; l<PATCH_SIZE; l++)
+          A[x[i]+k*nx+l]=255;
     char name[100];
     sprintf(name, "verbose_Harris_%d.png",s++);
     save_image(name, A, nx, ny, 1);
     delete[] A;
   }
+}
 
-  
+
+/**
+  *
+  *  Gather the pixels of the patches in contiguous arrays, patch by patch
+  *  and row by row: the first image, its gradient and the coordinates.
+  *  The patches are given by their first pixel in x
+  *
+**/
+void gather_points(
+  float *I1,          //first image
+  float *Ix,          //x derivate of the first image
+  float *Iy,          //y derivate of the first image
+  vector<int> &x, //first pixel of the patch of each point
+  PatchPixels &pts,    //output pixels of the patches
+  int nx          //number of columns
+)
+{
+  const int size=PATCH_SIZE*PATCH_SIZE;
+  const int npatches=x.size();
+  pts.N=npatches*size;
+
+  #pragma omp parallel for
+  for(int q=0; q<npatches; q++)
+  {
+    const int i0=x[q]/nx, j0=x[q]%nx;
+    for(int k=0; k<PATCH_SIZE; k++)
+    {
+      const int r=x[q]+k*nx;          //row of the patch in the image
+      const int n=q*size+k*PATCH_SIZE; //row of the patch in pts
+      for(int l=0; l<PATCH_SIZE; l++)
+      {
+        pts.I1[n+l]=I1[r+l];
+        pts.Ix[n+l]=Ix[r+l];
+        pts.Iy[n+l]=Iy[r+l];
+        pts.x[n+l]=j0+l;
+        pts.y[n+l]=i0+k;
+      }
+    }
+  }
+}
+
+
+/**
+  *
+  *  Select the points of the first image, on a grid or with the corner
+  *  response of its gradient, which is computed with a replicated border
+  *  in both cases, since it is needed for the patches. The gradient is
+  *  left in ws->Ix and ws->Iy and the first pixel of the patch of each
+  *  point in ws->x. It returns the number of pixels of the patches
+  *
+**/
+int select_patches(
+  float *I1,     //first image
+  int npoints,  //number of points, 0 for a grid of GRID_STEP pixels
+  int nx,       //number of columns
+  int ny,       //number of rows
+  int verbose,  //enable verbose mode
+  IcaWorkspace *ws //buffers of the gradient, the points and the response
+)
+{
+  //Evaluate the gradient of I1, with a replicated border
+  gradient(pad_image(I1, ws->Ip, nx, ny), ws->Ix, ws->Iy, nx, ny);
+
+  //with a budget, find corner points with the gradient; Iw, DI and rho
+  //hold the window sums and Is the response, not used until the iterations
+  ws->x.clear();
+  if(npoints>0)
+    corner_response(
+      ws->Ix, ws->Iy, ws->Iw, ws->DI, ws->rho, ws->Is, PATCH_RADIUS, nx, ny
+    );
+  select_points(
+    I1, ws->Is, ws->Iw, ws->corners, ws->x, npoints, nx, ny, verbose
+  );
+
+  return ws->x.size()*PATCH_SIZE*PATCH_SIZE;
+}
+
+
+/**
+  *
+  *  Function to compute the steepest descent images of the patches,
+  *  unless DIJ is NULL, and the inverse Hessian of the quadratic version,
+  *  unless H_1 is NULL
+  *
+**/
+template<int nparams>
+void patch_data(
+  const PatchPixels &pts, //pixels of the patches
+  float *DIJ,    //output steepest descent images, or NULL
+  float *H_1,    //output inverse Hessian, or NULL
+  IcaWorkspace *ws //buffers of the partial sums
+)
+{
+  //Compute the steepest descent images, unless they are computed on the fly
+  if(DIJ!=NULL)
+    steepest_descent_images<nparams>(pts, DIJ);
+
+  //Compute the Hessian matrix and its inverse
+  if(H_1!=NULL)
+  {
+    float H[MAX_NPARAMS*MAX_NPARAMS];
+    quadratic_accumulate<nparams>(
+      DIJ, pts, NULL, NULL, H, ws->partials, ws->nthreads
+    );
+    inverse_hessian(H, H_1, nparams);
+  }
 }
 
 
@@ -345,50 +1029,58 @@ void select_points(
   * 
   *
 **/
+template<int nparams>
 void inverse_compositional_algorithm(
   float *I1,   //first image
   float *I2,   //second image
   float *p,    //parameters of the transform (output)
-  int nparams,  //number of parameters of the transform
   float TOL,   //Tolerance used for the convergence in the iterations
   int nx,        //number of columns
   int ny,        //number of rows
-  int verbose   //enable verbose mode
+  bool matrix_free, //compute the steepest descent images on the fly
+  int npoints,  //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose,  //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
 )
 {
-  float *Ix =new float[nx*ny];   //x derivate of the first image
-  float *Iy =new float[nx*ny];   //y derivate of the first image
-
-  //Evaluate the gradient of I1
-  gradient(I1, Ix, Iy, nx, ny);
-  
-  //find corner points
-  vector<int> x;
-  select_points(I1, x, nx, ny, verbose);
-  
+  //use a temporary workspace if none is given
+  IcaWorkspace tmp;
+  workspace_init(tmp);
+  if(ws==NULL) ws=&tmp;
+
+  workspace_reserve(*ws, nx*ny, 0);
+  workspace_reserve_padded(*ws, nx, ny);
+
+  float *Iw =ws->Iw; //warp of the second image/
+  float *DI =ws->DI; //error image (I2(w)-I1)
+  float *DIJ=NULL;   //steepest descent images
+  float dp[MAX_NPARAMS];  //incremental solution
+  float b[MAX_NPARAMS];   //steepest descent images
+  float H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian matrix
+
+  //Select the points and gather the pixels of their patches once for all
+  //the iterations, with their steepest descent images and the inverse
+  //Hessian, or take them from the precomputed data
+  if(tpl==NULL)
+  {
+    int N=select_patches(I1, npoints, nx, ny, verbose, ws);
+    workspace_reserve(*ws, nx*ny, matrix_free?0:nparams*sd_stride(N), N);
+    gather_points(I1, ws->Ix, ws->Iy, ws->x, ws->pts, nx);
+    if(!matrix_free) DIJ=ws->DIJ;
+    patch_data<nparams>(ws->pts, DIJ, H_1, ws);
+  }
+  else
+  {
+    DIJ=tpl->DIJ;
+    for(int i=0; i<nparams*nparams; i++)
+      H_1[i]=tpl->H_1[i];
+  }
+  const PatchPixels &pts=(tpl==NULL)?ws->pts:tpl->pts;
+  int N=pts.N; //number of pixels of the patches
 
-  int N=x.size();
-  int size2=N*nparams;   //size of the image with transform parameters
-  int size3=nparams*nparams; //size for the Hessian
-  int size4=2*N*nparams; 
-  float *Iw =new float[N];   //warp of the second image/
-  float *DI =new float[N];   //error image (I2(w)-I1)
-  float *DIJ=new float[size2];   //steepest descent images
-  float *dp =new float[nparams]; //incremental solution
-  float *b  =new float[nparams]; //steepest descent images
-  float *J  =new float[size4];   //jacobian matrix for all points
-  float *H  =new float[size3];   //Hessian matrix
-  float *H_1=new float[size3];   //inverse Hessian matrix
-
-  //Evaluate the Jacobian
-  jacobian(J, x, nparams, nx);
-
-  //Compute the steepest descent images
-  steepest_descent_images(Ix, Iy, J, DIJ, nparams, x);
-
-  //Compute the Hessian matrix
-  hessian(DIJ, H, nparams, N);
-  inverse_hessian(H, H_1, nparams);
+  //I2 is warped with its border replicated
+  float *I2p=pad_image(I2, ws->Ip, nx, ny);
 
   //Iterate
   float error=1E10;
@@ -396,13 +1088,15 @@ void inverse_compositional_algorithm(
 
   do{     
     //Warp image I2
-    bicubic_interpolation(I2, x, Iw, p, nparams, nx, ny);
+    bicubic_interpolation<nparams>(I2p, pts.x, pts.y, Iw, p, N, nx, ny);
 
     //Compute the error image (I1-I2w)
-    difference_image(I1, Iw, x, DI);
+    difference_image(pts.I1, Iw, DI, N);
     
     //Compute the independent vector
-    independent_vector(DIJ, DI, b, nparams, N);
+    quadratic_accumulate<nparams>(
+      DIJ, pts, DI, b, NULL, ws->partials, ws->nthreads
+    );
 
     //Solve equation and compute increment of the motion 
     error=parametric_solve(H_1, b, dp, nparams);
@@ -421,17 +1115,59 @@ void inverse_compositional_algorithm(
   }
   while(error>TOL && niter<MAX_ITER);
   
-  //delete allocated memory
-  delete []DI;
-  delete []Ix;
-  delete []Iy;
-  delete []Iw;
-  delete []DIJ;
-  delete []dp;
-  delete []b;
-  delete []J;
-  delete []H;
-  delete []H_1;
+  //delete the temporary workspace
+  workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void inverse_compositional_algorithm(
+  float *I1,   //first image
+  float *I2,   //second image
+  float *p,    //parameters of the transform (output)
+  int nparams,  //number of parameters of the transform
+  float TOL,   //Tolerance used for the convergence in the iterations
+  int nx,        //number of columns
+  int ny,        //number of rows
+  bool matrix_free, //compute the steepest descent images on the fly
+  int npoints,  //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose,  //enable verbose mode
+  IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, TOL, nx, ny, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, TOL, nx, ny, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, TOL, nx, ny, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, TOL, nx, ny, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, TOL, nx, ny, matrix_free, npoints, verbose, ws
+      );
+      break;
+  }
 }
 
 
@@ -442,48 +1178,55 @@ void inverse_compositional_algorithm(
   *  Version with robust error functions
   * 
 **/
+template<int nparams, class Robust>
 void robust_inverse_compositional_algorithm(
   float *I1,    //first image
   float *I2,    //second image
   float *p,     //parameters of the transform (output)
-  int nparams,   //number of parameters of the transform
   float TOL,    //Tolerance used for the convergence in the iterations
-  int    robust, //robust error function
   float lambda, //parameter of robust error function
   int nx,        //number of columns
   int ny,        //number of rows
-  int verbose    //enable verbose mode
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int npoints,   //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
 )
 {  
-  float *Ix =new float[nx*ny];       //x derivate of the first image
-  float *Iy =new float[nx*ny];       //y derivate of the first image
-
-  //Evaluate the gradient of I1
-  gradient(I1, Ix, Iy, nx, ny);
-
-  //find corner points
-  vector<int> x;
-  select_points(I1, x, nx, ny, verbose);      
-
-  int N=x.size();            //number of corner points
-  int size2=N*nparams;   //size of the image with transform parameters
-  int size3=nparams*nparams; //size for the Hessian
-  int size4=2*N*nparams; 
-  float *Iw =new float[N];       //warp of the second image/
-  float *DI =new float[N];       //error image (I2(w)-I1)
-  float *DIJ=new float[size2];   //steepest descent images
-  float *dp =new float[nparams]; //incremental solution
-  float *b  =new float[nparams]; //steepest descent images
-  float *J  =new float[size4];   //jacobian matrix for all points
-  float *H  =new float[size3];   //Hessian matrix
-  float *H_1=new float[size3];   //inverse Hessian matrix
-  float *rho=new float[N];       //robust function  
-  
-  //Evaluate the Jacobian
-  jacobian(J, x, nparams, nx);
+  //use a temporary workspace if none is given
+  IcaWorkspace tmp;
+  workspace_init(tmp);
+  if(ws==NULL) ws=&tmp;
+
+  workspace_reserve(*ws, nx*ny, 0);
+  workspace_reserve_padded(*ws, nx, ny);
+
+  float *DIJ=NULL; //steepest descent images
+  float dp[MAX_NPARAMS];  //incremental solution
+  float b[MAX_NPARAMS];   //steepest descent images
+  float H[MAX_NPARAMS*MAX_NPARAMS];   //Hessian matrix
+  float H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian matrix
+
+  //Select the points and gather the pixels of their patches once for all
+  //the iterations, with their steepest descent images, or take them from
+  //the precomputed data. The Hessian depends on the weights of the robust
+  //function
+  if(tpl==NULL)
+  {
+    int N=select_patches(I1, npoints, nx, ny, verbose, ws);
+    workspace_reserve(*ws, nx*ny, matrix_free?0:nparams*sd_stride(N), N);
+    gather_points(I1, ws->Ix, ws->Iy, ws->x, ws->pts, nx);
+    if(!matrix_free) DIJ=ws->DIJ;
+    patch_data<nparams>(ws->pts, DIJ, NULL, ws);
+  }
+  else
+    DIJ=tpl->DIJ;
+  const PatchPixels &pts=(tpl==NULL)?ws->pts:tpl->pts;
 
-  //Compute the steepest descent images
-  steepest_descent_images(Ix, Iy, J, DIJ, nparams, x);
+  //I2 is warped with its border replicated
+  float *I2p=pad_image(I2, ws->Ip, nx, ny);
   
   //Iterate
   float error=1E10;
@@ -494,26 +1237,29 @@ void robust_inverse_compositional_algorithm(
   else lambda_it=LAMBDA_0;
   
   do{     
-    //Warp image I2
-    bicubic_interpolation(I2, x, Iw, p, nparams, nx, ny);
-
-    //Compute the error image (I1-I2w)
-    difference_image(I1, Iw, x, DI);
-
-    //compute robustifiction function
-    robust_error_function(DI, rho, lambda_it, robust, N);
+    //Warp image I2 and compute the independent vector and the Hessian
+    //with the robust function in a single pass. If the Hessian is reused,
+    //it is rebuilt every hessian_reuse iterations and updated in between
+    bool rebuild=(hessian_reuse<=0 || niter%hessian_reuse==0);
+    if(hessian_reuse<=0)
+      robust_accumulate<nparams, Robust>(
+        pts, I2p, DIJ, p, b, H, lambda_it,
+        ws->partials, ws->nthreads, nx, ny
+      );
+    else
+      robust_update<nparams, Robust>(
+        pts, I2p, DIJ, p, b, H, ws->rho, lambda_it, rebuild,
+        ws->partials, ws->nthreads, nx, ny
+      );
     if(lambda<=0 && lambda_it>LAMBDA_N) 
     {
       lambda_it*=LAMBDA_RATIO;
       if(lambda_it<LAMBDA_N) lambda_it=LAMBDA_N;
     }
 
-    //Compute the independent vector
-    independent_vector(DIJ, DI, rho, b, nparams, N);
-
-    //Compute the Hessian matrix
-    hessian(DIJ, rho, H, nparams, N);
-    inverse_hessian(H, H_1, nparams);
+    //Compute the inverse of the Hessian matrix, unless it is kept
+    if(rebuild || Robust::binary)
+      inverse_hessian(H, H_1, nparams);
 
     //Solve equation and compute increment of the motion 
     error=parametric_solve(H_1, b, dp, nparams);
@@ -532,18 +1278,155 @@ void robust_inverse_compositional_algorithm(
   }
   while(error>TOL && niter<MAX_ITER);
   
-  //delete allocated memory
-  delete []DI;
-  delete []Ix;
-  delete []Iy;
-  delete []Iw;
-  delete []DIJ;
-  delete []dp;
-  delete []b;
-  delete []J;
-  delete []H;
-  delete []H_1;
-  delete []rho;
+  //delete the temporary workspace
+  workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of robust_inverse_compositional_algorithm to the version for
+  *  the robust function chosen at run time
+  *
+**/
+template<int nparams>
+void robust_inverse_compositional_algorithm(
+  float *I1,    //first image
+  float *I2,    //second image
+  float *p,     //parameters of the transform (output)
+  float TOL,    //Tolerance used for the convergence in the iterations
+  int    robust, //robust error function
+  float lambda, //parameter of robust error function
+  int nx,        //number of columns
+  int ny,        //number of rows
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int npoints,   //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws, //buffers reused across calls, or NULL
+  const IcaTemplate *tpl=NULL //precomputed data of I1, or NULL
+)
+{
+  switch(robust)
+  {
+    case QUADRATIC:
+      robust_inverse_compositional_algorithm<nparams, Quadratic>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+    default: case TRUNCATED_QUADRATIC:
+      robust_inverse_compositional_algorithm<nparams, TruncatedQuadratic>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+    case GERMAN_MCCLURE:
+      robust_inverse_compositional_algorithm<nparams, GemanMcClure>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+    case LORENTZIAN:
+      robust_inverse_compositional_algorithm<nparams, Lorentzian>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+    case CHARBONNIER:
+      robust_inverse_compositional_algorithm<nparams, Charbonnier>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+    case CHARBONNIER_FAST:
+      robust_inverse_compositional_algorithm<nparams, CharbonnierFast>(
+        I1, I2, p, TOL, lambda, nx, ny, matrix_free, hessian_reuse,
+        npoints, verbose, ws, tpl
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Dispatch of robust_inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void robust_inverse_compositional_algorithm(
+  float *I1,    //first image
+  float *I2,    //second image
+  float *p,     //parameters of the transform (output)
+  int nparams,   //number of parameters of the transform
+  float TOL,    //Tolerance used for the convergence in the iterations
+  int    robust, //robust error function
+  float lambda, //parameter of robust error function
+  int nx,        //number of columns
+  int ny,        //number of rows
+  bool matrix_free, //compute the steepest descent images on the fly
+  int hessian_reuse, //iterations between rebuilds of the robust Hessian
+  int npoints,   //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose,   //enable verbose mode
+  IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      robust_inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, TOL, robust, lambda, nx, ny, matrix_free,
+        hessian_reuse, npoints, verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      robust_inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, TOL, robust, lambda, nx, ny, matrix_free,
+        hessian_reuse, npoints, verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      robust_inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, TOL, robust, lambda, nx, ny, matrix_free,
+        hessian_reuse, npoints, verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      robust_inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, TOL, robust, lambda, nx, ny, matrix_free,
+        hessian_reuse, npoints, verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      robust_inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, TOL, robust, lambda, nx, ny, matrix_free,
+        hessian_reuse, npoints, verbose, ws
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Coarsest scale at which a motion of residual pixels at the finest
+  *  scale is at most WARM_START_RANGE pixels
+  *
+**/
+static int start_scale(
+  float residual, //motion at the finest scale, in pixels
+  float nu,       //downsampling factor
+  int nscales     //number of scales
+)
+{
+  int s=0;
+  while(s<nscales-1 && residual>WARM_START_RANGE)
+  {
+    residual*=nu;
+    s++;
+  }
+  return s;
 }
 
 
@@ -552,11 +1435,11 @@ void robust_inverse_compositional_algorithm(
   *  Multiscale approach for computing the optical flow
   *
 **/
+template<int nparams>
 void pyramidal_inverse_compositional_algorithm(
-    float *I1,     //first image
-    float *I2,     //second image
-    float *p,      //parameters of the transform
-    int    nparams, //number of parameters
+    float *I1,   //first image
+    float *I2,   //second image
+    float *p,    //parameters of the transform
     int    nxx,     //image width
     int    nyy,     //image height
     int    nscales, //number of scales
@@ -564,58 +1447,89 @@ void pyramidal_inverse_compositional_algorithm(
     float TOL,     //stopping criterion threshold
     int    robust,  //robust error function
     float lambda,  //parameter of robust error function
-    bool   verbose  //switch on messages
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws, //buffers reused across calls, or NULL
+    float *p0,       //initial transform, or NULL to start from zero
+    float residual,  //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref //precomputed data of I1, or NULL
 )
 {
-    int size=nxx*nyy;
-
-    float **I1s=new float*[nscales];
-    float **I2s=new float*[nscales];
-    float **ps =new float*[nscales];
-
-    int *nx=new int[nscales];
-    int *ny=new int[nscales];
-
-    I1s[0]=new float[size];
-    I2s[0]=new float[size];
-
-    //copy the input images
-    #pragma omp parallel for
-    for(int i=0;i<size;i++)
-    {
-      I1s[0][i]=I1[i];
-      I2s[0][i]=I2[i];
-    }
-
+    //use a temporary workspace if none is given
+    IcaWorkspace tmp;
+    workspace_init(tmp);
+    if(ws==NULL) ws=&tmp;
+
+    //with an initial transform, the scales coarser than those needed for
+    //the residual motion are skipped
+    int nlevels=nscales;
+    if(p0!=NULL && residual>=0)
+      nlevels=start_scale(residual, nu, nscales)+1;
+
+    //the reference is only used if it was built with the same options
+    if(
+      ref!=NULL && !reference_compatible(
+        *ref, nparams, nxx, nyy, nscales, nu, matrix_free, npoints
+      )
+    )
+      ref=NULL;
+
+    //the pyramid of the first image is kept from the last call if it was
+    //rolled, for the same size (see workspace_roll_pyramid)
+    bool rolled=nlevels<=ws->rolled && nxx==ws->nx[0] && nyy==ws->ny[0];
+    ws->rolled=0;
+
+    //size the images for the finest scale; the steepest descent images
+    //and the points grow with the number of points selected at each scale
+    workspace_reserve_pyramid(*ws, nxx, nyy, nscales, nu);
+    workspace_reserve(*ws, nxx*nyy, 0);
+    workspace_reserve_padded(*ws, nxx, nyy);
+
+    float **I1s=ws->I1s;
+    float **I2s=ws->I2s;
+    float **ps =ws->ps;
+
+    int *nx=ws->nx;
+    int *ny=ws->ny;
+
+    //the finest scale uses the input images
+    I1s[0]=I1;
+    I2s[0]=I2;
     ps[0]=p;
-    nx[0]=nxx;
-    ny[0]=nyy;
 
     //initialization of the transformation parameters at the finest scale
     for(int i=0; i<nparams; i++)
-      p[i]=0.0;
+      p[i]=(p0==NULL)?0.0:p0[i];
 
     //create the scales
-    for(int s=1; s<nscales; s++)
+    for(int s=1; s<nlevels; s++)
     {
-      zoom_size(nx[s-1], ny[s-1], nx[s], ny[s], nu);
-
-      const int size=nx[s]*ny[s];
-
-      I1s[s]=new float[size];
-      I2s[s]=new float[size];
-      ps[s] =new float[nparams];
-      
-      for(int i=0; i<nparams; i++)
-        ps[s][i]=0.0;
+      //down-project the initial transform, or start from zero
+      if(p0==NULL)
+        for(int i=0; i<nparams; i++)
+          ps[s][i]=0.0;
+      else
+        zoom_out_parameters(
+          ps[s-1], ps[s], nparams, nx[s-1], ny[s-1], nx[s], ny[s]
+        );
 
-      //zoom the images from the previous scale
-      zoom_out(I1s[s-1], I1s[s], nx[s-1], ny[s-1], nu);
-      zoom_out(I2s[s-1], I2s[s], nx[s-1], ny[s-1], nu);
+      //zoom the images from the previous scale, or only the second one,
+      //since the reference only keeps the patches of the first one
+      if(rolled || ref!=NULL)
+        zoom_out(
+          I2s[s-1], NULL, I2s[s], NULL, nx[s-1], ny[s-1], nu, ws->Is
+        );
+      else
+        zoom_out(
+          I1s[s-1], I2s[s-1], I1s[s], I2s[s], nx[s-1], ny[s-1], nu, ws->Is
+        );
     }  
+    ws->levels=nlevels;
 
     //pyramidal approach for computing the transformation
-    for(int s=nscales-1; s>=0; s--)
+    for(int s=nlevels-1; s>=0; s--)
     {
       if(verbose) printf("Scale: %d (%d,%d)\n",s,nx[s],ny[s]);
 
@@ -624,17 +1538,20 @@ void pyramidal_inverse_compositional_algorithm(
       {
         if(verbose) printf("(L2 norm)\n");
 
-        inverse_compositional_algorithm(
-          I1s[s], I2s[s], ps[s], nparams, TOL, nx[s], ny[s], verbose
+        inverse_compositional_algorithm<nparams>(
+          I1s[s], I2s[s], ps[s], TOL, nx[s], ny[s],
+          matrix_free, npoints, verbose, ws,
+          (ref==NULL)?NULL:&(ref->scales[s])
         );
       }
       else
       {
         if(verbose) printf("(Robust error function %d)\n",robust);
 
-        robust_inverse_compositional_algorithm(
-          I1s[s], I2s[s], ps[s], nparams, TOL, 
-          robust, lambda, nx[s], ny[s], verbose
+        robust_inverse_compositional_algorithm<nparams>(
+          I1s[s], I2s[s], ps[s], TOL, 
+          robust, lambda, nx[s], ny[s], matrix_free, hessian_reuse,
+          npoints, verbose, ws, (ref==NULL)?NULL:&(ref->scales[s])
         );
       }
 
@@ -645,18 +1562,232 @@ void pyramidal_inverse_compositional_algorithm(
         );
     }
 
-    //delete allocated memory
-    delete []I1s[0];
-    delete []I2s[0];
-    for(int i=1; i<nscales; i++)
+    //the input images do not belong to the workspace
+    I1s[0]=I2s[0]=ps[0]=NULL;
+
+    //delete the temporary workspace
+    workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of pyramidal_inverse_compositional_algorithm to the version for
+  *  the transform chosen at run time
+  *
+**/
+void pyramidal_inverse_compositional_algorithm(
+    float *I1,   //first image
+    float *I2,   //second image
+    float *p,    //parameters of the transform
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    float nu,      //downsampling factor
+    float TOL,     //stopping criterion threshold
+    int    robust,  //robust error function
+    float lambda,  //parameter of robust error function
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws, //buffers reused across calls, or NULL
+    float *p0,       //initial transform, or NULL to start from zero
+    float residual,  //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref //precomputed data of I1, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<TRANSLATION_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, npoints, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<EUCLIDEAN_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, npoints, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<SIMILARITY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, npoints, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<AFFINITY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, npoints, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      pyramidal_inverse_compositional_algorithm<HOMOGRAPHY_TRANSFORM>(
+        I1, I2, p, nxx, nyy, nscales, nu, TOL, robust, lambda, matrix_free,
+        hessian_reuse, npoints, verbose, ws,
+        p0, residual, ref
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Select the points of a reference image at each scale and compute the
+  *  data of their patches, in the same way as the estimation computes
+  *  them for the first image
+  *
+**/
+template<int nparams>
+void reference_build(
+    IcaReference &ref, //output reference
+    float *I1,     //reference image
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    float nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+    //use a temporary workspace if none is given
+    IcaWorkspace tmp;
+    workspace_init(tmp);
+    if(ws==NULL) ws=&tmp;
+
+    workspace_reserve(*ws, nxx*nyy, 0);
+    workspace_reserve_padded(*ws, nxx, nyy);
+
+    reference_free(ref);
+    ref.nparams=nparams;
+    ref.nscales=nscales;
+    ref.nu=nu;
+    ref.matrix_free=matrix_free;
+    ref.npoints=npoints;
+    ref.checksum=reference_checksum(I1, nxx*nyy);
+    ref.nx=new int[nscales];
+    ref.ny=new int[nscales];
+    ref.scales=new IcaTemplate[nscales];
+
+    //the scales of the image are only kept until their points are selected
+    float *I=I1;
+    ref.nx[0]=nxx;
+    ref.ny[0]=nyy;
+    for(int s=0; s<nscales; s++)
     {
-      delete []I1s[i];
-      delete []I2s[i];
-      delete []ps [i];
+      int nx=ref.nx[s], ny=ref.ny[s];
+      if(s)
+      {
+        float *Iz=new float[nx*ny];
+        zoom_out(I, NULL, Iz, NULL, ref.nx[s-1], ref.ny[s-1], nu, ws->Is);
+        if(I!=I1) delete []I;
+        I=Iz;
+      }
+      if(s<nscales-1)
+        zoom_size(nx, ny, ref.nx[s+1], ref.ny[s+1], nu);
+
+      if(verbose) printf("Reference scale: %d (%d,%d)\n", s, nx, ny);
+
+      //gather the pixels of the patches and compute their data
+      IcaTemplate &t=ref.scales[s];
+      PatchPixels &pts=t.pts;
+      int N=select_patches(I, npoints, nx, ny, verbose, ws);
+      pts.I1=new float[N];
+      pts.Ix=new float[N];
+      pts.Iy=new float[N];
+      pts.x=new float[N];
+      pts.y=new float[N];
+      gather_points(I, ws->Ix, ws->Iy, ws->x, pts, nx);
+      t.DIJ=matrix_free?NULL:sd_allocate(nparams, N);
+      patch_data<nparams>(pts, t.DIJ, t.H_1, ws);
     }
-    delete []I1s;
-    delete []I2s;
-    delete []ps;
-    delete []nx;
-    delete []ny;
+    if(I!=I1) delete []I;
+
+    //delete the temporary workspace
+    workspace_free(tmp);
+}
+
+
+/**
+  *
+  *  Dispatch of reference_build to the version for the transform chosen
+  *  at run time
+  *
+**/
+void reference_build(
+    IcaReference &ref, //output reference
+    float *I1,     //reference image
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    float nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws //buffers reused across calls, or NULL
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      reference_build<TRANSLATION_TRANSFORM>(
+        ref, I1, nxx, nyy, nscales, nu, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      reference_build<EUCLIDEAN_TRANSFORM>(
+        ref, I1, nxx, nyy, nscales, nu, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      reference_build<SIMILARITY_TRANSFORM>(
+        ref, I1, nxx, nyy, nscales, nu, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      reference_build<AFFINITY_TRANSFORM>(
+        ref, I1, nxx, nyy, nscales, nu, matrix_free, npoints, verbose, ws
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      reference_build<HOMOGRAPHY_TRANSFORM>(
+        ref, I1, nxx, nyy, nscales, nu, matrix_free, npoints, verbose, ws
+      );
+      break;
+  }
+}
+
+
+/**
+  *
+  *  Check that a reference was built with the options of an estimation,
+  *  so that the estimation can use it
+  *
+**/
+bool reference_compatible(
+    const IcaReference &ref, //reference
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    float nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    npoints  //number of points at each scale, 0 for automatic
+)
+{
+  return
+    ref.nparams==nparams && ref.nscales==nscales && ref.nu==nu &&
+    ref.nx[0]==nxx && ref.ny[0]==nyy &&
+    ref.matrix_free==matrix_free && ref.npoints==npoints;
 }
@@ -10,10 +10,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h> 
+#include <math.h>
 #include <algorithm>
+#include <string>
+#include <vector>
+#include <omp.h>
 
 #include "inverse_compositional_algorithm.h"
 #include "file.h"
+#include "transformation.h"
 
 #define PAR_DEFAULT_NSCALES 5
 #define PAR_DEFAULT_ZFACTOR 0.5
@@ -22,7 +27,15 @@
 #define PAR_DEFAULT_ROBUST 3
 #define PAR_DEFAULT_LAMBDA 0.0
 #define PAR_DEFAULT_VERBOSE 0
+#define PAR_DEFAULT_WARM_START 0
+#define PAR_DEFAULT_REFERENCE 0
+#define PAR_DEFAULT_MATRIX_FREE 0
+#define PAR_DEFAULT_HESSIAN_REUSE 0
+#define PAR_DEFAULT_NPOINTS 0
 #define PAR_DEFAULT_OUTFILE "transform.mat"
+#define PAR_DEFAULT_ACCFILE "accumulated.mat"
+#define PAR_DEFAULT_DATAFILE ""
+#define PAR_DEFAULT_MANIFEST ""
 
 /**
  *
@@ -31,8 +44,12 @@
  */
 void print_help(char *name) 
 {
-  printf("\n<Usage>: %s image1 image2 [OPTIONS] \n\n", name);
+  printf("\n<Usage>: %s image1 image2 [image3 ...] [OPTIONS] \n", name);
+  printf("         %s -i manifest [OPTIONS] \n\n", name);
   printf("This program calculates the transformation between two images.\n");
+  printf("With more images, it calculates the transformations between\n");
+  printf("consecutive images of a sequence, or from the first image to\n");
+  printf("each of the others.\n");
   printf("It implements the inverse compositional algorithm. \n");
   printf("More information in http://www.ipol.im \n\n");
   printf("OPTIONS:\n");
@@ -40,6 +57,11 @@ void print_help(char *name)
   printf(" -f name \t Name of the output filename that will contain the\n");
   printf("         \t   computed transformation\n");
   printf("         \t   Default value %s\n", PAR_DEFAULT_OUTFILE);
+  printf(" -c name \t Name of the output filename that will contain the\n");
+  printf("         \t   transformations from the first image of a sequence\n");
+  printf("         \t   to each image; those between consecutive images are\n");
+  printf("         \t   saved in the file of -f\n");
+  printf("         \t   Default value %s\n", PAR_DEFAULT_ACCFILE);
   printf(" -n N    \t Number of scales for the coarse-to-fine scheme\n");
   printf("         \t   Default value %d\n", PAR_DEFAULT_NSCALES);
   printf(" -z F    \t Zoom factor used in the coarse-to-fine scheme \n");
@@ -56,11 +78,41 @@ void print_help(char *name)
   printf(" -r N    \t Use robust error functions: \n");
   printf("         \t   0-Non robust (L2 norm); 1-truncated quadratic\n"); 
   printf("         \t   2-German & McLure; 3-Lorentzian 4-Charbonnier \n");
+  printf("         \t   5-Charbonnier with a fast reciprocal square root\n");
   printf("         \t   Default value %d\n", 
                         PAR_DEFAULT_ROBUST);
   printf(" -l F    \t Value of the parameter for the robust error function\n");
   printf("         \t   A value <=0 if it is automatically computed\n");
   printf("         \t   Default value %0.0f\n", PAR_DEFAULT_LAMBDA);
+  printf(" -m      \t Matrix-free mode: compute the steepest descent images\n");
+  printf("         \t   on the fly instead of storing them (less memory)\n");
+  printf(" -k N    \t Iterations between rebuilds of the robust Hessian\n");
+  printf("         \t   In between, it is updated with the pixels that\n");
+  printf("         \t   enter or leave the inliers (truncated quadratic)\n");
+  printf("         \t   or kept (other functions). 0 rebuilds it always\n");
+  printf("         \t   Default value %d\n", PAR_DEFAULT_HESSIAN_REUSE);
+  printf(" -p N    \t Number of corner points at each scale, picked with\n");
+  printf("         \t   the strongest Shi-Tomasi response of a grid of\n");
+  printf("         \t   cells. 0 uses a regular grid of points every %d\n",
+                        GRID_STEP);
+  printf("         \t   pixels, whatever the content of the image\n");
+  printf("         \t   Default value %d\n", PAR_DEFAULT_NPOINTS);
+  printf(" -w      \t Warm start in a sequence: each pair starts from the\n");
+  printf("         \t   transform of the previous pair, at the coarsest\n");
+  printf("         \t   scale needed for the change of the motion\n");
+  printf(" -g      \t Align each image to the first one, in parallel. The\n");
+  printf("         \t   points of the first image and the data of their\n");
+  printf("         \t   patches at each scale are computed once\n");
+  printf(" -d name \t File of the data of the first image, for -g. It is\n");
+  printf("         \t   mapped in memory if it was saved for the same image\n");
+  printf("         \t   and options, or computed and saved otherwise\n");
+  printf(" -i name \t Batch mode: align the pairs of a manifest, with one\n");
+  printf("         \t   line per pair: image1 image2 [OPTIONS] output\n");
+  printf("         \t   The options of the line are added to those of the\n");
+  printf("         \t   command line. The pairs are aligned in parallel,\n");
+  printf("         \t   one per thread, and their transforms are written\n");
+  printf("         \t   to the file of -f, one line per pair: output,\n");
+  printf("         \t   number of parameters and parameters\n");
   printf(" -v      \t Switch on verbose mode. \n\n\n");
 }
 
@@ -73,15 +125,23 @@ void print_help(char *name)
 int read_parameters(
     int    argc, 
     char   *argv[], 
-    char   **image1,
-    char   **image2,
+    char   **&images,
+    int    &nimages,
     char   *outfile,
+    char   *accfile,
     int    &nscales,
     float &zfactor,
     float &TOL,
     int    &nparams,
     int    &robust,
     float &lambda,
+    int    &matrix_free,
+    int    &hessian_reuse,
+    int    &npoints,
+    int    &warm_start,
+    int    &reference,
+    char   *datafile,
+    char   *manifest,
     int    &verbose
 )
 {
@@ -90,12 +150,17 @@ int read_parameters(
     return 0;
   }
   else{
+    //the images are the arguments before the first option
     int i=1;
-    *image1=argv[i++];
-    *image2=argv[i++];      
+    images=&(argv[i]);
+    while(i<argc && argv[i][0]!='-') i++;
+    nimages=i-1;
 
     //assign default values to the parameters
     strcpy(outfile,PAR_DEFAULT_OUTFILE);
+    strcpy(accfile,PAR_DEFAULT_ACCFILE);
+    strcpy(datafile,PAR_DEFAULT_DATAFILE);
+    strcpy(manifest,PAR_DEFAULT_MANIFEST);
     nscales=PAR_DEFAULT_NSCALES;
     zfactor=PAR_DEFAULT_ZFACTOR;
     TOL    =PAR_DEFAULT_TOL;
@@ -103,6 +168,11 @@ int read_parameters(
     robust =PAR_DEFAULT_ROBUST; 
     lambda =PAR_DEFAULT_LAMBDA; 
     verbose=PAR_DEFAULT_VERBOSE; 
+    warm_start=PAR_DEFAULT_WARM_START;
+    reference=PAR_DEFAULT_REFERENCE;
+    matrix_free=PAR_DEFAULT_MATRIX_FREE;
+    hessian_reuse=PAR_DEFAULT_HESSIAN_REUSE;
+    npoints=PAR_DEFAULT_NPOINTS;
 
     //read each parameter from the command line
     while(i<argc)
@@ -111,6 +181,10 @@ int read_parameters(
         if(i<argc-1)
           strcpy(outfile,argv[++i]);
       
+      if(strcmp(argv[i],"-c")==0)
+        if(i<argc-1)
+          strcpy(accfile,argv[++i]);
+
       if(strcmp(argv[i],"-n")==0)
         if(i<argc-1)
           nscales=atoi(argv[++i]);
@@ -135,11 +209,46 @@ int read_parameters(
         if(i<argc-1)
           lambda=atof(argv[++i]);
 
+      if(strcmp(argv[i],"-m")==0)
+        matrix_free=1;
+
+      if(strcmp(argv[i],"-k")==0)
+        if(i<argc-1)
+          hessian_reuse=atoi(argv[++i]);
+
+      if(strcmp(argv[i],"-p")==0)
+        if(i<argc-1)
+          npoints=atoi(argv[++i]);
+
+      if(strcmp(argv[i],"-w")==0)
+        warm_start=1;
+
+      if(strcmp(argv[i],"-g")==0)
+        reference=1;
+
+      if(strcmp(argv[i],"-d")==0)
+        if(i<argc-1)
+        {
+          strcpy(datafile,argv[++i]);
+          reference=1;
+        }
+
+      if(strcmp(argv[i],"-i")==0)
+        if(i<argc-1)
+          strcpy(manifest,argv[++i]);
+
       if(strcmp(argv[i],"-v")==0)
         verbose=1;
       
       i++;
     }
+
+    //the batch mode takes the images from the manifest
+    if(nimages<2 && *manifest=='\0')
+    {
+      print_help(argv[0]);
+      return 0;
+    }
     
     //check parameter values
     if(nscales <= 0)           nscales=PAR_DEFAULT_NSCALES;
@@ -147,8 +256,10 @@ int read_parameters(
     if(TOL<0)                  TOL    =PAR_DEFAULT_TOL;
     if(nparams!=2 && nparams!=3 && nparams!=4 && 
      nparams!=6 && nparams!=8) nparams=PAR_DEFAULT_TYPE;
-    if(robust<0||robust>4)     robust =PAR_DEFAULT_ROBUST;
+    if(robust<0||robust>5)     robust =PAR_DEFAULT_ROBUST;
     if(lambda<0)               lambda =PAR_DEFAULT_LAMBDA;
+    if(hessian_reuse<0)        hessian_reuse=PAR_DEFAULT_HESSIAN_REUSE;
+    if(npoints<0)              npoints=PAR_DEFAULT_NPOINTS;
   }
 
   return 1;
@@ -184,37 +295,227 @@ void rgb2gray(
 
 
 
+/**
+ *
+ *  Batch mode: align the pairs of images of a manifest and write their
+ *  transforms to one file, in the order of the manifest. Each line holds
+ *  "image1 image2 [OPTIONS] output", where the options are added to those
+ *  of the command line and output names the transform of the pair. The
+ *  pairs are aligned in parallel, one per thread of the team, and the
+ *  parallel loops of the method are run by the thread of each pair. It
+ *  returns false if a pair cannot be aligned
+ *
+ */
+bool align_manifest(
+  char *manifest, //name of the manifest
+  char *outfile,  //name of the file of the transforms
+  int  argc,      //number of arguments of the command line
+  char *argv[]    //arguments of the command line
+)
+{
+  //read the lines of the manifest, without empty lines and comments
+  FILE *fd=fopen(manifest, "r");
+  if(fd==NULL)
+  {
+    printf("Cannot read the manifest %s\n", manifest);
+    return false;
+  }
+
+  std::vector<std::string> lines;
+  char *line=NULL;
+  size_t length=0;
+  while(getline(&line, &length, fd)>=0)
+  {
+    const char *c=line+strspn(line, " \t\r\n");
+    if(*c!='\0' && *c!='#') lines.push_back(c);
+  }
+  free(line);
+  fclose(fd);
+
+  FILE *out=fopen(outfile, "w");
+  if(out==NULL)
+  {
+    printf("Cannot write the transforms to %s\n", outfile);
+    return false;
+  }
+
+  int npairs=lines.size();
+  float *p=new float[npairs*MAX_NPARAMS];
+  std::vector<std::string> names(npairs);
+  int *np=new int[npairs]; //parameters of each pair, 0 until it is
+                           //aligned and -1 if it fails
+  for(int n=0; n<npairs; n++) np[n]=0;
+  int next=0;    //first pair whose transform is not written
+  int failed=0;  //number of pairs that cannot be aligned
+
+  //only the pairs are run in parallel, not the loops of the method
+  omp_set_max_active_levels(1);
+
+  const double begin=omp_get_wtime();
+  #pragma omp parallel
+  {
+    IcaWorkspace ws;
+    workspace_init(ws);
+
+    #pragma omp for schedule(dynamic)
+    for(int n=0; n<npairs; n++)
+    {
+      //split the line into the images, the options and the output, and
+      //add the options of the command line before those of the line
+      std::vector<char> text(lines[n].begin(), lines[n].end());
+      text.push_back('\0');
+      std::vector<char *> args(1, argv[0]);
+      char *state;
+      for(
+        char *w=strtok_r(&(text[0]), " \t\r\n", &state); w!=NULL;
+        w=strtok_r(NULL, " \t\r\n", &state)
+      )
+        args.push_back(w);
+
+      bool correct=(args.size()>=4);
+      if(correct)
+      {
+        names[n]=args.back();
+        args.pop_back();
+        args.insert(args.begin()+3, argv+1, argv+argc);
+      }
+
+      //parameters of the pair
+      char **images, outfile1[200], accfile1[200], datafile1[200];
+      char manifest1[200];
+      int nimages, warm_start, reference;
+      int nscales, nparams, robust, matrix_free, hessian_reuse;
+      int npoints, verbose;
+      float zfactor, TOL, lambda;
+
+      correct=correct && read_parameters(
+        args.size(), &(args[0]), images, nimages, outfile1, accfile1,
+        nscales, zfactor, TOL, nparams, robust, lambda, matrix_free,
+        hessian_reuse, npoints, warm_start, reference, datafile1, manifest1,
+        verbose
+      );
+
+      //the decoders of the images are not reentrant
+      float *I1=NULL, *I2=NULL;
+      int nx=0, ny=0, nz=0, nx2=0, ny2=0, nz2=0;
+      #pragma omp critical(read_image)
+      if(correct)
+        correct=
+          read_image(images[0], &I1, nx, ny, nz) &&
+          read_image(images[1], &I2, nx2, ny2, nz2);
+
+      if(correct && nx==nx2 && ny==ny2 && nz==nz2)
+      {
+        //limit the number of scales according to image size (min 32x32)
+        const float N=1+log(std::min(nx, ny)/32.)/log(1./zfactor);
+        if ((int) N<nscales) nscales=(int) N;
+
+        float *I1g=new float[nx*ny];
+        float *I2g=new float[nx*ny];
+        rgb2gray(I1, I1g, nx, ny, nz);
+        rgb2gray(I2, I2g, nx, ny, nz);
+
+        if(verbose) printf("Pair %s\n", names[n].c_str());
+
+        pyramidal_inverse_compositional_algorithm(
+          I1g, I2g, &(p[n*MAX_NPARAMS]), nparams, nx, ny, nscales,
+          zfactor, TOL, robust, lambda, matrix_free, hessian_reuse,
+          npoints, verbose, &ws
+        );
+
+        delete []I1g;
+        delete []I2g;
+      }
+      else
+      {
+        printf("Cannot read the images of pair %d of the manifest\n", n+1);
+        correct=false;
+      }
+      free(I1);
+      free(I2);
+
+      //write the transforms that are ready, in the order of the manifest
+      #pragma omp critical(write_transform)
+      {
+        np[n]=correct?nparams:-1;
+        if(!correct) failed++;
+        for(; next<npairs && np[next]!=0; next++)
+          if(np[next]>0)
+          {
+            fprintf(out, "%s %d ", names[next].c_str(), np[next]);
+            for(int j=0; j<np[next]; j++)
+              fprintf(out, "%f ", p[next*MAX_NPARAMS+j]);
+            fprintf(out, "\n");
+          }
+        fflush(out);
+      }
+    }
+
+    workspace_free(ws);
+  }
+
+  printf("Time=%f\n", omp_get_wtime()-begin);
+
+  fclose(out);
+  delete []p;
+  delete []np;
+
+  return failed==0;
+}
+
+
+
 /**
  *
  *  Main program:
  *   This program reads the following parameters from the console and
  *   computes the corresponding parametric transformation:
  *   -I1          first image
- *   -I2          second image
+ *   -I2          second image, and the next images of a sequence
  *   -out_file    name of the output flow field
+ *   -acc_file    name of the transforms from the first image of a sequence
  *   -nscales     number of scales for the pyramidal approach
  *   -zoom_factor reduction factor for creating the scales
  *   -TOL         stopping criterion threshold for the iterative process
  *   -robust      type of the robust error function 
  *   -lambda      parameter of the robust error function
+ *   -matrix_free compute the steepest descent images on the fly
+ *   -hessian_reuse iterations between rebuilds of the robust Hessian
+ *   -npoints     number of corner points at each scale
  *   -type        type of the parametric model (the number of parameters):
  *                Translation(2), Euclidean(3), Similarity(4), Affinity(6), 
  *                Homography(8)
+ *   -warm_start  start each pair of a sequence from the previous one
+ *   -reference   align each image to the first one
+ *   -data_file   name of the file of the data of the first image
+ *   -manifest    list of pairs of images to align in batch mode
  *   -verbose     switch on/off messages
  *
  */
 int main (int argc, char *argv[])
 {
   //parameters of the method
-  char  *image1, *image2, outfile[200];
-  int    nscales, nparams, robust, verbose;
+  char  **images, outfile[200], accfile[200], datafile[200];
+  char  manifest[200];
+  int    nimages, warm_start, reference;
+  int    nscales, nparams, robust, matrix_free, hessian_reuse;
+  int    npoints, verbose;
   float zfactor, TOL, lambda;
 
   //read the parameters from the console
   int result=read_parameters(
-        argc, argv, &image1, &image2, outfile, nscales, 
-        zfactor, TOL, nparams, robust, lambda, verbose
+        argc, argv, images, nimages, outfile, accfile, nscales, 
+        zfactor, TOL, nparams, robust, lambda, matrix_free, hessian_reuse,
+        npoints, warm_start, reference, datafile,
+        manifest, verbose
       );
+
+  //align the pairs of the manifest in batch mode
+  if(result && *manifest!='\0')
+  {
+    bool correct=align_manifest(manifest, outfile, argc, argv);
+    exit(correct?EXIT_SUCCESS:EXIT_FAILURE);
+  }
   
   if(result)
   {
@@ -222,60 +523,183 @@ int main (int argc, char *argv[])
 
     float *I1, *I2;
 
-    //read the input images
-    bool correct1=read_image(image1, &I1, nx, ny, nz);
-    bool correct2=read_image(image2, &I2, nx1, ny1, nz1);
+    //read the first image; each image is read once, when it is needed
+    if(!read_image(images[0], &I1, nx, ny, nz))
+    {
+      printf("Cannot read the images or their sizes are not the same\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if(verbose) 
+      printf(
+        "\nParameters: scales=%d, zoom=%f, TOL=%f, transform type=%d, "
+        "robust function=%d, lambda=%f, output file=%s\n",
+        nscales, zfactor, TOL, nparams, robust, lambda, outfile
+      );
+
+    //limit the number of scales according to image size (min 32x32)
+    const float N=1+log(std::min(nx, ny)/32.)/log(1./zfactor);
+    if ((int) N<nscales) nscales=(int) N;
+
+    //allocate memory for the parametric models between consecutive
+    //images and from the first image
+    int npairs=nimages-1;
+    float *p=new float[npairs*nparams];
+    float *pacc=new float[npairs*nparams];
+
+    //convert the images to grayscale as they are read
+    float *I1g=new float[nx*ny];
+    float *I2g=new float[nx*ny];
+    rgb2gray(I1, I1g, nx, ny, nz);
+    free(I1);
 
-    // if the images are correct, compute the optical flow
-    if (correct1 && correct2 && nx == nx1 && ny == ny1 && nz == nz1)
+    double time=0;
+    if(reference)
     {
-      if(verbose) 
-        printf(
-          "\nParameters: scales=%d, zoom=%f, TOL=%f, transform type=%d, "
-          "robust function=%d, lambda=%f, output file=%s\n",
-          nscales, zfactor, TOL, nparams, robust, lambda, outfile
+      //the points of the first image and the data of their patches are
+      //computed once and shared by the threads, each one with its own
+      //workspace
+      const double begin=omp_get_wtime();
+      IcaReference ref;
+      reference_init(ref);
+
+      //the data saved by a previous run is used if it is that of the same
+      //image and options
+      if(
+        *datafile=='\0' || !reference_load(ref, datafile, I1g, nx*ny) ||
+        !reference_compatible(
+          ref, nparams, nx, ny, nscales, zfactor, matrix_free, npoints
+        )
+      )
+      {
+        reference_build(
+          ref, I1g, nparams, nx, ny, nscales, zfactor, matrix_free, npoints,
+          verbose
         );
+        if(*datafile!='\0' && !reference_save(ref, datafile))
+          printf("Cannot save the data of the first image to %s\n", datafile);
+      }
+      else if(verbose)
+        printf("Data of the first image read from %s\n", datafile);
 
-      //limit the number of scales according to image size (min 32x32)
-      const float N=1+log(std::min(nx, ny)/32.)/log(1./zfactor);
-      if ((int) N<nscales) nscales=(int) N;
+      #pragma omp parallel
+      {
+        IcaWorkspace ws;
+        workspace_init(ws);
+        float *Ig=new float[nx*ny];
 
-      //allocate memory for the parametric model
-      float *p=new float[nparams];
+        #pragma omp for schedule(dynamic)
+        for(int n=0; n<npairs; n++)
+        {
+          //the decoders of the images are not reentrant
+          float *I;
+          int nx2, ny2, nz2;
+          bool correct;
+          #pragma omp critical(read_image)
+          correct=read_image(images[n+1], &I, nx2, ny2, nz2);
+          if(!correct || nx != nx2 || ny != ny2 || nz != nz2)
+          {
+            printf("Cannot read the images or their sizes are not the same\n");
+            exit(EXIT_FAILURE);
+          }
+          rgb2gray(I, Ig, nx, ny, nz);
+          free(I);
 
-      //convert images to grayscale
-      float *I1g=new float[nx*ny];
-      float *I2g=new float[nx*ny];
-      
-      rgb2gray(I1, I1g, nx, ny, nz);
-      rgb2gray(I2, I2g, nx, ny, nz);
-
-      //compute the optic flow
-      const clock_t begin = clock();
-      pyramidal_inverse_compositional_algorithm(
-        I1g, I2g, p, nparams, nx, ny, nscales, zfactor, 
-	TOL, robust, lambda, verbose
-      );
-      
-//      if(verbose) 
-        printf("Time=%f\n", float(clock()-begin)/CLOCKS_PER_SEC);
-      
-      //save the parametric model to disk
-      save(outfile, p, nparams);
+          if(verbose) printf("Images 0-%d\n", n+1);
 
-      //free memory
-      free (I1);
-      free (I2);
-      delete[]I1g;          
-      delete[]I2g;          
-      delete[]p;          
+          pyramidal_inverse_compositional_algorithm(
+            I1g, Ig, &(p[n*nparams]), nparams, nx, ny, nscales, zfactor, 
+            TOL, robust, lambda, matrix_free, hessian_reuse,
+            npoints, verbose, &ws,
+            NULL, -1, &ref
+          );
+        }
+
+        workspace_free(ws);
+        delete[]Ig;
+      }
+
+      reference_free(ref);
+      time=omp_get_wtime()-begin;
     }
-    else 
+    else
     {
-      printf("Cannot read the images or their sizes are not the same\n");
-      exit(EXIT_FAILURE);
+      //the workspace keeps the pyramid of each image for the next pair
+      IcaWorkspace ws;
+      workspace_init(ws);
+
+      for(int n=0; n<npairs; n++)
+      {
+        //read the next image
+        bool correct=read_image(images[n+1], &I2, nx1, ny1, nz1);
+        if(!correct || nx != nx1 || ny != ny1 || nz != nz1)
+        {
+          printf("Cannot read the images or their sizes are not the same\n");
+          exit(EXIT_FAILURE);
+        }
+        rgb2gray(I2, I2g, nx, ny, nz);
+        free(I2);
+
+        if(verbose && npairs>1) printf("Images %d-%d\n", n, n+1);
+
+        //predict the transform from the previous pair, and its error from
+        //the change of the motion between the last two pairs
+        float *p0=NULL, residual=-1;
+        if(warm_start && n>0)
+        {
+          p0=&(p[(n-1)*nparams]);
+          if(n>1)
+            residual=transform_distance(
+              &(p[(n-1)*nparams]), &(p[(n-2)*nparams]), nparams, nx, ny
+            );
+        }
+
+        //compute the optic flow
+        const clock_t begin = clock();
+        pyramidal_inverse_compositional_algorithm(
+          I1g, I2g, &(p[n*nparams]), nparams, nx, ny, nscales, zfactor, 
+          TOL, robust, lambda, matrix_free, hessian_reuse,
+          npoints, verbose, &ws,
+          p0, residual
+        );
+        time+=double(clock()-begin)/CLOCKS_PER_SEC;
+
+        //accumulate the transform from the first image
+        if(n==0)
+          for(int i=0; i<nparams; i++)
+            pacc[i]=p[i];
+        else
+          compose_transform(
+            &(pacc[(n-1)*nparams]), &(p[n*nparams]), &(pacc[n*nparams]),
+            nparams
+          );
+
+        //the second image and its pyramid are the first ones of the next
+        //pair
+        workspace_roll_pyramid(ws);
+        std::swap(I1g, I2g);
+      }
+      
+      workspace_free(ws);
     }
+
+    printf("Time=%f\n", time);
       
+    //save the parametric models to disk, one per line for a sequence or
+    //for the images aligned to the first one
+    if(npairs==1)
+      save(outfile, p, nparams);
+    else
+    {
+      save(outfile, p, nparams, npairs, 1);
+      if(!reference) save(accfile, pacc, nparams, npairs, 1);
+    }
+
+    //free memory
+    delete[]I1g;          
+    delete[]I2g;          
+    delete[]p;          
+    delete[]pacc;          
   }
   exit(EXIT_SUCCESS);
 }
@@ -8,82 +8,167 @@
 // All rights reserved.
 
 #include "mask.h"
+#include "padded_image.h"
 
 #include <math.h>
 #include <stdio.h>
+#include <vector>
+
+#define GAUSSIAN_BLOCK 64 //number of columns convolved at once
+#define GAUSSIAN_ROWS 8   //number of rows filtered at once, recursively
+#define GAUSSIAN_LANES 64 //maximum number of lines filtered at once
+#define GAUSSIAN_PAD 32   //maximum extension of the recursive filter
+#define GAUSSIAN_RECURSIVE_PAD 4 //extension of the recursive filter, in sigmas
 
 /**
   *
-  * Function to compute the gradient with centered differences
+  * Function to compute the gradient with centered differences. The input
+  * is a padded image, whose guard band replicates the border, so the
+  * differences at the border are taken with the same loop
   *
 **/
 void gradient(
-    float *input,  //input image
+    float *input,  //input image, with a replicated border
     float *dx,           //computed x derivative
     float *dy,           //computed y derivative
     const int nx,        //image width
     const int ny         //image height
 )
 {
- //#pragma omp parallel
- {
-    //apply the gradient to the center body of the image
-    //#pragma omp for schedule(dynamic) nowait
-    for(int i = 1; i < ny-1; i++)
+  const int w = nx + 2 * IMAGE_BORDER; //width of the rows of the input
+
+  for(int i = 0; i < ny; i++)
+  {
+    const float *r = &(input[i * w]);
+    for(int j = 0; j < nx; j++)
     {
-        for(int j = 1; j < nx-1; j++)
-        {
-            const int k = i * nx + j;
-            dx[k] = 0.5*(input[k+1] - input[k-1]);
-            dy[k] = 0.5*(input[k+nx] - input[k-nx]);
-        }
+      const int k = i * nx + j;
+      dx[k] = 0.5*(r[j+1] - r[j-1]);
+      dy[k] = 0.5*(r[j+w] - r[j-w]);
     }
+  }
+}
+
 
-    //apply the gradient to the first and last rows
-    //#pragma omp for schedule(dynamic) nowait
-    for(int j = 1; j < nx-1; j++)
-    {
-        dx[j] = 0.5*(input[j+1] - input[j-1]);
-        dy[j] = 0.5*(input[j+nx] - input[j]);
 
-        const int k = (ny - 1) * nx + j;
 
-        dx[k] = 0.5*(input[k+1] - input[k-1]);
-        dy[k] = 0.5*(input[k] - input[k-nx]);
+/**
+ *
+ * Shi-Tomasi corner response: smallest eigenvalue of the structure
+ * tensor, summed over windows of (2*radius+1)x(2*radius+1) pixels. It is
+ * computed with separable running sums for the centers at 2*radius or
+ * more pixels from the border, and it is zero for the rest
+ *
+ */
+void corner_response(
+  float *dx,     //x derivative
+  float *dy,     //y derivative
+  float *Sxx,    //buffer for the row sums of dx*dx
+  float *Sxy,    //buffer for the row sums of dx*dy
+  float *Syy,    //buffer for the row sums of dy*dy
+  float *R,      //output corner response
+  int radius,    //radius of the window
+  int nx,        //image width
+  int ny         //image height
+)
+{
+  //sum the products of the derivatives along the rows
+  #pragma omp parallel for
+  for(int i=0; i<ny; i++)
+  {
+    float sxx=0, sxy=0, syy=0;
+    for(int j=0; j<2*radius && j<nx; j++)
+    {
+      const int k=i*nx+j;
+      sxx+=dx[k]*dx[k]; sxy+=dx[k]*dy[k]; syy+=dy[k]*dy[k];
     }
+    for(int j=radius; j<nx-radius; j++)
+    {
+      const int k=i*nx+j;
+      sxx+=dx[k+radius]*dx[k+radius];
+      sxy+=dx[k+radius]*dy[k+radius];
+      syy+=dy[k+radius]*dy[k+radius];
+      Sxx[k]=sxx; Sxy[k]=sxy; Syy[k]=syy;
+      sxx-=dx[k-radius]*dx[k-radius];
+      sxy-=dx[k-radius]*dy[k-radius];
+      syy-=dy[k-radius]*dy[k-radius];
+    }
+  }
 
-    //apply the gradient to the first and last columns
-    //#pragma omp for schedule(dynamic) nowait
-    for(int i = 1; i < ny-1; i++)
+  //sum the rows of each window and take the smallest eigenvalue
+  const int m=2*radius;
+  #pragma omp parallel for
+  for(int i=0; i<ny; i++)
+  {
+    if(i<m || i>=ny-m)
+    {
+      for(int j=0; j<nx; j++) R[i*nx+j]=0;
+      continue;
+    }
+    for(int j=0; j<nx; j++)
     {
-        const int p = i * nx;
-        dx[p] = 0.5*(input[p+1] - input[p]);
-        dy[p] = 0.5*(input[p+nx] - input[p-nx]);
+      if(j<m || j>=nx-m)
+      {
+        R[i*nx+j]=0;
+        continue;
+      }
+      float a=0, b=0, c=0;
+      for(int k=i-radius; k<=i+radius; k++)
+      {
+        a+=Sxx[k*nx+j]; b+=Sxy[k*nx+j]; c+=Syy[k*nx+j];
+      }
+      const float h=(a-c)/2;
+      R[i*nx+j]=(a+c)/2-sqrtf(h*h+b*b);
+    }
+  }
+}
 
-        const int k = (i+1) * nx - 1;
 
-        dx[k] = 0.5*(input[k] - input[k-1]);
-        dy[k] = 0.5*(input[k+nx] - input[k-nx]);
-    }
 
-    //apply the gradient to the four corners
-    dx[0] = 0.5*(input[1] - input[0]);
-    dy[0] = 0.5*(input[nx] - input[0]);
+/**
+ *
+ * Coefficients of the normalized 1D Gaussian kernel, from the center to
+ * the border of the window. The table is cached for each thread and only
+ * recomputed when sigma or the precision change, so the pointer is valid
+ * until the next call of the thread with other values
+ *
+ */
+float *
+gaussian_kernel (
+  float sigma, //Gaussian sigma
+  int &size,    //output number of coefficients
+  int precision //defines the size of the window
+)
+{
+  static thread_local std::vector<float> B;
+  static thread_local float last_sigma = -1;
+  static thread_local int last_precision = -1;
 
-    dx[nx-1] = 0.5*(input[nx-1] - input[nx-2]);
-    dy[nx-1] = 0.5*(input[2*nx-1] - input[nx-1]);
+  size = (int) (precision * sigma) + 1;
+  if (sigma == last_sigma && precision == last_precision)
+    return B.data ();
 
-    dx[(ny-1)*nx] = 0.5*(input[(ny-1)*nx + 1] - input[(ny-1)*nx]);
-    dy[(ny-1)*nx] = 0.5*(input[(ny-1)*nx] - input[(ny-2)*nx]);
+  float den = 2 * sigma * sigma;
+  B.resize (size);
+  for (int i = 0; i < size; i++)
+    B[i] = 1 / (sigma * sqrt (2.0 * 3.1415926)) * exp (-i * i / den);
 
-    dx[ny*nx-1] = 0.5*(input[ny*nx-1] - input[ny*nx-1-1]);
-    dy[ny*nx-1] = 0.5*(input[ny*nx-1] - input[(ny-1)*nx-1]);
- }
+  float norm = 0;
 
-}
+  //normalize the 1D convolution kernel
+  for (int i = 0; i < size; i++)
+    norm += B[i];
 
+  norm *= 2;
+  norm -= B[0];
 
+  for (int i = 0; i < size; i++)
+    B[i] /= norm;
 
+  last_sigma = sigma;
+  last_precision = precision;
+  return B.data ();
+}
 
 
 /**
@@ -103,35 +188,19 @@ gaussian (
 {
   int i, j, k;
   
-  float den = 2 * sigma * sigma;
   int size = (int) (precision * sigma) + 1;
   int bdx = xdim + size;
-  int bdy = ydim + size;
   
-  if (bc && size > xdim){
+  if (bc && (size > xdim || size > ydim)){
       printf("GaussianSmooth: sigma too large for this bc\n");
       throw 1;
   }
 
   //compute the coefficients of the 1D convolution kernel
-  float *B = new float [size];
-  for (int i = 0; i < size; i++)
-    B[i] = 1 / (sigma * sqrt (2.0 * 3.1415926)) * exp (-i * i / den);
-
-  float norm = 0;
-
-  //normalize the 1D convolution kernel
-  for (int i = 0; i < size; i++)
-    norm += B[i];
-
-  norm *= 2;
-  norm -= B[0];
-
-  for (int i = 0; i < size; i++)
-    B[i] /= norm;
+  float *B = gaussian_kernel (sigma, size, precision);
   
   float *R = new float[size + xdim + size]; 
-  float *T = new float[size + ydim + size];
+  float *T = new float[(size + ydim + size) * GAUSSIAN_BLOCK];
    
   //convolution of each line of the input image
    for (k = 0; k < ydim; k++)
@@ -174,46 +243,198 @@ gaussian (
         }
     }
 
-  //convolution of each column of the input image
-  for (k = 0; k < xdim; k++)
+  //convolution of the columns, by blocks of GAUSSIAN_BLOCK columns that
+  //are copied with the boundary rows: the rows of a block are contiguous,
+  //so the block is traversed in cache and the taps are vectorised
+  for (k = 0; k < xdim; k += GAUSSIAN_BLOCK)
     {
-      for (i = size; i < bdy; i++)
-        T[i] = I[((i - size) * xdim + k) ];
+      int w = (xdim - k < GAUSSIAN_BLOCK) ? xdim - k : GAUSSIAN_BLOCK;
 
-      switch (bc)
+      for (i = 1; i < size + ydim + size; i++)
         {
-        case 0: // Dirichlet boundary conditions
-          for (i = 0, j = bdy; i < size; i++, j++)
-            T[i] = T[j] = 0;
-          break;
-        case 1: // Reflecting boundary conditions
-          for (i = 0, j = bdy; i < size; i++, j++)
-            {
-              T[i] = I[((size - i) * xdim + k) ];
-              T[j] = I[((ydim - i - 1) * xdim + k) ];
-            }
-          break;
-        case 2: // Periodic boundary conditions
-          for (i = 0, j = bdx; i < size; i++, j++)
-            {
-              T[i] = I[((ydim - size + i) * xdim + k) ];
-              T[j] = I[(i * xdim + k) ];
-            }
-          break;
+          float *t = &T[i * w];
+          int r = i - size;
+
+          if (r < 0 || r >= ydim)
+            switch (bc)
+              {
+              case 0: // Dirichlet boundary conditions
+                for (j = 0; j < w; j++)
+                  t[j] = 0;
+                continue;
+              case 1: // Reflecting boundary conditions
+                r = (r < 0) ? -r : 2 * ydim - 1 - r;
+                break;
+              case 2: // Periodic boundary conditions
+                r = (r < 0) ? ydim + r : r - ydim;
+                break;
+              }
+
+          for (j = 0; j < w; j++)
+            t[j] = I[r * xdim + k + j];
         }
 
-      for (i = size; i < bdy; i++)
+      for (i = 0; i < ydim; i++)
         {
-          float sum = B[0] * T[i];
+          float *t = &T[(i + size) * w];
+          float *out = &I[i * xdim + k];
 
-          for (j = 1; j < size; j++)
-            sum += B[j] * (T[i - j] + T[i + j]);
+          for (int c = 0; c < w; c++)
+            out[c] = B[0] * t[c];
 
-          I[((i - size) * xdim + k) ] = sum;
+          for (j = 1; j < size; j++)
+            {
+              float *tm = t - j * w;
+              float *tp = t + j * w;
+              for (int c = 0; c < w; c++)
+                out[c] += B[j] * (tm[c] + tp[c]);
+            }
         }
     }
   
-  delete[]B;
   delete[]R;
   delete[]T;
 }
+
+
+/**
+ *
+ * Coefficients of the recursive Gaussian of Young and van Vliet:
+ * w[n] = b * in[n] + a[0] * w[n-1] + a[1] * w[n-2] + a[2] * w[n-3]
+ *
+ */
+static float
+recursive_coefficients (
+  float sigma, //Gaussian sigma
+  float *a     //output feedback coefficients
+)
+{
+  float q;
+  if (sigma >= 2.5)
+    q = 0.98711 * sigma - 0.96330;
+  else
+    q = 3.97156 - 4.14554 * sqrt (1.0 - 0.26891 * sigma);
+
+  float q2 = q * q, q3 = q2 * q;
+  float b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+
+  a[0] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  a[1] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  a[2] = 0.422205 * q3 / b0;
+  return 1.0 - (a[0] + a[1] + a[2]);
+}
+
+
+/**
+ *
+ * Recursive Gaussian of a set of lines, processed together since their
+ * recursions are independent. The recursions start from a reflected
+ * extension of pad values at both ends, as in the reflecting boundary
+ * condition of gaussian
+ *
+ */
+static void
+recursive_lines (
+  float *I,     //first value of the first line
+  int n,         //number of values of each line
+  int step,      //distance between the values of a line
+  int lanes,     //number of lines, at most GAUSSIAN_LANES
+  int lane_step, //distance between the lines
+  float b,      //gain of the filter
+  float *a,     //feedback coefficients of the filter
+  int pad        //size of the extensions, at most GAUSSIAN_PAD
+)
+{
+  float w1[GAUSSIAN_LANES], w2[GAUSSIAN_LANES], w3[GAUSSIAN_LANES];
+  float ext[GAUSSIAN_PAD][GAUSSIAN_LANES];
+  int l;
+
+  if (n < 2)
+    return;
+  if (pad > n - 1)
+    pad = n - 1;
+
+  //save the values of the right extension
+  for (int i = 0; i < pad; i++)
+    for (l = 0; l < lanes; l++)
+      ext[i][l] = I[(n - 1 - i) * step + l * lane_step];
+
+  //causal filter, from the left extension
+  for (l = 0; l < lanes; l++)
+    w1[l] = w2[l] = w3[l] = I[pad * step + l * lane_step];
+  for (int i = -pad + 1; i < n + pad; i++)
+    {
+      float *x = (i < 0) ? &I[-i * step] : &I[i * step];
+      if (i >= n)
+        x = ext[i - n];
+      int ls = (i >= n) ? 1 : lane_step;
+
+      for (l = 0; l < lanes; l++)
+        {
+          float w = b * x[l * ls] + a[0] * w1[l] + a[1] * w2[l]
+            + a[2] * w3[l];
+          w3[l] = w2[l]; w2[l] = w1[l]; w1[l] = w;
+          if (i >= 0)
+            x[l * ls] = w;
+        }
+    }
+
+  //anti-causal filter, from the right extension
+  for (l = 0; l < lanes; l++)
+    w1[l] = w2[l] = w3[l] = ext[pad - 1][l];
+  for (int i = n + pad - 2; i >= 0; i--)
+    {
+      float *x = (i >= n) ? ext[i - n] : &I[i * step];
+      int ls = (i >= n) ? 1 : lane_step;
+
+      for (l = 0; l < lanes; l++)
+        {
+          float w = b * x[l * ls] + a[0] * w1[l] + a[1] * w2[l]
+            + a[2] * w3[l];
+          w3[l] = w2[l]; w2[l] = w1[l]; w1[l] = w;
+          x[l * ls] = w;
+        }
+    }
+}
+
+
+/**
+ *
+ * Convolution with a Gaussian with the recursive filter of Young and van
+ * Vliet, whose cost does not depend on sigma. It is applied forward and
+ * backward along the rows and the columns, with reflecting boundary
+ * conditions. The rows are filtered in groups of independent recursions
+ * and the columns by blocks, row by row, so the image is traversed
+ * contiguously
+ *
+ */
+void
+gaussian_recursive (
+  float *I,    //input/output image
+  int xdim,     //image width
+  int ydim,     //image height
+  float sigma  //Gaussian sigma, at least 0.5
+)
+{
+  float a[3];
+  float b = recursive_coefficients (sigma, a);
+  int pad = (int) (GAUSSIAN_RECURSIVE_PAD * sigma) + 1;
+  if (pad > GAUSSIAN_PAD)
+    pad = GAUSSIAN_PAD;
+
+  //filter the rows
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < ydim; k += GAUSSIAN_ROWS)
+    {
+      int h = (ydim - k < GAUSSIAN_ROWS) ? ydim - k : GAUSSIAN_ROWS;
+      recursive_lines (&I[k * xdim], xdim, 1, h, xdim, b, a, pad);
+    }
+
+  //filter the columns
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < xdim; k += GAUSSIAN_LANES)
+    {
+      int w = (xdim - k < GAUSSIAN_LANES) ? xdim - k : GAUSSIAN_LANES;
+      recursive_lines (&I[k], ydim, xdim, w, 1, b, a, pad);
+    }
+}
@@ -13,11 +13,11 @@
 #include <vector>
 /**
  *
- * Compute the gradient with central differences
+ * Compute the gradient with central differences of a padded image
  *
  */
 void gradient(
-  float *input,  //input image
+  float *input,  //input image, with a replicated border
   float *dx,     //computed x derivative
   float *dy,     //computed y derivative
   int nx,         //image width
@@ -39,6 +39,40 @@ void gradient_points(
 );
 
 
+/**
+ *
+ * Shi-Tomasi corner response: smallest eigenvalue of the structure
+ * tensor in the window of each pixel
+ *
+ */
+void corner_response(
+  float *dx,     //x derivative
+  float *dy,     //y derivative
+  float *Sxx,    //buffer for the row sums of dx*dx
+  float *Sxy,    //buffer for the row sums of dx*dy
+  float *Syy,    //buffer for the row sums of dy*dy
+  float *R,      //output corner response
+  int radius,    //radius of the window
+  int nx,        //image width
+  int ny         //image height
+);
+
+
+
+/**
+ *
+ * Coefficients of the normalized 1D Gaussian kernel, from the center to
+ * the border of the window. The table is cached for each thread, so the
+ * pointer is valid until the next call of the thread with other values
+ *
+ */
+float *
+gaussian_kernel (
+  float sigma,     //Gaussian sigma
+  int &size,        //output number of coefficients
+  int precision = 5 //defines the size of the window
+);
+
 
 /**
  *
@@ -55,4 +89,19 @@ gaussian (
   int precision = 5 //defines the size of the window
 );
 
+/**
+ *
+ * Convolution with a Gaussian with the recursive filter of Young and van
+ * Vliet, whose cost does not depend on sigma, with reflecting boundary
+ * conditions
+ *
+ */
+void
+gaussian_recursive (
+  float *I,    //input/output image
+  int xdim,     //image width
+  int ydim,     //image height
+  float sigma  //Gaussian sigma, at least 0.5
+);
+
 #endif
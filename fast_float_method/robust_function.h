@@ -0,0 +1,170 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef ROBUST_FUNCTION_H
+#define ROBUST_FUNCTION_H
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+  *
+  *  Derivatives of the robust error functions, rho'(t²), as policy types.
+  *  Each one has the weight of a squared difference, t2, for the squared
+  *  threshold lambda2, so that the estimator is instantiated for the
+  *  robust function and the weights of a tile are evaluated in a loop
+  *  without branches, which the compiler vectorises. binary is set if the
+  *  weights are only 0 or 1, so that the Hessian can be updated with the
+  *  samples that enter or leave the set of inliers
+  *
+**/
+
+//Non robust (L2 norm): rho'(t²)=1
+struct Quadratic
+{
+  static const bool binary=true;
+
+  static inline float weight(float, float)
+  {
+    return 1.0f;
+  }
+};
+
+//Truncated quadratic: rho'(t²)=1 if t²<lambda², 0 otherwise
+struct TruncatedQuadratic
+{
+  static const bool binary=true;
+
+  static inline float weight(float t2, float lambda2)
+  {
+    return (t2<lambda2)?1.0f:0.0f;
+  }
+};
+
+//Geman & McClure: rho'(t²)=lambda²/(lambda²+t²)²
+struct GemanMcClure
+{
+  static const bool binary=false;
+
+  static inline float weight(float t2, float lambda2)
+  {
+    float d=lambda2+t2;
+    return lambda2/(d*d);
+  }
+};
+
+//Lorentzian: rho'(t²)=1/(lambda²+t²)
+struct Lorentzian
+{
+  static const bool binary=false;
+
+  static inline float weight(float t2, float lambda2)
+  {
+    return 1.0f/(lambda2+t2);
+  }
+};
+
+//Charbonnier: rho'(t²)=1/sqrt(t²+lambda²)
+struct Charbonnier
+{
+  static const bool binary=false;
+
+  static inline float weight(float t2, float lambda2)
+  {
+    return 1.0f/sqrtf(t2+lambda2);
+  }
+};
+
+//Charbonnier with an approximate reciprocal square root: initial guess
+//from the exponent bits and two Newton steps (relative error below 5E-6)
+struct CharbonnierFast
+{
+  static const bool binary=false;
+
+  static inline float weight(float t2, float lambda2)
+  {
+    float x=t2+lambda2, y;
+    int32_t i;
+
+    memcpy(&i, &x, sizeof(i));
+    i=0x5F3759DF-(i>>1);
+    memcpy(&y, &i, sizeof(y));
+
+    y*=1.5f-0.5f*x*y*y;
+    y*=1.5f-0.5f*x*y*y;
+    return y;
+  }
+};
+
+
+/**
+  *
+  *  Weights of n squared differences with the robust function R.
+  *  The input and output arrays may be the same
+  *
+**/
+template<class R>
+inline void robust_weights(
+  float *t2,     //squared differences
+  float *rho,    //output weights
+  int n,         //number of values
+  float lambda2  //squared threshold of the robust function
+)
+{
+  for(int i=0; i<n; i++)
+    rho[i]=R::weight(t2[i], lambda2);
+}
+
+
+/**
+  *
+  *  The square root of the Charbonnier function is not vectorised by the
+  *  compiler, since it may set errno, so it is written with AVX or, in
+  *  the default build for x86-64, with SSE2
+  *
+**/
+template<>
+inline void robust_weights<Charbonnier>(
+  float *t2,     //squared differences
+  float *rho,    //output weights
+  int n,         //number of values
+  float lambda2  //squared threshold of the robust function
+)
+{
+  int i=0;
+
+#ifdef __AVX__
+  __m256 l=_mm256_set1_ps(lambda2);
+  __m256 one=_mm256_set1_ps(1.0f);
+  for(; i+8<=n; i+=8)
+  {
+    __m256 s=_mm256_sqrt_ps(_mm256_add_ps(_mm256_loadu_ps(&(t2[i])), l));
+    _mm256_storeu_ps(&(rho[i]), _mm256_div_ps(one, s));
+  }
+#elif defined(__SSE2__)
+  __m128 l=_mm_set1_ps(lambda2);
+  __m128 one=_mm_set1_ps(1.0f);
+  for(; i+4<=n; i+=4)
+  {
+    __m128 s=_mm_sqrt_ps(_mm_add_ps(_mm_loadu_ps(&(t2[i])), l));
+    _mm_storeu_ps(&(rho[i]), _mm_div_ps(one, s));
+  }
+#endif
+
+  for(; i<n; i++)
+    rho[i]=Charbonnier::weight(t2[i], lambda2);
+}
+
+#endif
@@ -0,0 +1,273 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+/**
+  *
+  *  Storage of the steepest descent images as a structure of arrays and
+  *  cache blocked kernels for the Hessian and the independent vector.
+  *  The samples are processed in tiles of SD_BLOCK values, so that the
+  *  nparams planes of a tile stay in cache while the upper triangle of
+  *  the Hessian is accumulated with contiguous, vectorizable dot products
+  *
+**/
+
+#include <stdlib.h>
+#include <omp.h>
+
+#include "steepest_descent.h"
+#include "transformation.h"
+
+
+/**
+ *
+ *  Length of each plane for n samples, padded to the alignment
+ *
+ */
+int sd_stride(
+  int n //number of samples
+)
+{
+  int a=SD_ALIGN/sizeof(float);
+  if(n<a) return a;
+  return ((n+a-1)/a)*a;
+}
+
+
+/**
+ *
+ *  Allocate the planes of the steepest descent images, set to zero
+ *
+ */
+float *sd_allocate(
+  int nparams, //number of parameters
+  int n        //number of samples
+)
+{
+  void *D=NULL;
+  int size=nparams*sd_stride(n);
+
+  if(posix_memalign(&D, SD_ALIGN, size*sizeof(float))!=0)
+    return NULL;
+
+  //the padding must be zero so that it does not contribute to the sums
+  for(int i=0; i<size; i++)
+    ((float *)D)[i]=0.0;
+
+  return (float *)D;
+}
+
+
+/**
+ *
+ *  Release the memory of the steepest descent images
+ *
+ */
+void sd_free(
+  float *D //steepest descent images
+)
+{
+  free(D);
+}
+
+
+/**
+ *
+ *  Accumulate one tile of samples, from start to start+len-1:
+ *  b+=D^t*diag(rho)*DI and the packed upper triangle Hp+=D^t*diag(rho)*D.
+ *  DI and rho are indexed from the start of the tile. If rho is NULL, the
+ *  weights are one; if DI or b are NULL, only the Hessian is accumulated;
+ *  if Hp is NULL, only the independent vector is accumulated
+ *
+ */
+void sd_accumulate_tile(
+  float *D,   //steepest descent images
+  float *DI,  //differences of the tile
+  float *rho, //robust weights of the tile
+  float *b,   //independent vector to be accumulated
+  float *Hp,  //packed upper triangle of the Hessian to be accumulated
+  int nparams, //number of parameters
+  int stride,  //length of each plane
+  int start,   //first sample of the tile
+  int len      //number of samples of the tile (at most SD_BLOCK)
+)
+{
+  switch(nparams)
+  {
+    default: case TRANSLATION_TRANSFORM:
+      sd_accumulate_tile<TRANSLATION_TRANSFORM>(
+        D, DI, rho, b, Hp, stride, start, len
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      sd_accumulate_tile<EUCLIDEAN_TRANSFORM>(
+        D, DI, rho, b, Hp, stride, start, len
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      sd_accumulate_tile<SIMILARITY_TRANSFORM>(
+        D, DI, rho, b, Hp, stride, start, len
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      sd_accumulate_tile<AFFINITY_TRANSFORM>(
+        D, DI, rho, b, Hp, stride, start, len
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      sd_accumulate_tile<HOMOGRAPHY_TRANSFORM>(
+        D, DI, rho, b, Hp, stride, start, len
+      );
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Allocate the partial sums of the threads, set to zero
+ *
+ */
+float *sd_partials_allocate(
+  int &nthreads //output number of stripes, one per thread
+)
+{
+  nthreads=omp_get_max_threads();
+  return sd_allocate(nthreads, SD_PARTIAL);
+}
+
+
+/**
+ *
+ *  Combine the partial sums of the threads with a tree reduction, copy
+ *  the result to b and H, and set the partial sums to zero, so that they
+ *  can be reused in the next accumulation. b or H may be NULL if they are
+ *  not needed
+ *
+ */
+void sd_partials_reduce(
+  float *partials, //partial sums of the threads
+  int nthreads,     //number of threads
+  float *b,        //output independent vector
+  float *H,        //output Hessian matrix
+  int nparams       //number of parameters
+)
+{
+  //add the stripes by pairs, doubling the distance at each level
+  for(int s=1; s<nthreads; s*=2)
+    for(int i=0; i+s<nthreads; i+=2*s)
+    {
+      float *P=&(partials[i*SD_PARTIAL]);
+      float *Q=&(partials[(i+s)*SD_PARTIAL]);
+      for(int k=0; k<SD_PARTIAL; k++)
+        P[k]+=Q[k];
+    }
+
+  if(b!=NULL)
+    for(int k=0; k<nparams; k++)
+      b[k]=partials[k];
+
+  if(H!=NULL)
+    sd_unpack_hessian(&(partials[MAX_NPARAMS]), H, nparams);
+
+  for(int k=0; k<nthreads*SD_PARTIAL; k++)
+    partials[k]=0.0;
+}
+
+
+/**
+ *
+ *  Copy the packed upper triangle to the symmetric Hessian
+ *
+ */
+void sd_unpack_hessian(
+  float *Hp, //packed upper triangle of the Hessian
+  float *H,  //output Hessian matrix
+  int nparams //number of parameters
+)
+{
+  int c=0;
+  for(int k=0; k<nparams; k++)
+    for(int l=k; l<nparams; l++, c++)
+      H[k*nparams+l]=H[l*nparams+k]=Hp[c];
+}
+
+
+/**
+ *
+ *  Compute H=D^t*diag(rho)*D by tiles, in the same way as a DSYRK
+ *  rho may be NULL for the quadratic version
+ *
+ */
+void sd_syrk(
+  float *D,   //steepest descent images
+  float *rho, //robust weights
+  float *H,   //output Hessian matrix
+  int nparams, //number of parameters
+  int n        //number of samples
+)
+{
+  int nthreads;
+  float *partials=sd_partials_allocate(nthreads);
+  int stride=sd_stride(n);
+
+  #pragma omp parallel num_threads(nthreads)
+  {
+    float *Hp=&(partials[omp_get_thread_num()*SD_PARTIAL+MAX_NPARAMS]);
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<n; t+=SD_BLOCK)
+    {
+      int len=(n-t<SD_BLOCK)?n-t:SD_BLOCK;
+      sd_accumulate_tile(
+        D, NULL, (rho==NULL)?NULL:&(rho[t]), NULL, Hp, nparams, stride, t, len
+      );
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, NULL, H, nparams);
+  sd_free(partials);
+}
+
+
+/**
+ *
+ *  Compute b=D^t*diag(rho)*DI by tiles, in the same way as a DGEMV
+ *  rho may be NULL for the quadratic version
+ *
+ */
+void sd_gemv(
+  float *D,   //steepest descent images
+  float *DI,  //differences
+  float *rho, //robust weights
+  float *b,   //output independent vector
+  int nparams, //number of parameters
+  int n        //number of samples
+)
+{
+  int nthreads;
+  float *partials=sd_partials_allocate(nthreads);
+  int stride=sd_stride(n);
+
+  #pragma omp parallel num_threads(nthreads)
+  {
+    float *bt=&(partials[omp_get_thread_num()*SD_PARTIAL]);
+
+    #pragma omp for schedule(static)
+    for(int t=0; t<n; t+=SD_BLOCK)
+    {
+      int len=(n-t<SD_BLOCK)?n-t:SD_BLOCK;
+      sd_accumulate_tile(
+        D, &(DI[t]), (rho==NULL)?NULL:&(rho[t]), bt, NULL,
+        nparams, stride, t, len
+      );
+    }
+  }
+
+  sd_partials_reduce(partials, nthreads, b, NULL, nparams);
+  sd_free(partials);
+}
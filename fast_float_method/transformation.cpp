@@ -86,6 +86,44 @@ void jacobian
   }
 }
 
+/**
+ *
+ *  Function to compute the steepest descent values DI^t*J at a point from
+ *  the gradient, using the analytic Jacobian of the transform, so that the
+ *  Jacobian matrix of the whole image does not need to be stored
+ *
+ */
+void point_steepest_descent
+(
+  float x,    //x component of the point
+  float y,    //y component of the point
+  float Ix,   //x derivate of the image at the point
+  float Iy,   //y derivate of the image at the point
+  float *D,   //output DI^t*J, nparams values
+  int stride, //distance between consecutive values in D
+  int nparams //number of parameters
+)
+{
+  switch(nparams) 
+  {
+    default: case TRANSLATION_TRANSFORM:
+      point_steepest_descent<TRANSLATION_TRANSFORM>(x, y, Ix, Iy, D, stride);
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      point_steepest_descent<EUCLIDEAN_TRANSFORM>(x, y, Ix, Iy, D, stride);
+      break;
+    case SIMILARITY_TRANSFORM:
+      point_steepest_descent<SIMILARITY_TRANSFORM>(x, y, Ix, Iy, D, stride);
+      break;
+    case AFFINITY_TRANSFORM:
+      point_steepest_descent<AFFINITY_TRANSFORM>(x, y, Ix, Iy, D, stride);
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      point_steepest_descent<HOMOGRAPHY_TRANSFORM>(x, y, Ix, Iy, D, stride);
+      break;
+  }
+}
+
 /**
  *
  *  Function to update the current transform with the computed increment
@@ -223,26 +261,20 @@ void project
 )
 {
   switch(nparams) {
-    default: case TRANSLATION_TRANSFORM: //p=(tx, ty) 
-      xp=x+p[0];
-      yp=y+p[1];
+    default: case TRANSLATION_TRANSFORM:
+      project<TRANSLATION_TRANSFORM>(x, y, p, xp, yp);
       break;
-    case EUCLIDEAN_TRANSFORM:   //p=(tx, ty, tita)
-      xp=cos(p[2])*x-sin(p[2])*y+p[0];
-      yp=sin(p[2])*x+cos(p[2])*y+p[1];
+    case EUCLIDEAN_TRANSFORM:
+      project<EUCLIDEAN_TRANSFORM>(x, y, p, xp, yp);
       break;
-    case SIMILARITY_TRANSFORM:  //p=(tx, ty, a, b)
-      xp=(1+p[2])*x-p[3]*y+p[0];
-      yp=p[3]*x+(1+p[2])*y+p[1];
+    case SIMILARITY_TRANSFORM:
+      project<SIMILARITY_TRANSFORM>(x, y, p, xp, yp);
       break;
-    case AFFINITY_TRANSFORM:    //p=(tx, ty, a00, a01, a10, a11)
-      xp=(1+p[2])*x+p[3]*y+p[0];
-      yp=p[4]*x+(1+p[5])*y+p[1];
+    case AFFINITY_TRANSFORM:
+      project<AFFINITY_TRANSFORM>(x, y, p, xp, yp);
       break;
-    case HOMOGRAPHY_TRANSFORM:  //p=(h00, h01,..., h21)
-      float d=p[6]*x+p[7]*y+1;
-      xp=((1+p[0])*x+p[1]*y+p[2])/d;
-      yp=(p[3]*x+(1+p[4])*y+p[5])/d;
+    case HOMOGRAPHY_TRANSFORM:
+      project<HOMOGRAPHY_TRANSFORM>(x, y, p, xp, yp);
       break;
   }
 }
@@ -304,3 +336,90 @@ void params2matrix
     
   }
 }
+
+
+/**
+ *
+ *  Function to compose two transforms, x'(x;p) = x'(x'(x;p1);p2), such as
+ *  the transforms between consecutive images of a sequence
+ *
+ */
+void compose_transform
+(
+  float *p1,  //first transform
+  float *p2,  //second transform, applied after the first one
+  float *p,   //output composition, which can be p1 or p2
+  int nparams //number of parameters
+)
+{
+  float m1[9], m2[9], m[9];
+  params2matrix(p1, m1, nparams);
+  params2matrix(p2, m2, nparams);
+
+  //product of the matrices, m=m2*m1
+  for(int i=0; i<3; i++)
+    for(int j=0; j<3; j++)
+      m[3*i+j]=m2[3*i]*m1[j]+m2[3*i+1]*m1[3+j]+m2[3*i+2]*m1[6+j];
+
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM: //p=(tx, ty) 
+      p[0]=m[2];
+      p[1]=m[5];
+      break;
+    case EUCLIDEAN_TRANSFORM:   //p=(tx, ty, tita)
+      p[0]=m[2];
+      p[1]=m[5];
+      p[2]=atan2(m[3], m[0]);
+      break;
+    case SIMILARITY_TRANSFORM:  //p=(tx, ty, a, b)
+      p[0]=m[2];
+      p[1]=m[5];
+      p[2]=m[0]-1;
+      p[3]=m[3];
+      break;
+    case AFFINITY_TRANSFORM:    //p=(tx, ty, a00, a01, a10, a11)
+      p[0]=m[2];
+      p[1]=m[5];
+      p[2]=m[0]-1;
+      p[3]=m[1];
+      p[4]=m[3];
+      p[5]=m[4]-1;
+      break;
+    case HOMOGRAPHY_TRANSFORM:  //p=(h00, h01,..., h21)
+      for(int i=0; i<8; i++)
+        p[i]=m[i]/m[8];
+      p[0]-=1;
+      p[4]-=1;
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Largest distance between the corners of an image transformed by two
+ *  transforms, which measures how much the transforms differ, in pixels
+ *
+ */
+float transform_distance
+(
+  float *p1,   //first transform
+  float *p2,   //second transform
+  int nparams, //number of parameters
+  int nx,      //number of columns of the image
+  int ny       //number of rows of the image
+)
+{
+  int x[4]={0, nx-1, 0, nx-1};
+  int y[4]={0, 0, ny-1, ny-1};
+  float d=0;
+  for(int i=0; i<4; i++)
+  {
+    float x1, y1, x2, y2;
+    project(x[i], y[i], p1, x1, y1, nparams);
+    project(x[i], y[i], p2, x2, y2, nparams);
+    float di=sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2));
+    if(di>d) d=di;
+  }
+  return d;
+}
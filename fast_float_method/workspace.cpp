@@ -0,0 +1,288 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#include <stdlib.h>
+
+#include "workspace.h"
+#include "padded_image.h"
+#include "steepest_descent.h"
+#include "transformation.h"
+#include "zoom.h"
+
+//number of heap allocations of the workspaces, which may be used by
+//several threads
+static long allocations=0;
+
+
+/**
+ *
+ *  Grow a buffer to hold at least size values, discarding its content
+ *
+ */
+static void grow(
+  float *&buffer, //buffer to be grown
+  int capacity,    //current capacity of the buffer
+  int size         //required number of values
+)
+{
+  if(size<=capacity) return;
+  delete []buffer;
+  buffer=new float[size];
+  #pragma omp atomic
+  allocations++;
+}
+
+
+/**
+ *
+ *  Initialize an empty workspace, without allocating memory
+ *
+ */
+void workspace_init(
+  IcaWorkspace &ws //workspace
+)
+{
+  ws.size=ws.sd_size=ws.nscales=ws.nthreads=ws.npoints=ws.ncorners=ws.npixels=0;
+  ws.padded=0;
+  ws.Ix=ws.Iy=ws.Iw=ws.DI=ws.rho=ws.DIJ=ws.Is=ws.Ip=ws.partials=NULL;
+  ws.pts.I1=ws.pts.Ix=ws.pts.Iy=ws.pts.x=ws.pts.y=NULL;
+  ws.pts.N=0;
+  ws.I1s=ws.I2s=ws.ps=NULL;
+  ws.nx=ws.ny=ws.scale_size=NULL;
+  ws.levels=ws.rolled=0;
+}
+
+
+/**
+ *
+ *  Make room for images of size values and for sd_size values of the
+ *  steepest descent images (zero in the matrix-free mode). It is called
+ *  again after selecting the points, which are stored in x, to make room
+ *  for the npixels pixels of their patches
+ *
+ */
+void workspace_reserve(
+  IcaWorkspace &ws, //workspace
+  int size,         //number of values of the images
+  int sd_size,      //number of values of the steepest descent images
+  int npixels       //number of pixels of the patches
+)
+{
+  if(size>ws.size)
+  {
+    grow(ws.Ix, ws.size, size);
+    grow(ws.Iy, ws.size, size);
+    grow(ws.Iw, ws.size, size);
+    grow(ws.DI, ws.size, size);
+    grow(ws.rho, ws.size, size);
+    grow(ws.Is, 2*ws.size, 2*size);
+    ws.size=size;
+  }
+
+  if(npixels>ws.npixels)
+  {
+    grow(ws.pts.I1, ws.npixels, npixels);
+    grow(ws.pts.Ix, ws.npixels, npixels);
+    grow(ws.pts.Iy, ws.npixels, npixels);
+    grow(ws.pts.x, ws.npixels, npixels);
+    grow(ws.pts.y, ws.npixels, npixels);
+    ws.npixels=npixels;
+  }
+
+  //the planes are aligned, as in sd_allocate
+  if(sd_size>ws.sd_size)
+  {
+    sd_free(ws.DIJ);
+    ws.DIJ=sd_allocate(1, sd_size);
+    ws.sd_size=sd_size;
+    #pragma omp atomic
+    allocations++;
+  }
+
+  //the points are added with push_back, which only allocates when the
+  //capacity of the vector is exceeded
+  if((int)ws.x.capacity()>ws.npoints)
+  {
+    ws.npoints=ws.x.capacity();
+    #pragma omp atomic
+    allocations++;
+  }
+  if((int)ws.corners.capacity()>ws.ncorners)
+  {
+    ws.ncorners=ws.corners.capacity();
+    #pragma omp atomic
+    allocations++;
+  }
+
+  if(ws.partials==NULL)
+  {
+    ws.partials=sd_partials_allocate(ws.nthreads);
+    #pragma omp atomic
+    allocations++;
+  }
+}
+
+
+/**
+ *
+ *  Make room for the copy of an image of nx x ny pixels with a replicated
+ *  border
+ *
+ */
+void workspace_reserve_padded(
+  IcaWorkspace &ws, //workspace
+  int nx,           //image width
+  int ny            //image height
+)
+{
+  int size=padded_size(nx, ny);
+  grow(ws.Ip, ws.padded, size);
+  if(size>ws.padded) ws.padded=size;
+}
+
+
+/**
+ *
+ *  Make room for a pyramid of nscales scales, computing the size of each
+ *  scale. The first scale is not stored: it points to the input images
+ *
+ */
+void workspace_reserve_pyramid(
+  IcaWorkspace &ws, //workspace
+  int nxx,          //image width
+  int nyy,          //image height
+  int nscales,      //number of scales
+  float nu         //downsampling factor
+)
+{
+  if(nscales>ws.nscales)
+  {
+    //release the previous pyramid
+    for(int s=1; s<ws.nscales; s++)
+    {
+      delete []ws.I1s[s];
+      delete []ws.I2s[s];
+      delete []ws.ps[s];
+    }
+    delete []ws.I1s;
+    delete []ws.I2s;
+    delete []ws.ps;
+    delete []ws.nx;
+    delete []ws.ny;
+    delete []ws.scale_size;
+
+    ws.I1s=new float*[nscales];
+    ws.I2s=new float*[nscales];
+    ws.ps =new float*[nscales];
+    ws.nx =new int[nscales];
+    ws.ny =new int[nscales];
+    ws.scale_size=new int[nscales];
+    #pragma omp atomic
+    allocations+=6;
+
+    for(int s=0; s<nscales; s++)
+    {
+      ws.I1s[s]=ws.I2s[s]=ws.ps[s]=NULL;
+      ws.scale_size[s]=0;
+    }
+    for(int s=1; s<nscales; s++)
+    {
+      ws.ps[s]=new float[MAX_NPARAMS];
+      #pragma omp atomic
+      allocations++;
+    }
+    ws.nscales=nscales;
+  }
+
+  ws.nx[0]=nxx;
+  ws.ny[0]=nyy;
+
+  //the coarser scales are allocated for the size of each scale
+  for(int s=1; s<nscales; s++)
+  {
+    zoom_size(ws.nx[s-1], ws.ny[s-1], ws.nx[s], ws.ny[s], nu);
+
+    int size=ws.nx[s]*ws.ny[s];
+    grow(ws.I1s[s], ws.scale_size[s], size);
+    grow(ws.I2s[s], ws.scale_size[s], size);
+    if(size>ws.scale_size[s]) ws.scale_size[s]=size;
+  }
+}
+
+
+/**
+ *
+ *  Keep the pyramid of the second image of the last call as the pyramid
+ *  of the first image of the next one. The levels are swapped, so that
+ *  those of the first image are reused for the next second image
+ *
+ */
+void workspace_roll_pyramid(
+  IcaWorkspace &ws //workspace
+)
+{
+  float **I=ws.I1s;
+  ws.I1s=ws.I2s;
+  ws.I2s=I;
+  ws.rolled=ws.levels;
+}
+
+
+/**
+ *
+ *  Release the memory of the workspace
+ *
+ */
+void workspace_free(
+  IcaWorkspace &ws //workspace
+)
+{
+  for(int s=1; s<ws.nscales; s++)
+  {
+    delete []ws.I1s[s];
+    delete []ws.I2s[s];
+    delete []ws.ps[s];
+  }
+  delete []ws.I1s;
+  delete []ws.I2s;
+  delete []ws.ps;
+  delete []ws.nx;
+  delete []ws.ny;
+  delete []ws.scale_size;
+
+  delete []ws.Ix;
+  delete []ws.Iy;
+  delete []ws.Iw;
+  delete []ws.DI;
+  delete []ws.rho;
+  delete []ws.Is;
+  delete []ws.Ip;
+  sd_free(ws.DIJ);
+  sd_free(ws.partials);
+  delete []ws.pts.I1;
+  delete []ws.pts.Ix;
+  delete []ws.pts.Iy;
+  delete []ws.pts.x;
+  delete []ws.pts.y;
+  std::vector<int>().swap(ws.x);
+  std::vector<int>().swap(ws.corners);
+
+  workspace_init(ws);
+}
+
+
+/**
+ *
+ *  Number of heap allocations done by the workspaces since the start of
+ *  the program. It is used to check that the buffers are reused
+ *
+ */
+long workspace_allocations()
+{
+  return allocations;
+}
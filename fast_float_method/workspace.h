@@ -0,0 +1,164 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <vector>
+
+/**
+  *
+  *  Pixels of the patches of the selected points, gathered once per scale
+  *  in contiguous arrays, patch by patch and row by row, so that the
+  *  iterations neither compute the coordinates from the positions in the
+  *  image nor read the first image at scattered positions
+  *
+**/
+struct PatchPixels
+{
+  int N;          //number of pixels
+  float *I1;     //first image
+  float *Ix;     //x derivate of the first image
+  float *Iy;     //y derivate of the first image
+  float *x;      //x coordinates
+  float *y;      //y coordinates
+};
+
+
+/**
+  *
+  *  Buffers of the estimator, reused across scales and across calls.
+  *  The buffers are sized for the largest scale and only grow when a
+  *  larger image, more scales or more parameters are requested, so that
+  *  the iterations, and the whole estimation once the workspace is sized,
+  *  run without heap allocations
+  *
+**/
+struct IcaWorkspace
+{
+  int size;       //capacity of the image buffers
+  int sd_size;    //capacity of the steepest descent images
+  int nscales;    //capacity of the pyramid
+  int nthreads;   //number of stripes of the partial sums
+  int npoints;    //capacity of the selected points
+  int ncorners;   //capacity of the candidate corners
+  int npixels;    //capacity of the pixels of the patches
+  int padded;     //capacity of the padded image
+
+  float *Ix;     //x derivate of the first image
+  float *Iy;     //y derivate of the first image
+  float *Iw;     //warp of the second image
+  float *DI;     //error image
+  float *rho;    //robust weights of the last Hessian
+  float *DIJ;    //steepest descent images
+  float *Is;     //smoothed images used to build the pyramid, 2*size
+  float *Ip;     //copy of the image being differentiated or warped, with
+                 //a replicated border (see padded_image.h)
+  float *partials; //partial sums of the threads
+  std::vector<int> x; //first pixel of the patch of each selected point
+  PatchPixels pts;    //pixels of the patches
+  std::vector<int> corners; //best corner of each cell
+
+  float **I1s;   //pyramid of the first image
+  float **I2s;   //pyramid of the second image
+  float **ps;    //transform at each scale
+  int *nx;        //number of columns at each scale
+  int *ny;        //number of rows at each scale
+  int *scale_size;//capacity of each scale of the pyramid
+  int levels;     //number of scales built by the last call
+  int rolled;     //scales of the pyramid of the next first image in I1s
+};
+
+
+/**
+ *
+ *  Initialize an empty workspace, without allocating memory
+ *
+ */
+void workspace_init(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Make room for images of size values and for sd_size values of the
+ *  steepest descent images (zero in the matrix-free mode). It is called
+ *  again after selecting the points, which are stored in x, to make room
+ *  for the npixels pixels of their patches
+ *
+ */
+void workspace_reserve(
+  IcaWorkspace &ws, //workspace
+  int size,         //number of values of the images
+  int sd_size,      //number of values of the steepest descent images
+  int npixels=0     //number of pixels of the patches
+);
+
+
+/**
+ *
+ *  Make room for the copy of an image of nx x ny pixels with a replicated
+ *  border
+ *
+ */
+void workspace_reserve_padded(
+  IcaWorkspace &ws, //workspace
+  int nx,           //image width
+  int ny            //image height
+);
+
+
+/**
+ *
+ *  Make room for a pyramid of nscales scales, computing the size of each
+ *  scale. The first scale is not stored: it points to the input images
+ *
+ */
+void workspace_reserve_pyramid(
+  IcaWorkspace &ws, //workspace
+  int nxx,          //image width
+  int nyy,          //image height
+  int nscales,      //number of scales
+  float nu         //downsampling factor
+);
+
+
+/**
+ *
+ *  Keep the pyramid of the second image of the last call as the pyramid
+ *  of the first image of the next one, for consecutive frames of a
+ *  sequence. The next call must take the second image of the last call
+ *  as its first image, with the same size and zoom factor and at most
+ *  the same number of scales
+ *
+ */
+void workspace_roll_pyramid(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Release the memory of the workspace
+ *
+ */
+void workspace_free(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Number of heap allocations done by the workspaces since the start of
+ *  the program. It is used to check that the buffers are reused
+ *
+ */
+long workspace_allocations();
+
+#endif
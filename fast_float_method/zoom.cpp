@@ -17,6 +17,8 @@
 #include "transformation.h"
 
 #define ZOOM_SIGMA_ZERO 0.6
+#define ZOOM_BLOCK 256 //number of columns smoothed at once when re-sampling
+#define ZOOM_RECURSIVE_SIGMA 3.0 //larger sigmas use the recursive Gaussian
 
 /**
   *
@@ -38,67 +40,301 @@ void zoom_size
 
 /**
   *
-  * Function to downsample the image
+  * Reflecting boundary condition, as in the Gaussian convolution
   *
 **/
-void zoom_out
-(
-  float *I,    //input image
-  float *Iout, //output image
+static inline int reflect(
+  int i, //position
+  int n  //number of values
+)
+{
+  if(i<0) return -i;
+  if(i>=n) return 2*n-1-i;
+  return i;
+}
+
+
+/**
+  *
+  * Neumann boundary condition, as in the bicubic interpolation
+  *
+**/
+static inline int clamp(
+  int i, //position
+  int n  //number of values
+)
+{
+  if(i<0) return 0;
+  if(i>=n) return n-1;
+  return i;
+}
+
+
+/**
+  *
+  * Convolution of a row with the Gaussian kernel, only at the columns 0,
+  * step, 2*step... The taps are added in the same order as in gaussian,
+  * so the values are equal to those of the smoothed image. The columns
+  * far from the borders are computed tap by tap, which is vectorised
+  *
+**/
+static void convolve_row(
+  float *I,   //input row
+  float *out, //output values
+  float *B,   //coefficients of the Gaussian kernel
+  int size,    //number of coefficients
+  int nx,      //width of the row
+  int nout,    //number of output values
+  int step     //distance between the output columns
+)
+{
+  //output values whose taps are inside the row
+  int first=(size+step-2)/step;
+  int last=(nx-size)/step+1;
+  if(last>nout) last=nout;
+  if(first>last) first=last;
+
+  for(int k=first; k<last; k++)
+    out[k]=B[0]*I[k*step];
+  for(int j=1; j<size; j++)
+    for(int k=first; k<last; k++)
+      out[k]+=B[j]*(I[k*step-j]+I[k*step+j]);
+
+  //output values near the borders
+  for(int k=0; k<nout; k++)
+  {
+    if(k==first) k=last;
+    if(k>=nout) break;
+
+    int c=k*step;
+    float sum=B[0]*I[c];
+    for(int j=1; j<size; j++)
+      sum+=B[j]*(I[reflect(c-j, nx)]+I[reflect(c+j, nx)]);
+    out[k]=sum;
+  }
+}
+
+
+/**
+  *
+  * Convolution of len columns with the Gaussian kernel at row i. The rows
+  * are traversed contiguously, which is vectorised
+  *
+**/
+static void convolve_column(
+  float *I,   //input image, at the first column
+  float *out, //output values
+  float *B,   //coefficients of the Gaussian kernel
+  int size,    //number of coefficients
+  int i,       //row of the output values
+  int len,     //number of columns
+  int stride,  //number of values of each row
+  int ny       //number of rows
+)
+{
+  float *I0=I+i*stride;
+  for(int k=0; k<len; k++)
+    out[k]=B[0]*I0[k];
+
+  for(int j=1; j<size; j++)
+  {
+    float *Im=I+reflect(i-j, ny)*stride;
+    float *Ip=I+reflect(i+j, ny)*stride;
+    for(int k=0; k<len; k++)
+      out[k]+=B[j]*(Im[k]+Ip[k]);
+  }
+}
+
+
+/**
+  *
+  * Resample row i of the zoomed image from an image smoothed along the
+  * rows: the four rows of the bicubic interpolation are smoothed along
+  * the columns by blocks, interpolated in y and then in x, in the same
+  * order as the bicubic interpolation of the smoothed image
+  *
+**/
+static void resample_row(
+  float *Is,   //image smoothed along the rows
+  float *Iout, //output row of the zoomed image
+  float *B,    //coefficients of the Gaussian kernel
+  int size,     //number of coefficients
+  int i,        //row of the zoomed image
+  float factor,//zoom factor between 0 and 1
   int nx,       //image width
-  int ny,       //image height          
-  float factor //zoom factor between 0 and 1
+  int ny,       //image height
+  int nxx       //width of the zoomed image
 )
 {
-  int nxx, nyy, original_size =nx*ny; 
-  float *Is=new float[original_size];
+  float c[4][ZOOM_BLOCK], v[ZOOM_BLOCK], p[4];
+
+  float yy=(float)i/factor;
+  int y=(int)yy;
 
-  for (int i=0; i<original_size; i++)
-    Is[i]=I[i];
+  int j=0;
+  while(j<nxx)
+  {
+    //zoomed columns whose taps fit in a block of columns
+    int k0=clamp((int)((float)j/factor)-1, nx);
+    int j1=j, k1=k0;
+    while(j1<nxx)
+    {
+      int k=clamp((int)((float)j1/factor)+2, nx);
+      if(k-k0>=ZOOM_BLOCK) break;
+      k1=k;
+      j1++;
+    }
+    int len=k1-k0+1;
+
+    //smooth the four rows along the columns and interpolate them in y
+    for(int t=0; t<4; t++)
+      convolve_column(
+        &(Is[k0]), c[t], B, size, clamp(y-1+t, ny), len, nx, ny
+      );
+    for(int k=0; k<len; k++)
+    {
+      p[0]=c[0][k]; p[1]=c[1][k]; p[2]=c[2][k]; p[3]=c[3][k];
+      v[k]=cubic_interpolation(p, yy-y);
+    }
+
+    //interpolate the block in x
+    for(; j<j1; j++)
+    {
+      float xx=(float)j/factor;
+      int x=(int)xx;
+      for(int t=0; t<4; t++)
+        p[t]=v[clamp(x-1+t, nx)-k0];
+      Iout[j]=cubic_interpolation(p, xx-x);
+    }
+  }
+}
+
+
+/**
+  *
+  * Function to downsample the two images, which are processed in the same
+  * parallel loops, or only the first one if the second is NULL. The images
+  * are smoothed and sampled with the bicubic interpolation; the smoothing is
+  * restricted to the values that are interpolated. With a factor of 0.5, the
+  * samples are the even pixels, where the interpolation is the smoothed
+  * image, so the rows are smoothed only at the even columns and the columns
+  * at the even rows
+  *
+**/
+void zoom_out
+(
+  float *I1,    //first input image
+  float *I2,    //second input image, or NULL
+  float *I1out, //first output image
+  float *I2out, //second output image, or NULL
+  int nx,        //image width
+  int ny,        //image height          
+  float factor, //zoom factor between 0 and 1
+  float *buffer //2*nx*ny values for the smoothed images, or NULL
+)
+{
+  int nxx, nyy, size;
+  float *Is=(buffer==NULL)?new float[2*nx*ny]:buffer;
+  float *I[2]={I1, I2};
+  float *Iout[2]={I1out, I2out};
+  int nimages=(I2==NULL)?1:2; //number of images to downsample
 
   //calculate the size of the zoomed image
   zoom_size(nx, ny, nxx, nyy, factor);
   
   //compute the Gaussian sigma for smoothing
   float sigma=ZOOM_SIGMA_ZERO*sqrt(1.0/(factor*factor)-1.0);
+  float *B=gaussian_kernel(sigma, size);
 
-  //pre-smooth the image
-  gaussian(Is, nx, ny, sigma);
-  
-  // re-sample the image using bicubic interpolation 
-  for (int i1=0; i1<nyy; i1++)
-    for (int j1=0; j1<nxx; j1++)
+  if(sigma<=ZOOM_RECURSIVE_SIGMA && (size>nx || size>ny))
+  {
+    printf("GaussianSmooth: sigma too large for this bc\n");
+    throw 1;
+  }
+
+  if(sigma>ZOOM_RECURSIVE_SIGMA)
+  {
+    //the window is large for small factors: the images are smoothed with
+    //the recursive filter and re-sampled with a unit kernel
+    float one=1.0;
+    for(int m=0; m<nimages; m++)
     {
-      float i2=(float)i1/factor;
-      float j2=(float)j1/factor;
-      Iout[i1*nxx+j1]=
-	  bicubic_interpolation(Is, j2, i2, nx, ny);  
-    }   
-  delete []Is;
+      #pragma omp parallel for schedule(static)
+      for(int i=0; i<nx*ny; i++)
+        Is[m*nx*ny+i]=I[m][i];
+      gaussian_recursive(&(Is[m*nx*ny]), nx, ny, sigma);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      resample_row(
+        &(Is[m*ny*nx]), &(Iout[m][i*nxx]), &one, 1, i, factor, nx, ny, nxx
+      );
+    }
+  }
+  else if(factor==0.5)
+  {
+    //smooth the rows at the even columns
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*ny; n++)
+    {
+      int m=n/ny, i=n%ny;
+      convolve_row(
+        &(I[m][i*nx]), &(Is[(m*ny+i)*nxx]), B, size, nx, nxx, 2
+      );
+    }
+
+    //smooth the columns at the even rows
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      convolve_column(
+        &(Is[m*ny*nxx]), &(Iout[m][i*nxx]), B, size, 2*i, nxx, nxx, ny
+      );
+    }
+  }
+  else
+  {
+    //smooth the rows
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*ny; n++)
+    {
+      int m=n/ny, i=n%ny;
+      convolve_row(&(I[m][i*nx]), &(Is[(m*ny+i)*nx]), B, size, nx, nx, 1);
+    }
+
+    //smooth the columns and re-sample the image
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nimages*nyy; n++)
+    {
+      int m=n/nyy, i=n%nyy;
+      resample_row(
+        &(Is[m*ny*nx]), &(Iout[m][i*nxx]), B, size, i, factor, nx, ny, nxx
+      );
+    }
+  }
+
+  if(buffer==NULL) delete []Is;
 }
 
 
 /**
   *
-  * Function to upsample the parameters of the transformation
+  * Scale the parameters of the transformation by the factor between the
+  * sizes of two scales
   *
 **/
-void zoom_in_parameters 
+static void scale_parameters
 (
-  float *p,    //input image
-  float *pout, //output image   
+  float *p,    //input parameters
+  float *pout, //output parameters, which can be p
   int nparams,  //number of parameters
-  int nx,       //width of the original image
-  int ny,       //height of the original image
-  int nxx,      //width of the zoomed image
-  int nyy       //height of the zoomed image
+  float nu     //factor between the scales
 )
 {
-  //compute the zoom factor
-  float factorx=((float)nxx/nx);
-  float factory=((float)nyy/ny);
-  float nu=(factorx>factory)?factorx:factory;
-
   switch(nparams) {
     default: case TRANSLATION_TRANSFORM: //p=(tx, ty) 
       pout[0]=p[0]*nu;
@@ -135,3 +371,54 @@ void zoom_in_parameters
       break;
   }
 }
+
+
+/**
+  *
+  * Function to upsample the parameters of the transformation
+  *
+**/
+void zoom_in_parameters 
+(
+  float *p,    //input image
+  float *pout, //output image   
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+)
+{
+  //compute the zoom factor
+  float factorx=((float)nxx/nx);
+  float factory=((float)nyy/ny);
+  float nu=(factorx>factory)?factorx:factory;
+
+  scale_parameters(p, pout, nparams, nu);
+}
+
+
+/**
+  *
+  * Function to downsample the parameters of the transformation, the
+  * inverse of zoom_in_parameters from the smaller to the larger scale
+  *
+**/
+void zoom_out_parameters 
+(
+  float *p,    //input parameters
+  float *pout, //output parameters
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+)
+{
+  //compute the zoom factor of zoom_in_parameters
+  float factorx=((float)nx/nxx);
+  float factory=((float)ny/nyy);
+  float nu=(factorx>factory)?factorx:factory;
+
+  scale_parameters(p, pout, nparams, 1/nu);
+}
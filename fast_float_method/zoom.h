@@ -27,16 +27,20 @@ void zoom_size
 
 /**
   *
-  * Function to downsample the image
+  * Function to downsample the two images, which are processed in the same
+  * parallel loops, or only the first one if the second is NULL
   *
 **/
 void zoom_out
 (
-  float *I,    //input image
-  float *Iout, //output image
-  int nx,       //image width
-  int ny,       //image height             
-  float factor = 0.5 //zoom factor between 0 and 1
+  float *I1,    //first input image
+  float *I2,    //second input image, or NULL
+  float *I1out, //first output image
+  float *I2out, //second output image, or NULL
+  int nx,        //image width
+  int ny,        //image height             
+  float factor = 0.5,  //zoom factor between 0 and 1
+  float *buffer = NULL //2*nx*ny values for the smoothed images, or NULL
 );
 
 /**
@@ -55,4 +59,21 @@ void zoom_in_parameters
   int nyy       //height of the zoomed image
 );
 
+/**
+  *
+  * Function to downsample the parameters of the transformation, the
+  * inverse of zoom_in_parameters
+  *
+**/
+void zoom_out_parameters 
+(
+  float *p,    //input parameters
+  float *pout, //output parameters
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+);
+
 #endif
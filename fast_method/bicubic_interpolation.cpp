@@ -7,31 +7,15 @@
 // All rights reserved.
 
 
+#include <math.h>
+
 #include "bicubic_interpolation.h"
+#include "padded_image.h"
 #include "transformation.h"
 
-
-/**
-  *
-  * Neumann boundary condition test
-  *
-**/
-int
-neumann_bc (int x, int nx, bool & out)
-{
-  if (x<0)
-    {
-      if(x < -2) out = true;
-      x = 0;
-    }
-  else if (x >= nx)
-    {
-      if(x > nx+1) out = true;
-      x = nx - 1;
-    }
-  return x;
-}
-
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 /**
   *
@@ -70,16 +54,66 @@ bicubic_interpolation(
   return cubic_interpolation (v, x);
 }
 
+/**
+  *
+  * Bicubic interpolation of a point whose 4x4 taps are inside the padded
+  * image, from the integer part of its coordinates
+  *
+**/
+static inline double bicubic_taps(
+  double *input, //padded image to be interpolated
+  double uu,     //x coordinate of the point
+  double vv,     //y coordinate of the point
+  int x,         //integer part of uu
+  int y,         //integer part of vv
+  int w          //width of the rows of the padded image
+)
+{
+  //obtain the interpolation points of the image
+  double *r=&(input[(y-1)*w+x-1]);
+  double pol[4][4] = { 
+    {r[0], r[w], r[2*w], r[3*w]}, {r[1], r[w+1], r[2*w+1], r[3*w+1]},
+    {r[2], r[w+2], r[2*w+2], r[3*w+2]}, {r[3], r[w+3], r[2*w+3], r[3*w+3]}
+  };
+
+  //return interpolation
+  return bicubic_interpolation (pol, uu - x, vv - y);
+}
+
 
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Check if a point is inside the image or less than one pixel away from
+  * it, so that its taps are inside the guard band. Otherwise, the point is
+  * moved to the nearest point of the border, unless it is put to zero
+  *
+**/
+static inline bool bicubic_inside(
+  double &uu,     //x coordinate of the point
+  double &vv,     //y coordinate of the point
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  if(uu>=-1 && vv>=-1 && uu<nx && vv<ny) return true;
+  if(border_out) return false;
+
+  uu=(uu<-1)?-1:(uu>nx-1)?nx-1:uu;
+  vv=(vv<-1)?-1:(vv>ny-1)?ny-1:vv;
+  return true;
+}
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 double
 bicubic_interpolation(
-  double *input,//image to be interpolated
+  double *input,//padded image to be interpolated
   double uu,    //x component of the vector field
   double vv,    //y component of the vector field
   int nx,       //width of the image
@@ -87,99 +121,228 @@ bicubic_interpolation(
   bool border_out //if true, put zeros outside the region
 )
 {
-  int sx = (uu < 0) ? -1 : 1;
-  int sy = (vv < 0) ? -1 : 1;
-
-  int x, y, mx, my, dx, dy, ddx, ddy;
-  bool out = false;
-
-  x = neumann_bc ((int) uu, nx, out);
-  y = neumann_bc ((int) vv, ny, out);
-  mx = neumann_bc ((int) uu - sx, nx, out);
-  my = neumann_bc ((int) vv - sx, ny, out);
-  dx = neumann_bc ((int) uu + sx, nx, out);
-  dy = neumann_bc ((int) vv + sy, ny, out);
-  ddx = neumann_bc ((int) uu + 2 * sx, nx, out);
-  ddy = neumann_bc ((int) vv + 2 * sy, ny, out);
-
-  if (out && border_out) 
-    return 0;
-  else
+  if(!bicubic_inside(uu, vv, nx, ny, border_out)) return 0;
+
+  //the points of the first pixel of the band use the taps to the left
+  int x=(uu<0)?-1:(int) uu;
+  int y=(vv<0)?-1:(int) vv;
+  return bicubic_taps(input, uu, vv, x, y, nx+2*IMAGE_BORDER);
+}
+
+
+/**
+  *
+  * Weights of the four taps of the cubic interpolation, so that
+  * cubic_interpolation(v, x) is the sum of w[k]*v[k]
+  *
+**/
+static inline void cubic_weights(
+  double x,  //position with respect to the second tap
+  double *w  //output weights of the taps
+)
+{
+  double x2=x*x;
+  double x3=x2*x;
+  w[0]=0.5*(-x+2.0*x2-x3);
+  w[1]=1.0+0.5*(3.0*x3-5.0*x2);
+  w[2]=0.5*(x+4.0*x2-3.0*x3);
+  w[3]=0.5*(x3-x2);
+}
+
+
+#if defined(__AVX2__) && defined(__FMA__)
+/**
+  *
+  * Bicubic interpolation of a point whose 4x4 taps are inside the padded
+  * image, with AVX2. The separable weights are computed once and each row
+  * of four taps is read with a single load: the rows are combined with the
+  * weights in y and the result is reduced with the weights in x
+  *
+**/
+static inline double bicubic_interpolation_avx(
+  double *input, //padded image to be interpolated
+  double uu,     //x coordinate of the point
+  double vv,     //y coordinate of the point
+  int x,         //integer part of uu
+  int y,         //integer part of vv
+  int w          //width of the rows of the padded image
+)
+{
+  double wx[4], wy[4];
+  cubic_weights(uu-x, wx);
+  cubic_weights(vv-y, wy);
+
+  double *r=&(input[(y-1)*w+x-1]);
+  __m256d v=_mm256_mul_pd(_mm256_set1_pd(wy[0]), _mm256_loadu_pd(r));
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[1]), _mm256_loadu_pd(r+w), v);
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[2]), _mm256_loadu_pd(r+2*w), v);
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[3]), _mm256_loadu_pd(r+3*w), v);
+  v=_mm256_mul_pd(v, _mm256_loadu_pd(wx));
+
+  __m128d h=_mm_add_pd(
+    _mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)
+  );
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+#endif
+
+
+/**
+  *
+  * Compute the bicubic interpolation of n points of a padded image. The
+  * taps of the points are read from the guard band near the border, so
+  * the same kernel is used for all the points. With AVX2, it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  double *input,  //padded image to be interpolated
+  double *uu,     //x coordinates of the points
+  double *vv,     //y coordinates of the points
+  double *output, //output interpolated values
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int w=nx+2*IMAGE_BORDER; //width of the rows of the padded image
+
+  for(int i=0; i<n; i++)
+  {
+    double u=uu[i], v=vv[i];
+    if(!bicubic_inside(u, v, nx, ny, border_out))
     {
-      //obtain the interpolation points of the image
-      double p11 = input[mx  + nx * my];
-      double p12 = input[x   + nx * my];
-      double p13 = input[dx  + nx * my];
-      double p14 = input[ddx + nx * my];
-
-      double p21 = input[mx  + nx * y];
-      double p22 = input[x   + nx * y];
-      double p23 = input[dx  + nx * y];
-      double p24 = input[ddx + nx * y];
-
-      double p31 = input[mx  + nx * dy];
-      double p32 = input[x   + nx * dy];
-      double p33 = input[dx  + nx * dy];
-      double p34 = input[ddx + nx * dy];
-
-      double p41 = input[mx  + nx * ddy];
-      double p42 = input[x   + nx * ddy];
-      double p43 = input[dx  + nx * ddy];
-      double p44 = input[ddx + nx * ddy];
-
-      //create array
-      double pol[4][4] = { 
-        {p11, p21, p31, p41}, {p12, p22, p32, p42},
-        {p13, p23, p33, p43}, {p14, p24, p34, p44}
-      };
-
-      //return interpolation
-      return bicubic_interpolation (pol, (double) uu - x, (double) vv - y);
+      output[i]=0;
+      continue;
     }
+
+    int x=(u<0)?-1:(int) u;
+    int y=(v<0)?-1:(int) v;
+#if defined(__AVX2__) && defined(__FMA__)
+    output[i]=bicubic_interpolation_avx(input, u, v, x, y, w);
+#else
+    output[i]=bicubic_taps(input, u, v, x, y, w);
+#endif
+  }
 }
 
 
+/**
+  *
+  * Compute the bicubic interpolation of n points of a padded image warped
+  * with a translation. The subpixel offset is the same for every point, so
+  * the weights of the taps are computed once for all the points whose taps
+  * are inside the padded image; for integer translations, these points are
+  * copied
+  *
+**/
+void bicubic_interpolation_translation(
+  double *input,  //padded image to be warped
+  double *x,      //x coordinates of the points
+  double *y,      //y coordinates of the points
+  double *output, //output interpolated values
+  double *params, //parameters of the translation
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int w=nx+2*IMAGE_BORDER; //width of the rows of the padded image
+  int dx=(int) floor(params[0]);
+  int dy=(int) floor(params[1]);
+  double tx=params[0]-dx;
+  double ty=params[1]-dy;
+  bool shift=(tx==0 && ty==0);
+
+  double wx[4], wy[4];
+  cubic_weights(tx, wx);
+  cubic_weights(ty, wy);
+
+  for(int i=0; i<n; i++)
+  {
+    int xi=(int)x[i]+dx;
+    int yi=(int)y[i]+dy;
 
+    if(xi>=-1 && yi>=-1 && xi<nx && yi<ny)
+    {
+      if(shift)
+        output[i]=input[yi*w+xi];
+      else
+      {
+        //separable interpolation with the constant weights
+        double *r=&(input[(yi-1)*w+xi-1]);
+        double v=0.0;
+        for(int l=0; l<4; l++, r+=w)
+          v+=wy[l]*(wx[0]*r[0]+wx[1]*r[1]+wx[2]*r[2]+wx[3]*r[3]);
+        output[i]=v;
+      }
+    }
+    else
+      output[i]=border_out?0:bicubic_interpolation(
+        input, x[i]+params[0], y[i]+params[1], nx, ny, false
+      );
+  }
+}
 
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,   //image to be warped
-  std::vector<int> &p, //selected points
+  double *input,   //padded image to be warped
+  double *x,       //x coordinates of the points
+  double *y,       //y coordinates of the points
   double *output,  //warped output image with bicubic interpolation
   double *params,  //x component of the vector field
+  int N,           //number of points
   int nparams,     //number of parameters of the transform
   int nx,          //width of the image
   int ny,          //height of the image 
   bool border_out  //if true, put zeros outside the region
 )
 {
-  for (unsigned int i=0; i<p.size(); i++)
-  {
-    double x, y;
-    double x1=p[i]%nx;
-    double y1=(int)(p[i]/nx);
-
-    //transform coordinates using the parametric model
-    project(x1, y1, params, x, y, nparams);
-    
-    //obtain the bicubic interpolation at position (uu, vv)
-    output[i]=bicubic_interpolation(input, x, y, nx, ny, border_out);
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM:
+      bicubic_interpolation<TRANSLATION_TRANSFORM>(
+        input, x, y, output, params, N, nx, ny, border_out
+      );
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      bicubic_interpolation<EUCLIDEAN_TRANSFORM>(
+        input, x, y, output, params, N, nx, ny, border_out
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      bicubic_interpolation<SIMILARITY_TRANSFORM>(
+        input, x, y, output, params, N, nx, ny, border_out
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      bicubic_interpolation<AFFINITY_TRANSFORM>(
+        input, x, y, output, params, N, nx, ny, border_out
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      bicubic_interpolation<HOMOGRAPHY_TRANSFORM>(
+        input, x, y, output, params, N, nx, ny, border_out
+      );
+      break;
   }
 }
 
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,   //image to be warped
+  double *input,   //padded image to be warped
   double *output,  //warped output image with bicubic interpolation
   double *params,  //x component of the vector field
   int nparams,     //number of parameters of the transform
@@ -188,18 +351,32 @@ void bicubic_interpolation(
   bool border_out  //if true, put zeros outside the region
 )
 {
-  for (int i=0; i<ny; i++)
-    for (int j=0; j<nx; j++)
-    {
-      double x, y;
-
-      //transform coordinates using the parametric model
-      project(j, i, params, x, y, nparams);
-      
-      //obtain the bicubic interpolation at position (uu, vv)
-      output[i*nx+j]=bicubic_interpolation(
-	input, x, y, nx, ny, border_out
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM:
+      bicubic_interpolation<TRANSLATION_TRANSFORM>(
+        input, output, params, nx, ny, border_out
       );
-    }
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      bicubic_interpolation<EUCLIDEAN_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      bicubic_interpolation<SIMILARITY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      bicubic_interpolation<AFFINITY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      bicubic_interpolation<HOMOGRAPHY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+  }
 }
 
@@ -13,15 +13,32 @@
 
 #include <vector>
 
+#include "padded_image.h"
+#include "transformation.h"
+
+#define BICUBIC_BLOCK 256 //number of points interpolated in each call
+
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Bicubic interpolation in one dimension
+  *
+**/
+double
+cubic_interpolation(
+  double v[4],  //interpolation points
+  double x      //point to be interpolated
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 double
 bicubic_interpolation(
-  double *input,//image to be interpolated
+  double *input,//padded image to be interpolated
   double uu,    //x component of the vector field
   double vv,    //y component of the vector field
   int nx,       //width of the image
@@ -32,14 +49,54 @@ bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of n points of a padded image. The
+  * same kernel is used for all the points and, with AVX2, it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  double *input,  //padded image to be interpolated
+  double *uu,     //x coordinates of the points
+  double *vv,     //y coordinates of the points
+  double *output, //output interpolated values
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out=true //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of n points of a padded image warped
+  * with a translation, with the same weights for all the points
+  *
+**/
+void bicubic_interpolation_translation(
+  double *input,  //padded image to be warped
+  double *x,      //x coordinates of the points
+  double *y,      //y coordinates of the points
+  double *output, //output interpolated values
+  double *params, //parameters of the translation
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out=true //if true, put zeros outside the region
+);
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,        //image to be warped
-  std::vector<int> &x, //selected points
+  double *input,        //padded image to be warped
+  double *x,            //x coordinates of the points
+  double *y,            //y coordinates of the points
   double *output,       //warped output image with bicubic interpolation
   double *params,       //x component of the vector field
+  int N,                //number of points
   int nparams,          //number of parameters of the transform
   int nx,               //width of the image
   int ny,               //height of the image
@@ -50,11 +107,12 @@ void bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,        //image to be warped
+  double *input,        //padded image to be warped
   double *output,       //warped output image with bicubic interpolation
   double *params,       //x component of the vector field
   int nparams,          //number of parameters of the transform
@@ -64,6 +122,111 @@ void bicubic_interpolation(
 );
 
 
+/**
+  *
+  * Version of the warping of the selected points for a transform fixed at
+  * compile time. The matrix of the transform is built once for all the
+  * points, so the loop has no trigonometric functions. The points are
+  * interpolated by blocks in a single call
+  *
+**/
+template<int nparams>
+void bicubic_interpolation(
+  double *input,        //padded image to be warped
+  double *x,            //x coordinates of the points
+  double *y,            //y coordinates of the points
+  double *output,       //warped output image with bicubic interpolation
+  double *params,       //x component of the vector field
+  int N,                //number of points
+  int nx,               //width of the image
+  int ny,               //height of the image
+  bool border_out=true  //if true, put zeros outside the region
+)
+{
+  //the translation uses the same weights for every point
+  if(nparams==TRANSLATION_TRANSFORM)
+  {
+    bicubic_interpolation_translation(
+      input, x, y, output, params, N, nx, ny, border_out
+    );
+    return;
+  }
+
+  double m[9];
+  params2matrix(params, m, nparams);
+
+  for (int i=0; i<N; i+=BICUBIC_BLOCK)
+  {
+    int len=(N-i<BICUBIC_BLOCK)?N-i:BICUBIC_BLOCK;
+    double xw[BICUBIC_BLOCK], yw[BICUBIC_BLOCK];
+
+    //transform coordinates using the parametric model
+    for (int n=0; n<len; n++)
+      project_matrix<nparams>(x[i+n], y[i+n], m, xw[n], yw[n]);
+    
+    //obtain the bicubic interpolation of the block of points
+    bicubic_interpolation(
+      input, xw, yw, &(output[i]), len, nx, ny, border_out
+    );
+  }
+}
+
+
+/**
+  *
+  * Version of the warping of the image for a transform fixed at compile
+  * time. The coordinates are stepped along each row by adding the first
+  * column of the matrix of the transform, so the loop has no trigonometric
+  * functions and only the homography needs a division per pixel. The
+  * points of each block of the row are interpolated in a single call
+  *
+**/
+template<int nparams>
+void bicubic_interpolation(
+  double *input,        //padded image to be warped
+  double *output,       //warped output image with bicubic interpolation
+  double *params,       //x component of the vector field
+  int nx,               //width of the image
+  int ny,               //height of the image
+  bool border_out=true  //if true, put zeros outside the region
+)
+{
+  double m[9];
+  params2matrix(params, m, nparams);
+
+  for (int i=0; i<ny; i++)
+  {
+    //numerators and denominator of the transform at the start of the row
+    double xn=m[1]*i+m[2];
+    double yn=m[4]*i+m[5];
+    double dn=m[7]*i+m[8];
+
+    for (int j=0; j<nx; j+=BICUBIC_BLOCK)
+    {
+      int len=(nx-j<BICUBIC_BLOCK)?nx-j:BICUBIC_BLOCK;
+      double x[BICUBIC_BLOCK], y[BICUBIC_BLOCK];
 
+      //transform coordinates using the parametric model
+      for (int n=0; n<len; n++)
+      {
+        x[n]=xn;
+        y[n]=yn;
+        if(nparams==HOMOGRAPHY_TRANSFORM)
+        {
+          x[n]/=dn;
+          y[n]/=dn;
+        }
+        xn+=m[0];
+        yn+=m[3];
+        dn+=m[6];
+      }
+      
+      //obtain the bicubic interpolation of the block of the row
+      bicubic_interpolation(
+        input, x, y, &(output[i*nx+j]), len, nx, ny, border_out
+      );
+    }
+  }
+}
 
 #endif
@@ -25,17 +25,27 @@
   * 
 **/
 
+#include "reference.h"
+#include "workspace.h"
+
 #define QUADRATIC 0
 #define TRUNCATED_QUADRATIC 1
 #define GERMAN_MCCLURE 2
 #define LORENTZIAN 3
 #define CHARBONNIER 4
+#define CHARBONNIER_FAST 5
 
 #define MAX_ITER 30
 #define LAMBDA_0 80
 #define LAMBDA_N 5
 #define LAMBDA_RATIO 0.90
 
+#define PATCH_RADIUS 3        //radius of the patches around the points
+#define PATCH_SIZE (2*PATCH_RADIUS+1) //side of the patches
+#define GRID_STEP 15          //spacing of the default grid of points
+#define CORNER_THRESHOLD 0.01 //minimum response, relative to the largest
+#define WARM_START_RANGE 2.0 //motion corrected at the starting scale
+
 /**
  *
  *  Derivative of robust error functions
@@ -63,7 +73,10 @@ void inverse_compositional_algorithm(
   int nx,       //number of columns of the image
   int ny,       //number of rows of the image
   double TOL,   //Tolerance used for the convergence in the iterations
-  int verbose=0 //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  int npoints=0, //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose=0, //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 
@@ -83,12 +96,21 @@ void robust_inverse_compositional_algorithm(
   double TOL,    //Tolerance used for the convergence in the iterations
   int    robust, //robust error function
   double lambda, //parameter of robust error function
-  int verbose=0  //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  int hessian_reuse=0, //iterations between rebuilds of the robust Hessian
+  int npoints=0,  //number of points, 0 for a grid of GRID_STEP pixels
+  int verbose=0,  //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 /**
   *
-  *  Multiscale approach for computing the optical flow
+  *  Multiscale approach for computing the optical flow. It starts from
+  *  the initial transform, if it is given, down-projected to the coarsest
+  *  scale at which the residual motion is at most WARM_START_RANGE pixels,
+  *  so that the coarser scales are skipped. With a reference built from I1
+  *  with the same options (see reference_build), its patches are used
+  *  instead of those of I1, which are not computed
   *
 **/
 void pyramidal_inverse_compositional_algorithm(
@@ -103,7 +125,55 @@ void pyramidal_inverse_compositional_algorithm(
     double TOL,     //stopping criterion threshold
     int    robust,  //robust error function
     double lambda,  //parameter of robust error function
-    bool   verbose  //switch on messages
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL, //buffers reused across calls, or NULL
+    double *p0=NULL, //initial transform, or NULL to start from zero
+    double residual=-1, //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref=NULL //precomputed data of I1, or NULL
+);
+
+
+/**
+  *
+  *  Select the points of a reference image at each scale and compute the
+  *  data of their patches, for the options of the estimations that use
+  *  it. The reference is initialized with reference_init and released
+  *  with reference_free
+  *
+**/
+void reference_build(
+    IcaReference &ref, //output reference
+    double *I1,     //reference image
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    npoints, //number of points at each scale, 0 for automatic
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
+);
+
+
+/**
+  *
+  *  Check that a reference was built with the options of an estimation,
+  *  so that the estimation can use it
+  *
+**/
+bool reference_compatible(
+    const IcaReference &ref, //reference
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    npoints  //number of points at each scale, 0 for automatic
 );
 
 #endif
@@ -13,11 +13,11 @@
 #include <vector>
 /**
  *
- * Compute the gradient with central differences
+ * Compute the gradient with central differences of a padded image
  *
  */
 void gradient(
-  double *input,  //input image
+  double *input,  //input image, with a replicated border
   double *dx,     //computed x derivative
   double *dy,     //computed y derivative
   int nx,         //image width
@@ -39,6 +39,40 @@ void gradient_points(
 );
 
 
+/**
+ *
+ * Shi-Tomasi corner response: smallest eigenvalue of the structure
+ * tensor in the window of each pixel
+ *
+ */
+void corner_response(
+  double *dx,    //x derivative
+  double *dy,    //y derivative
+  double *Sxx,   //buffer for the row sums of dx*dx
+  double *Sxy,   //buffer for the row sums of dx*dy
+  double *Syy,   //buffer for the row sums of dy*dy
+  double *R,     //output corner response
+  int radius,    //radius of the window
+  int nx,        //image width
+  int ny         //image height
+);
+
+
+
+/**
+ *
+ * Coefficients of the normalized 1D Gaussian kernel, from the center to
+ * the border of the window. The table is cached for each thread, so the
+ * pointer is valid until the next call of the thread with other values
+ *
+ */
+double *
+gaussian_kernel (
+  double sigma,     //Gaussian sigma
+  int &size,        //output number of coefficients
+  int precision = 5 //defines the size of the window
+);
+
 
 /**
  *
@@ -55,4 +89,20 @@ gaussian (
   int precision = 5 //defines the size of the window
 );
 
+
+/**
+ *
+ * Convolution with a Gaussian with the recursive filter of Young and van
+ * Vliet, whose cost does not depend on sigma, with reflecting boundary
+ * conditions
+ *
+ */
+void
+gaussian_recursive (
+  double *I,    //input/output image
+  int xdim,     //image width
+  int ydim,     //image height
+  double sigma  //Gaussian sigma, at least 0.5
+);
+
 #endif
@@ -0,0 +1,69 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#include <string.h>
+
+#include "padded_image.h"
+
+
+/**
+  *
+  *  Number of values of the buffer of a padded image
+  *
+**/
+int padded_size(
+  int nx, //width of the image
+  int ny  //height of the image
+)
+{
+  return (nx+2*IMAGE_BORDER)*(ny+2*IMAGE_BORDER);
+}
+
+
+/**
+  *
+  *  Copy an image to a buffer of padded_size values and fill the guard
+  *  band with the pixels of its border. It returns the pointer to the
+  *  first pixel of the image in the buffer
+  *
+**/
+double *pad_image(
+  double *input,  //input image
+  double *buffer, //buffer of the padded image
+  int nx,         //width of the image
+  int ny          //height of the image
+)
+{
+  int w=nx+2*IMAGE_BORDER; //width of the rows of the padded image
+  double *I=&(buffer[IMAGE_BORDER*w+IMAGE_BORDER]);
+
+  //copy the rows and replicate their first and last pixels
+  #pragma omp parallel for schedule(static)
+  for(int i=0; i<ny; i++)
+  {
+    double *r=&(I[i*w]);
+    memcpy(r, &(input[i*nx]), nx*sizeof(double));
+    for(int j=1; j<=IMAGE_BORDER; j++)
+    {
+      r[-j]=r[0];
+      r[nx-1+j]=r[nx-1];
+    }
+  }
+
+  //replicate the first and last rows, including their guard band
+  for(int i=1; i<=IMAGE_BORDER; i++)
+  {
+    memcpy(&(I[-i*w-IMAGE_BORDER]), &(I[-IMAGE_BORDER]), w*sizeof(double));
+    memcpy(
+      &(I[(ny-1+i)*w-IMAGE_BORDER]), &(I[(ny-1)*w-IMAGE_BORDER]),
+      w*sizeof(double)
+    );
+  }
+
+  return I;
+}
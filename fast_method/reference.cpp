@@ -0,0 +1,388 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "reference.h"
+#include "inverse_compositional_algorithm.h"
+#include "steepest_descent.h"
+#include "zoom.h"
+
+
+/**
+  *
+  *  Header of the files of the references. The files are written in the
+  *  byte order of the machine, followed by a table of the scales and the
+  *  data of each scale, aligned to SD_ALIGN bytes
+  *
+**/
+struct ReferenceHeader
+{
+  char magic[8];    //REFERENCE_MAGIC, without the terminating zero
+  int version;      //REFERENCE_VERSION
+  int value_size;   //size of the values of the images
+  int nparams;      //number of parameters of the transform
+  int nscales;      //number of scales
+  int matrix_free;  //the steepest descent images are not stored
+  int npoints;      //number of points at each scale, 0 for automatic
+  double nu;        //downsampling factor
+  unsigned long long checksum; //checksum of the image
+};
+
+
+/**
+  *
+  *  Entry of the table of the scales of a file, with the offsets of the
+  *  data of the scale from the beginning of the file
+  *
+**/
+struct ReferenceScale
+{
+  int nx;           //number of columns
+  int ny;           //number of rows
+  int npixels;      //number of pixels of the patches
+  int sd_size;      //number of values of the steepest descent images
+  long long I1;     //offset of the values of the pixels
+  long long Ix;     //offset of the x derivates
+  long long Iy;     //offset of the y derivates
+  long long x;      //offset of the x coordinates
+  long long y;      //offset of the y coordinates
+  long long DIJ;    //offset of the steepest descent images
+  double H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian
+};
+
+
+/**
+ *
+ *  Round an offset up to the alignment of the data in the files
+ *
+ */
+static long long align_offset(
+  long long offset //offset in bytes
+)
+{
+  return (offset+SD_ALIGN-1)/SD_ALIGN*SD_ALIGN;
+}
+
+
+/**
+ *
+ *  Write a block of data at the given offset of a file, after filling
+ *  the space from the current position with zeros
+ *
+ */
+static bool write_block(
+  FILE *fd,          //file
+  long long offset,  //offset of the block
+  const void *data,  //data of the block
+  size_t size        //size of the block in bytes
+)
+{
+  static const char zeros[SD_ALIGN]={0};
+
+  long long pos=ftell(fd);
+  if(pos<0 || pos>offset) return false;
+  if(fwrite(zeros, 1, offset-pos, fd)!=(size_t)(offset-pos)) return false;
+
+  return size==0 || fwrite(data, 1, size, fd)==size;
+}
+
+
+/**
+ *
+ *  Check that a block of data is aligned and inside of a file
+ *
+ */
+static bool valid_block(
+  long long offset, //offset of the block
+  long long size,   //size of the block in bytes
+  size_t length     //size of the file
+)
+{
+  return
+    offset>=0 && offset%SD_ALIGN==0 && size>=0 &&
+    offset+size<=(long long)length;
+}
+
+
+/**
+ *
+ *  Initialize an empty reference, without allocating memory
+ *
+ */
+void reference_init(
+  IcaReference &ref //reference
+)
+{
+  ref.nparams=ref.nscales=ref.npoints=0;
+  ref.nu=0;
+  ref.matrix_free=false;
+  ref.checksum=0;
+  ref.nx=ref.ny=NULL;
+  ref.scales=NULL;
+  ref.map=NULL;
+  ref.map_size=0;
+}
+
+
+/**
+ *
+ *  Release the memory of the reference
+ *
+ */
+void reference_free(
+  IcaReference &ref //reference
+)
+{
+  //the data of a loaded reference is that of the file
+  if(ref.map!=NULL)
+    munmap(ref.map, ref.map_size);
+  else
+    for(int s=0; s<ref.nscales; s++)
+    {
+      PatchPixels &pts=ref.scales[s].pts;
+      delete []pts.I1;
+      delete []pts.Ix;
+      delete []pts.Iy;
+      delete []pts.x;
+      delete []pts.y;
+      sd_free(ref.scales[s].DIJ);
+    }
+
+  delete []ref.nx;
+  delete []ref.ny;
+  delete []ref.scales;
+
+  reference_init(ref);
+}
+
+
+/**
+ *
+ *  Checksum of an image, which identifies the image of a reference
+ *
+ */
+unsigned long long reference_checksum(
+  const double *I, //image
+  int size         //number of values of the image
+)
+{
+  //FNV-1a hash of the bytes of the image
+  const unsigned char *b=(const unsigned char *)I;
+  unsigned long long h=14695981039346656037ULL;
+  for(size_t i=0; i<size*sizeof(double); i++)
+  {
+    h^=b[i];
+    h*=1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+ *
+ *  Save the reference to a binary file, which can be loaded by later
+ *  runs instead of building the reference again
+ *
+ */
+bool reference_save(
+  const IcaReference &ref, //reference
+  const char *name         //name of the file
+)
+{
+  //the file is written with another name and then renamed, so that the
+  //runs that have mapped a previous version are not affected
+  char tmpname[FILENAME_MAX];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  FILE *fd=fopen(tmpname, "wb");
+  if(fd==NULL) return false;
+
+  ReferenceHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, REFERENCE_MAGIC, sizeof(h.magic));
+  h.version=REFERENCE_VERSION;
+  h.value_size=sizeof(double);
+  h.nparams=ref.nparams;
+  h.nscales=ref.nscales;
+  h.matrix_free=ref.matrix_free;
+  h.npoints=ref.npoints;
+  h.nu=ref.nu;
+  h.checksum=ref.checksum;
+
+  //place the data of each scale after the table of the scales
+  ReferenceScale *table=new ReferenceScale[ref.nscales];
+  memset(table, 0, ref.nscales*sizeof(ReferenceScale));
+  long long offset=sizeof(h)+ref.nscales*sizeof(ReferenceScale);
+  for(int s=0; s<ref.nscales; s++)
+  {
+    const IcaTemplate &t=ref.scales[s];
+    ReferenceScale &e=table[s];
+    int N=t.pts.N;
+
+    e.nx=ref.nx[s];
+    e.ny=ref.ny[s];
+    e.npixels=N;
+    e.sd_size=(t.DIJ==NULL)?0:ref.nparams*sd_stride(N);
+    memcpy(e.H_1, t.H_1, sizeof(e.H_1));
+
+    e.I1 =align_offset(offset);
+    e.Ix =align_offset(e.I1+N*sizeof(double));
+    e.Iy =align_offset(e.Ix+N*sizeof(double));
+    e.x  =align_offset(e.Iy+N*sizeof(double));
+    e.y  =align_offset(e.x+N*sizeof(double));
+    e.DIJ=align_offset(e.y+N*sizeof(double));
+    offset=e.DIJ+e.sd_size*sizeof(double);
+  }
+
+  bool correct=
+    fwrite(&h, sizeof(h), 1, fd)==1 &&
+    fwrite(table, sizeof(ReferenceScale), ref.nscales, fd)==
+      (size_t)ref.nscales;
+
+  for(int s=0; s<ref.nscales && correct; s++)
+  {
+    const IcaTemplate &t=ref.scales[s];
+    const ReferenceScale &e=table[s];
+    size_t size=e.npixels*sizeof(double);
+
+    correct=
+      write_block(fd, e.I1, t.pts.I1, size) &&
+      write_block(fd, e.Ix, t.pts.Ix, size) &&
+      write_block(fd, e.Iy, t.pts.Iy, size) &&
+      write_block(fd, e.x, t.pts.x, size) &&
+      write_block(fd, e.y, t.pts.y, size) &&
+      write_block(fd, e.DIJ, t.DIJ, e.sd_size*sizeof(double));
+  }
+
+  delete []table;
+
+  if(fclose(fd)!=0) correct=false;
+  if(correct) correct=(rename(tmpname, name)==0);
+  if(!correct) remove(tmpname);
+
+  return correct;
+}
+
+
+/**
+ *
+ *  Load a reference saved with reference_save by mapping the file in
+ *  memory. It fails if the file does not exist, if it has another
+ *  format or version, or if it was not built from the given image
+ *
+ */
+bool reference_load(
+  IcaReference &ref, //output reference
+  const char *name,  //name of the file
+  const double *I1,  //image that the reference must be built from
+  int size           //number of values of the image
+)
+{
+  reference_free(ref);
+
+  int fd=open(name, O_RDONLY);
+  if(fd<0) return false;
+
+  //the mapping is kept after closing the file
+  struct stat st;
+  void *map=MAP_FAILED;
+  size_t length=0;
+  if(fstat(fd, &st)==0 && st.st_size>=(off_t)sizeof(ReferenceHeader))
+  {
+    length=st.st_size;
+    map=mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if(map==MAP_FAILED) return false;
+
+  const char *data=(const char *)map;
+  const ReferenceHeader *h=(const ReferenceHeader *)data;
+  const ReferenceScale *table=
+    (const ReferenceScale *)(data+sizeof(ReferenceHeader));
+
+  bool correct=
+    memcmp(h->magic, REFERENCE_MAGIC, sizeof(h->magic))==0 &&
+    h->version==REFERENCE_VERSION && h->value_size==sizeof(double) &&
+    h->nparams>0 && h->nparams<=MAX_NPARAMS && h->nscales>0 &&
+    (h->nscales==1 || (h->nu>0 && h->nu<1)) &&
+    sizeof(ReferenceHeader)+h->nscales*sizeof(ReferenceScale)<=length &&
+    table[0].nx*table[0].ny==size &&
+    h->checksum==reference_checksum(I1, size);
+
+  //the scales must be those of the pyramid of the image, with whole
+  //patches and the data of the options of the file, inside of the file
+  int nxs=0, nys=0;
+  for(int s=0; correct && s<h->nscales; s++)
+  {
+    const ReferenceScale &e=table[s];
+    if(s==0)
+    {
+      nxs=e.nx;
+      nys=e.ny;
+    }
+    else zoom_size(nxs, nys, nxs, nys, h->nu);
+
+    long long sd_size=
+      h->matrix_free?0:(long long)h->nparams*sd_stride(e.npixels);
+
+    long long bytes=(long long)e.npixels*sizeof(double);
+    correct=
+      e.nx>0 && e.ny>0 && e.nx==nxs && e.ny==nys &&
+      e.npixels>=0 && e.npixels<=e.nx*e.ny &&
+      e.npixels%(PATCH_SIZE*PATCH_SIZE)==0 && e.sd_size==sd_size &&
+      valid_block(e.I1, bytes, length) &&
+      valid_block(e.Ix, bytes, length) &&
+      valid_block(e.Iy, bytes, length) &&
+      valid_block(e.x, bytes, length) &&
+      valid_block(e.y, bytes, length) &&
+      valid_block(e.DIJ, (long long)e.sd_size*sizeof(double), length);
+  }
+
+  if(!correct)
+  {
+    munmap(map, length);
+    return false;
+  }
+
+  ref.nparams=h->nparams;
+  ref.nscales=h->nscales;
+  ref.nu=h->nu;
+  ref.matrix_free=h->matrix_free;
+  ref.npoints=h->npoints;
+  ref.checksum=h->checksum;
+  ref.nx=new int[ref.nscales];
+  ref.ny=new int[ref.nscales];
+  ref.scales=new IcaTemplate[ref.nscales];
+  ref.map=map;
+  ref.map_size=length;
+
+  //the pixels point to the mapped file, which is only read
+  for(int s=0; s<ref.nscales; s++)
+  {
+    const ReferenceScale &e=table[s];
+    IcaTemplate &t=ref.scales[s];
+
+    ref.nx[s]=e.nx;
+    ref.ny[s]=e.ny;
+    t.pts.N=e.npixels;
+    t.pts.I1=(double *)(data+e.I1);
+    t.pts.Ix=(double *)(data+e.Ix);
+    t.pts.Iy=(double *)(data+e.Iy);
+    t.pts.x=(double *)(data+e.x);
+    t.pts.y=(double *)(data+e.y);
+    t.DIJ=(e.sd_size==0)?NULL:(double *)(data+e.DIJ);
+    memcpy(t.H_1, e.H_1, sizeof(t.H_1));
+  }
+
+  return true;
+}
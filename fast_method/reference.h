@@ -0,0 +1,124 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stddef.h>
+
+#include "transformation.h"
+#include "workspace.h"
+
+//format of the files of the references (see reference_save)
+#define REFERENCE_MAGIC "ICA-FAST" //first eight bytes of the files
+#define REFERENCE_VERSION 1        //changed when the layout changes
+
+/**
+  *
+  *  Data of the first image at one scale, which does not depend on the
+  *  second image: the pixels of the patches of the selected points, their
+  *  steepest descent images and the inverse Hessian of the quadratic
+  *  version
+  *
+**/
+struct IcaTemplate
+{
+  PatchPixels pts; //pixels of the patches
+  double *DIJ;     //steepest descent images, NULL in the matrix-free mode
+  double H_1[MAX_NPARAMS*MAX_NPARAMS]; //inverse Hessian of the quadratic
+                                       //version
+};
+
+
+/**
+  *
+  *  Data of a reference image at each scale, computed once to align many
+  *  images to it. The estimation only uses the pixels of the patches, so
+  *  the pyramid of the image is not kept. It is only read by the
+  *  estimation, so that several images can be aligned in parallel with
+  *  the same reference. The options that it is built with must be those
+  *  of the estimation, otherwise it is not used. A reference saved to a
+  *  file is mapped in memory when it is loaded, instead of being copied
+  *
+**/
+struct IcaReference
+{
+  int nparams;    //number of parameters of the transform
+  int nscales;    //number of scales
+  double nu;      //downsampling factor
+  bool matrix_free; //the steepest descent images are not stored
+  int npoints;    //number of points at each scale, 0 for automatic
+  unsigned long long checksum; //checksum of the image it is built from
+
+  int *nx;        //number of columns at each scale
+  int *ny;        //number of rows at each scale
+  IcaTemplate *scales; //data of the image at each scale
+
+  void *map;      //file mapped in memory, or NULL if the data is allocated
+  size_t map_size; //size of the mapped file
+};
+
+
+/**
+ *
+ *  Initialize an empty reference, without allocating memory
+ *
+ */
+void reference_init(
+  IcaReference &ref //reference
+);
+
+
+/**
+ *
+ *  Release the memory of the reference
+ *
+ */
+void reference_free(
+  IcaReference &ref //reference
+);
+
+
+/**
+ *
+ *  Checksum of an image, which identifies the image of a reference
+ *
+ */
+unsigned long long reference_checksum(
+  const double *I, //image
+  int size         //number of values of the image
+);
+
+
+/**
+ *
+ *  Save the reference to a binary file, which can be loaded by later
+ *  runs instead of building the reference again
+ *
+ */
+bool reference_save(
+  const IcaReference &ref, //reference
+  const char *name         //name of the file
+);
+
+
+/**
+ *
+ *  Load a reference saved with reference_save by mapping the file in
+ *  memory. It fails if the file does not exist, if it has another
+ *  format or version, or if it was not built from the given image
+ *
+ */
+bool reference_load(
+  IcaReference &ref, //output reference
+  const char *name,  //name of the file
+  const double *I1,  //image that the reference must be built from
+  int size           //number of values of the image
+);
+
+#endif
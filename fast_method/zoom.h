@@ -27,16 +27,20 @@ void zoom_size
 
 /**
   *
-  * Function to downsample the image
+  * Function to downsample the two images, which are processed in the same
+  * parallel loops, or only the first one if the second is NULL
   *
 **/
 void zoom_out
 (
-  double *I,    //input image
-  double *Iout, //output image
-  int nx,       //image width
-  int ny,       //image height             
-  double factor = 0.5 //zoom factor between 0 and 1
+  double *I1,    //first input image
+  double *I2,    //second input image, or NULL
+  double *I1out, //first output image
+  double *I2out, //second output image, or NULL
+  int nx,        //image width
+  int ny,        //image height             
+  double factor = 0.5,  //zoom factor between 0 and 1
+  double *buffer = NULL //2*nx*ny values for the smoothed images, or NULL
 );
 
 /**
@@ -55,4 +59,21 @@ void zoom_in_parameters
   int nyy       //height of the zoomed image
 );
 
+/**
+  *
+  * Function to downsample the parameters of the transformation, the
+  * inverse of zoom_in_parameters
+  *
+**/
+void zoom_out_parameters 
+(
+  double *p,    //input parameters
+  double *pout, //output parameters
+  int nparams,  //number of parameters
+  int nx,       //width of the original image
+  int ny,       //height of the original image
+  int nxx,      //width of the zoomed image
+  int nyy       //height of the zoomed image
+);
+
 #endif
@@ -0,0 +1,430 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+#include <new>
+#include <vector>
+
+#include "bicubic_interpolation.h"
+#include "inverse_compositional_algorithm.h"
+#include "transformation.h"
+#include "mask.h"
+#include "padded_image.h"
+#include "steepest_descent.h"
+#include "workspace.h"
+#include "file.h"
+
+#define PAR_DEFAULT_TYPE 8
+#define PAR_DEFAULT_ROBUST 3
+#define PAR_DEFAULT_ITER 20
+#define BENCH_LAMBDA 5
+#define BENCH_NSCALES 5
+#define BENCH_NU 0.5
+#define BENCH_TOL 0.001
+#define BENCH_NSUBSETS 5
+#define BENCH_NBATCHES 3
+
+
+//number of calls to the global operator new, which counts the memory
+//allocated by the containers and by the methods, besides the workspace;
+//the operators are not inlined, so that the compiler does not pair the
+//calls to malloc and free with the new and delete expressions
+static long heap_allocations=0;
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+  #pragma omp atomic
+  heap_allocations++;
+
+  void *p=malloc(size?size:1);
+  if(p==NULL) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  operator delete(p);
+}
+
+
+/**
+ *
+ *  Estimated memory traffic of one robust iteration with separate passes:
+ *  warp (read I2, write Iw), difference (read I1 and Iw, write DI), robust
+ *  function (read DI, write rho), independent vector (one pass over DIJ,
+ *  DI and rho per parameter) and Hessian (one pass over DIJ and rho)
+ *
+ */
+double bytes_separate_passes(int N, int nparams)
+{
+  double s=sizeof(double);
+  double warp=2*N*s;
+  double diff=3*N*s;
+  double rob =2*N*s;
+  double b   =nparams*(N*nparams+2.0*N)*s;
+  double H   =(N*nparams+1.0*N)*s;
+  return warp+diff+rob+b+H;
+}
+
+
+/**
+ *
+ *  Estimated memory traffic of one robust iteration with the fused kernel:
+ *  I2, I1 and DIJ are read once and nothing is written
+ *
+ */
+double bytes_fused(int N, int nparams)
+{
+  double s=sizeof(double);
+  return (2.0*N+1.0*N*nparams)*s;
+}
+
+
+/**
+ *
+ *  Estimated memory traffic of one robust iteration with the matrix-free
+ *  kernel: I2, I1 and the gradient are read once
+ *
+ */
+double bytes_matrix_free(int N)
+{
+  double s=sizeof(double);
+  return 4.0*N*s;
+}
+
+
+/**
+ *
+ *  Largest distance between the corners of the image transformed with the
+ *  estimated and the true transforms, which may be of different types
+ *
+ */
+double corner_error(
+  double *p,   //estimated transform
+  int np,      //number of parameters of the estimated transform
+  double *g,   //true transform
+  int ng,      //number of parameters of the true transform
+  int nx,      //number of columns of the image
+  int ny       //number of rows of the image
+)
+{
+  double error=0;
+  for(int c=0; c<4; c++)
+  {
+    double x0, y0, x1, y1;
+    project((c%2)*(nx-1), (c/2)*(ny-1), g, x0, y0, ng);
+    project((c%2)*(nx-1), (c/2)*(ny-1), p, x1, y1, np);
+    error=fmax(error, hypot(x1-x0, y1-y0));
+  }
+  return error;
+}
+
+
+/**
+ *
+ *  Benchmark of the robust iteration:
+ *  compares the time and the memory traffic of the separate passes
+ *  with the fused warp/residual/accumulate kernel, using stored or
+ *  matrix-free steepest descent images. It also checks that the whole
+ *  estimation does not allocate memory when the workspace is reused,
+ *  counting both the buffers of the workspace and the calls to the global
+ *  operator new, which include the containers and the scratch memory, and
+ *  measures the throughput of the robust weights, evaluated per pixel
+ *  with rhop or in a batch with the policy of each robust function. The
+ *  Hessian of the truncated quadratic is also updated incrementally, with
+ *  a threshold that alternates between two values so that the pixels in
+ *  between enter and leave the set of inliers, and compared with the
+ *  Hessian built from scratch. Finally, the estimation is repeated with
+ *  subsets of the pixels and in the stochastic mode, reporting the time
+ *  per call and the distance from the corners of the image transformed
+ *  with the estimation to those transformed with the true transform
+ *
+ */
+int main(int argc, char *argv[])
+{
+  if(argc<4)
+  {
+    printf(
+      "\n<Usage>: %s image1 image2 transform [type] [robust] [iterations]"
+      "\n\n", argv[0]
+    );
+    return EXIT_FAILURE;
+  }
+
+  int nparams=(argc>4)?atoi(argv[4]):PAR_DEFAULT_TYPE;
+  int robust =(argc>5)?atoi(argv[5]):PAR_DEFAULT_ROBUST;
+  int niter  =(argc>6)?atoi(argv[6]):PAR_DEFAULT_ITER;
+  if(nparams!=2 && nparams!=3 && nparams!=4 &&
+     nparams!=6 && nparams!=8) nparams=PAR_DEFAULT_TYPE;
+  if(robust<1||robust>CHARBONNIER_FAST) robust=PAR_DEFAULT_ROBUST;
+  if(niter<1) niter=PAR_DEFAULT_ITER;
+
+  int nx, ny, nz, nx1, ny1, nz1;
+  double *I1, *I2;
+
+  bool correct1=read_image(argv[1], &I1, nx, ny, nz);
+  bool correct2=read_image(argv[2], &I2, nx1, ny1, nz1);
+  if(!correct1 || !correct2 || nx!=nx1 || ny!=ny1 || nz!=nz1)
+  {
+    printf("Cannot read the images or their sizes are not the same\n");
+    return EXIT_FAILURE;
+  }
+
+  //true transform between the images, to measure the error of the modes
+  int ng=0;
+  double *g;
+  read(argv[3], &g, ng);
+  if(g==NULL || (ng!=2 && ng!=3 && ng!=4 && ng!=6 && ng!=8))
+  {
+    printf("Cannot read the true transform\n");
+    return EXIT_FAILURE;
+  }
+
+  //use the first channel of the images
+  int N=nx*ny;
+  double *I1g=new double[N];
+  double *I2g=new double[N];
+  for(int i=0; i<N; i++)
+  {
+    I1g[i]=I1[i*nz];
+    I2g[i]=I2[i*nz];
+  }
+
+  //the gradient and the warps read the images with a replicated border
+  double *B1=new double[padded_size(nx, ny)];
+  double *B2=new double[padded_size(nx, ny)];
+  double *I1p=pad_image(I1g, B1, nx, ny);
+  double *I2p=pad_image(I2g, B2, nx, ny);
+
+  double *Ix =new double[N];
+  double *Iy =new double[N];
+  double *DIJ=sd_allocate(nparams, N);
+  double *Iw =new double[N];
+  double *DI =new double[N];
+  double *rho=new double[N];
+  double *rho0=new double[N];
+  double b1[MAX_NPARAMS], H1[MAX_NPARAMS*MAX_NPARAMS];
+  double b2[MAX_NPARAMS], H2[MAX_NPARAMS*MAX_NPARAMS];
+  double b3[MAX_NPARAMS], H3[MAX_NPARAMS*MAX_NPARAMS];
+  double p[MAX_NPARAMS]={0};
+  int nthreads;
+  double *partials=sd_partials_allocate(nthreads);
+  std::vector<int> all; //empty: all the pixels are used
+
+  //template precomputation
+  gradient(I1p, Ix, Iy, nx, ny);
+  steepest_descent_images(Ix, Iy, DIJ, nparams, all, nx, ny);
+
+  //separate passes
+  double t0=omp_get_wtime();
+  for(int n=0; n<niter; n++)
+  {
+    bicubic_interpolation(I2p, Iw, p, nparams, nx, ny);
+    difference_image(I1g, Iw, DI, nx, ny);
+    robust_error_function(DI, rho, BENCH_LAMBDA, robust, nx, ny);
+    independent_vector(DIJ, DI, rho, b1, nparams, nx, ny);
+    hessian(DIJ, rho, H1, nparams, nx, ny);
+  }
+  double t1=(omp_get_wtime()-t0)/niter;
+
+  //fused kernel
+  t0=omp_get_wtime();
+  for(int n=0; n<niter; n++)
+    robust_accumulate(
+      I1g, I2p, all, DIJ, Ix, Iy, p, b2, H2, BENCH_LAMBDA, robust,
+      partials, nthreads, nparams, nx, ny
+    );
+  double t2=(omp_get_wtime()-t0)/niter;
+
+  //fused kernel with matrix-free steepest descent images
+  t0=omp_get_wtime();
+  for(int n=0; n<niter; n++)
+    robust_accumulate(
+      I1g, I2p, all, NULL, Ix, Iy, p, b3, H3, BENCH_LAMBDA, robust,
+      partials, nthreads, nparams, nx, ny
+    );
+  double t3=(omp_get_wtime()-t0)/niter;
+
+  //check that both versions give the same result
+  double error=0;
+  for(int i=0; i<nparams; i++)
+  {
+    error=fmax(error, fabs(b1[i]-b2[i])/(fabs(b1[i])+1E-10));
+    error=fmax(error, fabs(b1[i]-b3[i])/(fabs(b1[i])+1E-10));
+  }
+  for(int i=0; i<nparams*nparams; i++)
+  {
+    error=fmax(error, fabs(H1[i]-H2[i])/(fabs(H1[i])+1E-10));
+    error=fmax(error, fabs(H1[i]-H3[i])/(fabs(H1[i])+1E-10));
+  }
+
+  //second estimation with the same workspace: the buffers are reused
+  IcaWorkspace ws;
+  workspace_init(ws);
+  double q[MAX_NPARAMS], t4=0;
+  long allocations=0, heap=0;
+  for(int n=0; n<2; n++)
+  {
+    t0=omp_get_wtime();
+    allocations=workspace_allocations();
+    heap=heap_allocations;
+    pyramidal_inverse_compositional_algorithm(
+      I1g, I2g, q, nparams, nx, ny, BENCH_NSCALES, BENCH_NU, BENCH_TOL,
+      robust, BENCH_LAMBDA, false, 0, 0, 1, 0, false, &ws
+    );
+    allocations=workspace_allocations()-allocations;
+    heap=heap_allocations-heap;
+    t4=omp_get_wtime()-t0;
+  }
+
+  //estimation with subsets of the pixels, with the same workspace
+  const double subsets[BENCH_NSUBSETS]={1, 0.5, 0.25, 0.1, 0.05};
+  double t7[BENCH_NSUBSETS], error3[BENCH_NSUBSETS];
+  for(int k=0; k<BENCH_NSUBSETS; k++)
+  {
+    t0=omp_get_wtime();
+    pyramidal_inverse_compositional_algorithm(
+      I1g, I2g, q, nparams, nx, ny, BENCH_NSCALES, BENCH_NU, BENCH_TOL,
+      robust, BENCH_LAMBDA, false, 0, 0, subsets[k], 0, false, &ws
+    );
+    t7[k]=omp_get_wtime()-t0;
+    error3[k]=corner_error(q, nparams, g, ng, nx, ny);
+  }
+
+  //estimation in the stochastic mode, with the same workspace
+  const double batches[BENCH_NBATCHES]={0.01, 0.05, 0.2};
+  double t8[BENCH_NBATCHES], error4[BENCH_NBATCHES];
+  for(int k=0; k<BENCH_NBATCHES; k++)
+  {
+    t0=omp_get_wtime();
+    pyramidal_inverse_compositional_algorithm(
+      I1g, I2g, q, nparams, nx, ny, BENCH_NSCALES, BENCH_NU, BENCH_TOL,
+      robust, BENCH_LAMBDA, false, 0, 0, 1, batches[k], false, &ws
+    );
+    t8[k]=omp_get_wtime()-t0;
+    error4[k]=corner_error(q, nparams, g, ng, nx, ny);
+  }
+  workspace_free(ws);
+
+  //Hessian of the truncated quadratic built from scratch in every iteration
+  double b4[MAX_NPARAMS], H4[MAX_NPARAMS*MAX_NPARAMS];
+  double b5[MAX_NPARAMS], H5[MAX_NPARAMS*MAX_NPARAMS];
+  double lambda_n=BENCH_LAMBDA;
+  t0=omp_get_wtime();
+  for(int n=0; n<niter; n++)
+  {
+    lambda_n=(n%2)?BENCH_LAMBDA:BENCH_LAMBDA*LAMBDA_RATIO;
+    robust_accumulate(
+      I1g, I2p, all, DIJ, Ix, Iy, p, b4, H4, lambda_n, TRUNCATED_QUADRATIC,
+      partials, nthreads, nparams, nx, ny
+    );
+  }
+  double t5=(omp_get_wtime()-t0)/niter;
+
+  //Hessian updated with the pixels that flip
+  robust_update(
+    I1g, I2p, all, DIJ, Ix, Iy, p, b5, H5, rho0, BENCH_LAMBDA,
+    TRUNCATED_QUADRATIC, true, partials, nthreads, nparams, nx, ny
+  );
+  t0=omp_get_wtime();
+  for(int n=0; n<niter; n++)
+  {
+    lambda_n=(n%2)?BENCH_LAMBDA:BENCH_LAMBDA*LAMBDA_RATIO;
+    robust_update(
+      I1g, I2p, all, DIJ, Ix, Iy, p, b5, H5, rho0, lambda_n,
+      TRUNCATED_QUADRATIC, false, partials, nthreads, nparams, nx, ny
+    );
+  }
+  double t6=(omp_get_wtime()-t0)/niter;
+
+  double error2=0;
+  for(int i=0; i<nparams; i++)
+    error2=fmax(error2, fabs(b4[i]-b5[i])/(fabs(b4[i])+1E-10));
+  for(int i=0; i<nparams*nparams; i++)
+    error2=fmax(error2, fabs(H4[i]-H5[i])/(fabs(H4[i])+1E-10));
+
+  //throughput of the robust weights with the differences of the image
+  double rate1[CHARBONNIER_FAST+1], rate2[CHARBONNIER_FAST+1];
+  for(int r=TRUNCATED_QUADRATIC; r<=CHARBONNIER_FAST; r++)
+  {
+    t0=omp_get_wtime();
+    for(int n=0; n<niter; n++)
+      for(int i=0; i<N; i++)
+        rho[i]=rhop(DI[i]*DI[i], BENCH_LAMBDA, r);
+    rate1[r]=(double)N*niter/(omp_get_wtime()-t0);
+
+    t0=omp_get_wtime();
+    for(int n=0; n<niter; n++)
+      robust_error_function(DI, rho, BENCH_LAMBDA, r, nx, ny);
+    rate2[r]=(double)N*niter/(omp_get_wtime()-t0);
+  }
+
+  double MB=1024.*1024.;
+  printf("Image %dx%d, transform type=%d, robust function=%d\n",
+         nx, ny, nparams, robust);
+  printf("Separate passes: %9.3f ms/iter, %9.2f MB/iter\n",
+         1000*t1, bytes_separate_passes(N, nparams)/MB);
+  printf("Fused kernel:    %9.3f ms/iter, %9.2f MB/iter\n",
+         1000*t2, bytes_fused(N, nparams)/MB);
+  printf("Matrix-free:     %9.3f ms/iter, %9.2f MB/iter\n",
+         1000*t3, bytes_matrix_free(N)/MB);
+  printf("Maximum relative difference: %g\n", error);
+  printf("Reused workspace: %9.3f ms/call, %ld workspace buffers, "
+         "%ld calls to operator new\n", 1000*t4, allocations, heap);
+  printf("Truncated quadratic, full Hessian:        %9.3f ms/iter\n", 1000*t5);
+  printf("Truncated quadratic, incremental Hessian: %9.3f ms/iter\n", 1000*t6);
+  printf("Maximum relative difference: %g\n", error2);
+  printf("Subset of pixels: ms/call, corner error (pixels)\n");
+  for(int k=0; k<BENCH_NSUBSETS; k++)
+    printf("  %5.2f:      %9.3f, %9.4f\n", subsets[k], 1000*t7[k], error3[k]);
+  printf("Stochastic mode: ms/call, corner error (pixels)\n");
+  for(int k=0; k<BENCH_NBATCHES; k++)
+    printf("  %5.2f:      %9.3f, %9.4f\n", batches[k], 1000*t8[k], error4[k]);
+  //instruction set of the batched Charbonnier weights in this build
+#if defined(__AVX__)
+  const char *simd="AVX";
+#elif defined(__SSE2__)
+  const char *simd="SSE2";
+#else
+  const char *simd="scalar";
+#endif
+  printf("Robust weights (Mweights/s, %s): per pixel, batched\n", simd);
+  for(int r=TRUNCATED_QUADRATIC; r<=CHARBONNIER_FAST; r++)
+    printf("  function %d:    %9.1f, %9.1f\n", r, rate1[r]/1E6, rate2[r]/1E6);
+
+  free(I1);
+  free(I2);
+  delete []I1g;
+  delete []I2g;
+  delete []g;
+  delete []B1;
+  delete []B2;
+  delete []Ix;
+  delete []Iy;
+  sd_free(DIJ);
+  sd_free(partials);
+  delete []Iw;
+  delete []DI;
+  delete []rho;
+  delete []rho0;
+
+  return EXIT_SUCCESS;
+}
@@ -8,30 +8,15 @@
 // All rights reserved.
 
 
+#include <math.h>
+
 #include "bicubic_interpolation.h"
+#include "padded_image.h"
 #include "transformation.h"
 
-/**
-  *
-  * Neumann boundary condition test
-  *
-**/
-int
-neumann_bc (int x, int nx, bool & out)
-{
-  if (x<0)
-    {
-      if(x < -2) out = true;
-      x = 0;
-    }
-  else if (x >= nx)
-    {
-      if(x > nx+1) out = true;
-      x = nx - 1;
-    }
-  return x;
-}
-
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 /**
   *
@@ -72,13 +57,64 @@ bicubic_interpolation(
 
 /**
   *
-  * Compute the bicubic interpolation of a point in an image. 
+  * Bicubic interpolation of a point whose 4x4 taps are inside the padded
+  * image, from the integer part of its coordinates
+  *
+**/
+static inline double bicubic_taps(
+  double *input, //padded image to be interpolated
+  double uu,     //x coordinate of the point
+  double vv,     //y coordinate of the point
+  int x,         //integer part of uu
+  int y,         //integer part of vv
+  int w          //width of the rows of the padded image
+)
+{
+  //obtain the interpolation points of the image
+  double *r=&(input[(y-1)*w+x-1]);
+  double pol[4][4] = { 
+    {r[0], r[w], r[2*w], r[3*w]}, {r[1], r[w+1], r[2*w+1], r[3*w+1]},
+    {r[2], r[w+2], r[2*w+2], r[3*w+2]}, {r[3], r[w+3], r[2*w+3], r[3*w+3]}
+  };
+
+  //return interpolation
+  return bicubic_interpolation (pol, uu - x, vv - y);
+}
+
+
+/**
+  *
+  * Check if a point is inside the image or less than one pixel away from
+  * it, so that its taps are inside the guard band. Otherwise, the point is
+  * moved to the nearest point of the border, unless it is put to zero
+  *
+**/
+static inline bool bicubic_inside(
+  double &uu,     //x coordinate of the point
+  double &vv,     //y coordinate of the point
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  if(uu>=-1 && vv>=-1 && uu<nx && vv<ny) return true;
+  if(border_out) return false;
+
+  uu=(uu<-1)?-1:(uu>nx-1)?nx-1:uu;
+  vv=(vv<-1)?-1:(vv>ny-1)?ny-1:vv;
+  return true;
+}
+
+
+/**
+  *
+  * Compute the bicubic interpolation of a point in a padded image. 
   * Detects if the point goes outside the image domain
   *
 **/
 double
 bicubic_interpolation(
-  double *input,//image to be interpolated
+  double *input,//padded image to be interpolated
   double uu,    //x component of the vector field
   double vv,    //y component of the vector field
   int nx,       //width of the image
@@ -86,66 +122,194 @@ bicubic_interpolation(
   bool border_out //if true, put zeros outside the region
 )
 {
-  int sx = (uu < 0) ? -1 : 1;
-  int sy = (vv < 0) ? -1 : 1;
-
-  int x, y, mx, my, dx, dy, ddx, ddy;
-  bool out = false;
-
-  x = neumann_bc ((int) uu, nx, out);
-  y = neumann_bc ((int) vv, ny, out);
-  mx = neumann_bc ((int) uu - sx, nx, out);
-  my = neumann_bc ((int) vv - sx, ny, out);
-  dx = neumann_bc ((int) uu + sx, nx, out);
-  dy = neumann_bc ((int) vv + sy, ny, out);
-  ddx = neumann_bc ((int) uu + 2 * sx, nx, out);
-  ddy = neumann_bc ((int) vv + 2 * sy, ny, out);
-
-  if (out && border_out) 
-    return 0;
-  else
+  if(!bicubic_inside(uu, vv, nx, ny, border_out)) return 0;
+
+  //the points of the first pixel of the band use the taps to the left
+  int x=(uu<0)?-1:(int) uu;
+  int y=(vv<0)?-1:(int) vv;
+  return bicubic_taps(input, uu, vv, x, y, nx+2*IMAGE_BORDER);
+}
+
+
+/**
+  *
+  * Weights of the four taps of the cubic interpolation, so that
+  * cubic_interpolation(v, x) is the sum of w[k]*v[k]
+  *
+**/
+static inline void cubic_weights(
+  double x,  //position with respect to the second tap
+  double *w  //output weights of the taps
+)
+{
+  double x2=x*x;
+  double x3=x2*x;
+  w[0]=0.5*(-x+2.0*x2-x3);
+  w[1]=1.0+0.5*(3.0*x3-5.0*x2);
+  w[2]=0.5*(x+4.0*x2-3.0*x3);
+  w[3]=0.5*(x3-x2);
+}
+
+
+#if defined(__AVX2__) && defined(__FMA__)
+/**
+  *
+  * Bicubic interpolation of a point whose 4x4 taps are inside the padded
+  * image, with AVX2. The separable weights are computed once and each row
+  * of four taps is read with a single load: the rows are combined with the
+  * weights in y and the result is reduced with the weights in x
+  *
+**/
+static inline double bicubic_interpolation_avx(
+  double *input, //padded image to be interpolated
+  double uu,     //x coordinate of the point
+  double vv,     //y coordinate of the point
+  int x,         //integer part of uu
+  int y,         //integer part of vv
+  int w          //width of the rows of the padded image
+)
+{
+  double wx[4], wy[4];
+  cubic_weights(uu-x, wx);
+  cubic_weights(vv-y, wy);
+
+  double *r=&(input[(y-1)*w+x-1]);
+  __m256d v=_mm256_mul_pd(_mm256_set1_pd(wy[0]), _mm256_loadu_pd(r));
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[1]), _mm256_loadu_pd(r+w), v);
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[2]), _mm256_loadu_pd(r+2*w), v);
+  v=_mm256_fmadd_pd(_mm256_set1_pd(wy[3]), _mm256_loadu_pd(r+3*w), v);
+  v=_mm256_mul_pd(v, _mm256_loadu_pd(wx));
+
+  __m128d h=_mm_add_pd(
+    _mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)
+  );
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+#endif
+
+
+/**
+  *
+  * Compute the bicubic interpolation of n points of a padded image. The
+  * taps of the points are read from the guard band near the border, so
+  * the same kernel is used for all the points. With AVX2, it is vectorised
+  *
+**/
+void bicubic_interpolation(
+  double *input,  //padded image to be interpolated
+  double *uu,     //x coordinates of the points
+  double *vv,     //y coordinates of the points
+  double *output, //output interpolated values
+  int n,          //number of points
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int w=nx+2*IMAGE_BORDER; //width of the rows of the padded image
+
+  for(int i=0; i<n; i++)
+  {
+    double u=uu[i], v=vv[i];
+    if(!bicubic_inside(u, v, nx, ny, border_out))
     {
-      //obtain the interpolation points of the image
-      double p11 = input[mx  + nx * my];
-      double p12 = input[x   + nx * my];
-      double p13 = input[dx  + nx * my];
-      double p14 = input[ddx + nx * my];
-
-      double p21 = input[mx  + nx * y];
-      double p22 = input[x   + nx * y];
-      double p23 = input[dx  + nx * y];
-      double p24 = input[ddx + nx * y];
-
-      double p31 = input[mx  + nx * dy];
-      double p32 = input[x   + nx * dy];
-      double p33 = input[dx  + nx * dy];
-      double p34 = input[ddx + nx * dy];
-
-      double p41 = input[mx  + nx * ddy];
-      double p42 = input[x   + nx * ddy];
-      double p43 = input[dx  + nx * ddy];
-      double p44 = input[ddx + nx * ddy];
-
-      //create array
-      double pol[4][4] = { 
-        {p11, p21, p31, p41}, {p12, p22, p32, p42},
-        {p13, p23, p33, p43}, {p14, p24, p34, p44}
-      };
-
-      //return interpolation
-      return bicubic_interpolation (pol, (double) uu - x, (double) vv - y);
+      output[i]=0;
+      continue;
     }
+
+    int x=(u<0)?-1:(int) u;
+    int y=(v<0)?-1:(int) v;
+#if defined(__AVX2__) && defined(__FMA__)
+    output[i]=bicubic_interpolation_avx(input, u, v, x, y, w);
+#else
+    output[i]=bicubic_taps(input, u, v, x, y, w);
+#endif
+  }
 }
 
 
+/**
+  *
+  * Compute the bicubic interpolation of a run of len pixels of row i,
+  * starting at column j, warped with a translation, in a padded image. The
+  * subpixel offset is the same for every pixel, so the pixels whose taps
+  * are inside the padded image are a 4x4 separable convolution with
+  * constant weights, done as a vertical and a horizontal pass; for integer
+  * translations, it is a copy
+  *
+**/
+void bicubic_interpolation_translation(
+  double *input,  //padded image to be warped
+  double *output, //output interpolated values of the run
+  double *params, //parameters of the translation
+  int i,          //row of the run
+  int j,          //first column of the run
+  int len,        //number of pixels of the run
+  int nx,         //width of the image
+  int ny,         //height of the image
+  bool border_out //if true, put zeros outside the region
+)
+{
+  int w=nx+2*IMAGE_BORDER; //width of the rows of the padded image
+  int dx=(int) floor(params[0]);
+  int dy=(int) floor(params[1]);
+  int y=i+dy;
+
+  //columns of the run whose taps are inside the padded image
+  int a=(-1-dx>j)?-1-dx:j;
+  int b=(nx-dx<j+len)?nx-dx:j+len;
+  if(y<-1 || y>ny-1 || a>b) a=b=j+len;
+
+  //pixels far from the image
+  for(int n=j; n<a; n++)
+    output[n-j]=border_out?0:bicubic_interpolation(
+      input, n+params[0], i+params[1], nx, ny, false
+    );
+  for(int n=b; n<j+len; n++)
+    output[n-j]=border_out?0:bicubic_interpolation(
+      input, n+params[0], i+params[1], nx, ny, false
+    );
+
+  double tx=params[0]-dx;
+  double ty=params[1]-dy;
+
+  if(tx==0 && ty==0)
+  {
+    //integer translation
+    for(int n=a; n<b; n++)
+      output[n-j]=input[y*w+n+dx];
+    return;
+  }
+
+  double wx[4], wy[4];
+  cubic_weights(tx, wx);
+  cubic_weights(ty, wy);
+
+  for(int c=a; c<b; c+=BICUBIC_BLOCK)
+  {
+    int m=(b-c<BICUBIC_BLOCK)?b-c:BICUBIC_BLOCK;
+    double v[BICUBIC_BLOCK+3];
+    double *r=&(input[(y-1)*w+c+dx-1]);
+
+    //vertical pass over the m+3 columns of taps
+    for(int k=0; k<m+3; k++)
+      v[k]=wy[0]*r[k]+wy[1]*r[k+w]+wy[2]*r[k+2*w]+wy[3]*r[k+3*w];
+
+    //horizontal pass
+    for(int k=0; k<m; k++)
+      output[c-j+k]=wx[0]*v[k]+wx[1]*v[k+1]+wx[2]*v[k+2]+wx[3]*v[k+3];
+  }
+}
+
 
 /**
   *
-  * Compute the bicubic interpolation of an image from a parametric trasform
+  * Compute the bicubic interpolation of a padded image from a parametric
+  * trasform
   *
 **/
 void bicubic_interpolation(
-  double *input,   //image to be warped
+  double *input,   //padded image to be warped
   double *output,  //warped output image with bicubic interpolation
   double *params,  //x component of the vector field
   int nparams,     //number of parameters of the transform
@@ -154,17 +318,31 @@ void bicubic_interpolation(
   bool border_out  //if true, put zeros outside the region
 )
 {
-  for (int i=0; i<ny; i++)
-    for (int j=0; j<nx; j++)
-    {
-      double x, y;
-
-      //transform coordinates using the parametric model
-      project(j, i, params, x, y, nparams);
-      
-      //obtain the bicubic interpolation at position (uu, vv)
-      output[i*nx+j]=bicubic_interpolation(
-	input, x, y, nx, ny, border_out
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM:
+      bicubic_interpolation<TRANSLATION_TRANSFORM>(
+        input, output, params, nx, ny, border_out
       );
-    }
+      break;
+    case EUCLIDEAN_TRANSFORM:
+      bicubic_interpolation<EUCLIDEAN_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case SIMILARITY_TRANSFORM:
+      bicubic_interpolation<SIMILARITY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case AFFINITY_TRANSFORM:
+      bicubic_interpolation<AFFINITY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+    case HOMOGRAPHY_TRANSFORM:
+      bicubic_interpolation<HOMOGRAPHY_TRANSFORM>(
+        input, output, params, nx, ny, border_out
+      );
+      break;
+  }
 }
@@ -25,16 +25,25 @@
   * 
 **/
 
+#include "reference.h"
+#include "workspace.h"
+
 #define QUADRATIC 0
 #define TRUNCATED_QUADRATIC 1
 #define GERMAN_MCCLURE 2
 #define LORENTZIAN 3
 #define CHARBONNIER 4
+#define CHARBONNIER_FAST 5
 
 #define MAX_ITER 30
 #define LAMBDA_0 80
 #define LAMBDA_N 5
 #define LAMBDA_RATIO 0.90
+#define SUBSET_MIN_PIXELS 1024
+#define BATCH_STALL 1.0
+#define ACTIVE_WEIGHT 0.01
+#define ACTIVE_MIN_DROP 0.05
+#define WARM_START_RANGE 2.0
 
 /**
  *
@@ -48,6 +57,176 @@ double rhop(
 );
  
 
+/**
+ *
+ *  Function to compute DI^t*J
+ *  from the gradient of the image and the analytic Jacobian
+ *  DIJ is stored as one plane per parameter (see steepest_descent.h)
+ *
+ */
+void steepest_descent_images
+(
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  double *DIJ, //output DI^t*J
+  int nparams, //number of parameters
+  const std::vector<int> &x, //selected pixels, empty if all are used
+  int nx,      //number of columns
+  int ny       //number of rows
+);
+
+
+/**
+ *
+ *  Function to compute the Hessian matrix with robust error functions
+ *  the Hessian is equal to rho'*DIJ^t*DIJ
+ *
+ */
+void hessian
+(
+  double *DIJ, //the steepest descent image
+  double *rho, //robust function
+  double *H,   //output Hessian matrix
+  int nparams, //number of parameters
+  int nx,      //number of columns
+  int ny       //number of rows
+);
+
+
+/**
+ *
+ *  Function to compute I2(W(x;p))-I1(x)
+ *
+ */
+void difference_image
+(
+  double *I,  //second warped image I2(x'(x;p))
+  double *Iw, //first image I1(x)
+  double *DI, //output difference array
+  int nx,     //number of columns
+  int ny      //number of rows
+);
+
+
+/**
+ *
+ *  Function to store the values of p'((I2(x'(x;p))-I1(x))²)
+ *
+ */
+void robust_error_function
+(
+  double *DI,   //input difference array
+  double *rho,  //output robust function
+  double lambda,//threshold used in the robust functions
+  int    type,  //choice of robust error function
+  int nx,       //number of columns
+  int ny        //number of rows
+);
+
+
+/**
+ *
+ *  Function to compute b=Sum(rho'*DIJ^t * DI)
+ *  with robust error functions
+ *
+ */
+void independent_vector
+(
+  double *DIJ, //the steepest descent image
+  double *DI,  //I2(x'(x;p))-I1(x) 
+  double *rho, //robust function
+  double *b,   //output independent vector
+  int nparams, //number of parameters
+  int nx,      //number of columns
+  int ny       //number of rows
+);
+
+
+/**
+ *
+ *  Function to compute b=Sum(DIJ^t * DI) and H=Sum(DIJ^t*DIJ) by tiles,
+ *  with stored or matrix-free steepest descent images. If DI is NULL, only
+ *  the Hessian is computed; if H is NULL, only the independent vector
+ *
+ */
+void quadratic_accumulate
+(
+  double *DIJ, //stored steepest descent images or NULL
+  double *Ix,  //x derivate of the image
+  double *Iy,  //y derivate of the image
+  const std::vector<int> &x, //selected pixels, empty if all are used
+  double *DI,  //I2(x'(x;p))-I1(x) 
+  double *b,   //output independent vector
+  double *H,   //output Hessian matrix
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams, //number of parameters
+  int nx,      //number of columns
+  int ny       //number of rows
+);
+
+
+/**
+ *
+ *  Function to compute b=Sum(rho'*DIJ^t * DI) and H=Sum(rho'*DIJ^t*DIJ) 
+ *  in a single pass: the pixels are warped by tiles, and the differences
+ *  and robust weights of each tile are accumulated while in cache, without
+ *  storing Iw, DI or rho for the whole image
+ *
+ */
+void robust_accumulate
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const std::vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //output Hessian matrix
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny         //number of rows
+);
+
+
+/**
+ *
+ *  Version of robust_accumulate that keeps the Hessian across iterations:
+ *  if rebuild is set, H is computed from scratch and its weights are
+ *  stored in rho0; otherwise, only b is computed with the new weights and
+ *  H is updated with the samples whose weights changed, for the truncated
+ *  quadratic, or kept as it is, for the smooth robust functions
+ *
+ */
+void robust_update
+(
+  double *I1,    //first image I1(x)
+  double *I2,    //second image, padded, to be warped with p
+  const std::vector<int> &x, //selected pixels, empty if all are used
+  double *DIJ,   //the steepest descent image, NULL if matrix-free
+  double *Ix,    //x derivate of the first image
+  double *Iy,    //y derivate of the first image
+  double *p,     //parameters of the transform
+  double *b,     //output independent vector
+  double *H,     //Hessian matrix, updated with the new weights
+  double *rho0,  //weights of the Hessian, updated with the new weights
+  double lambda, //threshold used in the robust functions
+  int    type,   //choice of robust error function
+  bool rebuild,  //compute the Hessian from scratch
+  double *partials, //partial sums of the threads
+  int nthreads,     //number of threads of the partial sums
+  int nparams,   //number of parameters
+  int nx,        //number of columns
+  int ny         //number of rows
+);
+
+
 /**
   *
   *  Inverse compositional algorithm
@@ -63,7 +242,11 @@ void inverse_compositional_algorithm(
   int nx,       //number of columns of the image
   int ny,       //number of rows of the image
   double TOL,   //Tolerance used for the convergence in the iterations
-  int verbose=0 //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  double subset=1, //fraction or number of pixels used, 1 for all
+  double batch=0,  //pixels drawn per iteration, 0 to use all of them
+  int verbose=0, //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 
@@ -83,12 +266,23 @@ void robust_inverse_compositional_algorithm(
   double TOL,    //Tolerance used for the convergence in the iterations
   int    robust, //robust error function
   double lambda, //parameter of robust error function
-  int verbose=0  //enable verbose mode
+  bool matrix_free=false, //compute the steepest descent images on the fly
+  int hessian_reuse=0, //iterations between rebuilds of the robust Hessian
+  int active_check=0,  //iterations between full checks of the outliers
+  double subset=1, //fraction or number of pixels used, 1 for all
+  double batch=0,  //pixels drawn per iteration, 0 to use all of them
+  int verbose=0,  //enable verbose mode
+  IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
 );
 
 /**
   *
-  *  Multiscale approach for computing the optical flow
+  *  Multiscale approach for computing the optical flow. It starts from
+  *  the initial transform, if it is given, down-projected to the coarsest
+  *  scale at which the residual motion is at most WARM_START_RANGE pixels,
+  *  so that the coarser scales are skipped. With a reference built from I1
+  *  with the same options (see reference_build), its pyramid and data are
+  *  used instead of those of I1, which are not computed
   *
 **/
 void pyramidal_inverse_compositional_algorithm(
@@ -103,7 +297,73 @@ void pyramidal_inverse_compositional_algorithm(
     double TOL,     //stopping criterion threshold
     int    robust,  //robust error function
     double lambda,  //parameter of robust error function
-    bool   verbose  //switch on messages
+    bool   matrix_free, //compute the steepest descent images on the fly
+    int    hessian_reuse, //iterations between rebuilds of the robust Hessian
+    int    active_check,  //iterations between full checks of the outliers
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL, //buffers reused across calls, or NULL
+    double *p0=NULL, //initial transform, or NULL to start from zero
+    double residual=-1, //motion left by p0, in pixels, or <0 if unknown
+    const IcaReference *ref=NULL //precomputed data of I1, or NULL
+);
+
+
+/**
+ *
+ *  Number of pixels used for a subset parameter: a fraction of the N
+ *  pixels, if it is in (0,1], or a number of pixels, if it is greater.
+ *  At least SUBSET_MIN_PIXELS pixels are used, if the image has them
+ *
+ */
+int subset_size(
+  double subset, //fraction or number of pixels
+  int N          //number of pixels of the image
+);
+
+
+/**
+  *
+  *  Build the pyramid of a reference image and its data at each scale,
+  *  for the options of the estimations that use it. The image is the
+  *  first scale of the reference and it must be kept while it is used.
+  *  The reference is initialized with reference_init and released with
+  *  reference_free
+  *
+**/
+void reference_build(
+    IcaReference &ref, //output reference
+    double *I1,     //reference image
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch,   //fraction or number of pixels drawn per iteration
+    bool   verbose, //switch on messages
+    IcaWorkspace *ws=NULL //buffers reused across calls, or NULL
+);
+
+
+/**
+  *
+  *  Check that a reference was built with the options of an estimation,
+  *  so that the estimation can use it
+  *
+**/
+bool reference_compatible(
+    const IcaReference &ref, //reference
+    int    nparams, //number of parameters
+    int    nxx,     //image width
+    int    nyy,     //image height
+    int    nscales, //number of scales
+    double nu,      //downsampling factor
+    bool   matrix_free, //compute the steepest descent images on the fly
+    double subset,  //fraction or number of pixels used at each scale
+    double batch    //fraction or number of pixels drawn per iteration
 );
 
 #endif
@@ -28,6 +28,9 @@ void AtA(double *A, double *B, int n, int m);
 //B should be initialized to zero outside
 void sAtA(double s, double *A, double *B, int n, int m);
 
+//Largest matrix inverted without heap allocations
+#define INVERSE_STACK_SIZE 8
+
 //Function to compute the inverse of a matrix
 //through Gaussian elimination
 int inverse(double *A, double *A_1, int N = 3);
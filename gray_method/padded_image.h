@@ -0,0 +1,50 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef PADDED_IMAGE_H
+#define PADDED_IMAGE_H
+
+/**
+  *
+  *  Images stored with a guard band of IMAGE_BORDER pixels around them,
+  *  which replicates the pixels of the border. The rows of a padded image
+  *  have nx+2*IMAGE_BORDER values and the pointer to the image is that of
+  *  its first pixel, so the pixels of the band are at negative positions
+  *  or beyond the last column and row. The bicubic interpolation reads
+  *  up to two pixels outside the image, so the band must be at least 2
+  *
+**/
+#define IMAGE_BORDER 2 //width of the replicated border of the images
+
+
+/**
+  *
+  *  Number of values of the buffer of a padded image
+  *
+**/
+int padded_size(
+  int nx, //width of the image
+  int ny  //height of the image
+);
+
+
+/**
+  *
+  *  Copy an image to a buffer of padded_size values and fill the guard
+  *  band with the pixels of its border. It returns the pointer to the
+  *  first pixel of the image in the buffer
+  *
+**/
+double *pad_image(
+  double *input,  //input image
+  double *buffer, //buffer of the padded image
+  int nx,         //width of the image
+  int ny          //height of the image
+);
+
+#endif
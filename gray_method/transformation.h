@@ -10,6 +10,8 @@
 #ifndef TRANSFORMATION_H
 #define TRANSFORMATION_H
 
+#include <math.h>
+
 //types of transformations
 #define TRANSLATION_TRANSFORM 2
 #define EUCLIDEAN_TRANSFORM   3
@@ -17,6 +19,9 @@
 #define AFFINITY_TRANSFORM    6
 #define HOMOGRAPHY_TRANSFORM  8
 
+//maximum number of parameters of a transform
+#define MAX_NPARAMS 8
+
 
 /**
  *
@@ -33,6 +38,24 @@ void jacobian
   int ny       //number of rows of the image
 );
 
+/**
+ *
+ *  Function to compute the steepest descent values DI^t*J at a point from
+ *  the gradient, using the analytic Jacobian of the transform, so that the
+ *  Jacobian matrix of the whole image does not need to be stored
+ *
+ */
+void point_steepest_descent
+(
+  double x,   //x component of the point
+  double y,   //y component of the point
+  double Ix,  //x derivate of the image at the point
+  double Iy,  //y derivate of the image at the point
+  double *D,  //output DI^t*J, nparams values
+  int stride, //distance between consecutive values in D
+  int nparams //number of parameters
+);
+
 /**
  *
  *  Function to update the current transform with the computed increment
@@ -75,4 +98,160 @@ void params2matrix
   int nparams     //number of parameters
 );
 
+
+/**
+ *
+ *  Function to compose two transforms, x'(x;p) = x'(x'(x;p1);p2), such as
+ *  the transforms between consecutive images of a sequence
+ *
+ */
+void compose_transform
+(
+  double *p1, //first transform
+  double *p2, //second transform, applied after the first one
+  double *p,  //output composition, which can be p1 or p2
+  int nparams //number of parameters
+);
+
+
+/**
+ *
+ *  Largest distance between the corners of an image transformed by two
+ *  transforms, which measures how much the transforms differ, in pixels
+ *
+ */
+double transform_distance
+(
+  double *p1,  //first transform
+  double *p2,  //second transform
+  int nparams, //number of parameters
+  int nx,      //number of columns of the image
+  int ny       //number of rows of the image
+);
+
+
+/**
+ *
+ *  Version of point_steepest_descent for a transform fixed at compile time,
+ *  used in the inner loops so that the switch is resolved by the compiler
+ *
+ */
+template<int nparams>
+inline void point_steepest_descent
+(
+  double x,   //x component of the point
+  double y,   //y component of the point
+  double Ix,  //x derivate of the image at the point
+  double Iy,  //y derivate of the image at the point
+  double *D,  //output DI^t*J, nparams values
+  int stride  //distance between consecutive values in D
+)
+{
+  switch(nparams) 
+  {
+    default: case TRANSLATION_TRANSFORM:  //p=(tx, ty) 
+      D[0]=Ix;
+      D[stride]=Iy;
+      break;
+    case EUCLIDEAN_TRANSFORM:  //p=(tx, ty, tita)
+      D[0]=Ix;
+      D[stride]=Iy;
+      D[2*stride]=Ix*(-y)+Iy*x;
+      break;
+    case SIMILARITY_TRANSFORM: //p=(tx, ty, a, b)
+      D[0]=Ix;
+      D[stride]=Iy;
+      D[2*stride]=Ix*x+Iy*y;
+      D[3*stride]=Ix*(-y)+Iy*x;
+      break;
+    case AFFINITY_TRANSFORM:  //p=(tx, ty, a00, a01, a10, a11)
+      D[0]=Ix;
+      D[stride]=Iy;
+      D[2*stride]=Ix*x;
+      D[3*stride]=Ix*y;
+      D[4*stride]=Iy*x;
+      D[5*stride]=Iy*y;
+      break;    
+    case HOMOGRAPHY_TRANSFORM: //p=(h00, h01,..., h21)
+      D[0]=Ix*x;
+      D[stride]=Ix*y;
+      D[2*stride]=Ix;
+      D[3*stride]=Iy*x;
+      D[4*stride]=Iy*y;
+      D[5*stride]=Iy;
+      D[6*stride]=Ix*(-x*x)+Iy*(-x*y);
+      D[7*stride]=Ix*(-x*y)+Iy*(-y*y);
+      break;
+  }
+}
+
+
+/**
+ *
+ *  Version of project for a transform fixed at compile time, used in the
+ *  inner loops so that the switch is resolved by the compiler
+ *
+ */
+template<int nparams>
+inline void project
+(
+  int x,      //x component of the 2D point
+  int y,      //y component of the 2D point
+  double *p,  //parameters of the transformation
+  double &xp, //x component of the transformed point
+  double &yp  //y component of the transformed point
+)
+{
+  switch(nparams) {
+    default: case TRANSLATION_TRANSFORM: //p=(tx, ty) 
+      xp=x+p[0];
+      yp=y+p[1];
+      break;
+    case EUCLIDEAN_TRANSFORM:   //p=(tx, ty, tita)
+      xp=cos(p[2])*x-sin(p[2])*y+p[0];
+      yp=sin(p[2])*x+cos(p[2])*y+p[1];
+      break;
+    case SIMILARITY_TRANSFORM:  //p=(tx, ty, a, b)
+      xp=(1+p[2])*x-p[3]*y+p[0];
+      yp=p[3]*x+(1+p[2])*y+p[1];
+      break;
+    case AFFINITY_TRANSFORM:    //p=(tx, ty, a00, a01, a10, a11)
+      xp=(1+p[2])*x+p[3]*y+p[0];
+      yp=p[4]*x+(1+p[5])*y+p[1];
+      break;
+    case HOMOGRAPHY_TRANSFORM:  //p=(h00, h01,..., h21)
+      double d=p[6]*x+p[7]*y+1;
+      xp=((1+p[0])*x+p[1]*y+p[2])/d;
+      yp=(p[3]*x+(1+p[4])*y+p[5])/d;
+      break;
+  }
+}
+
+/**
+ *
+ *  Function to transform a 2D point with the matrix of the transform
+ *  (see params2matrix). The matrix is built once for all the points, so
+ *  there are no trigonometric functions in the loops over the points
+ *
+ */
+template<int nparams>
+inline void project_matrix
+(
+  int x,      //x component of the 2D point
+  int y,      //y component of the 2D point
+  double *m,  //matrix of the transformation
+  double &xp, //x component of the transformed point
+  double &yp  //y component of the transformed point
+)
+{
+  xp=m[0]*x+m[1]*y+m[2];
+  yp=m[3]*x+m[4]*y+m[5];
+  if(nparams==HOMOGRAPHY_TRANSFORM)
+  {
+    double d=m[6]*x+m[7]*y+m[8];
+    xp/=d;
+    yp/=d;
+  }
+}
+
 #endif
@@ -0,0 +1,143 @@
+// This program is free software: you can use, modify and/or redistribute it
+// under the terms of the simplified BSD License. You should have received a
+// copy of this license along this program. If not, see
+// <http://www.opensource.org/licenses/bsd-license.html>.
+//
+// Copyright (C) 2015, Javier Sánchez Pérez <jsanchez@dis.ulpgc.es>
+// All rights reserved.
+
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <vector>
+
+/**
+  *
+  *  Buffers of the estimator, reused across scales and across calls.
+  *  The buffers are sized for the largest scale and only grow when a
+  *  larger image, more scales or more parameters are requested, so that
+  *  the iterations, and the whole estimation once the workspace is sized,
+  *  run without heap allocations
+  *
+**/
+struct IcaWorkspace
+{
+  int size;       //capacity of the image buffers
+  int sd_size;    //capacity of the steepest descent images
+  int nscales;    //capacity of the pyramid
+  int nthreads;   //number of stripes of the partial sums
+  int npixels;    //capacity of the selected pixels
+  int nsamples;   //capacity of the drawn pixels
+  int nactive;    //capacity of the active pixels
+  int padded;     //capacity of the padded image
+
+  double *Ix;     //x derivate of the first image
+  double *Iy;     //y derivate of the first image
+  double *Iw;     //warp of the second image
+  double *DI;     //error image
+  double *rho;    //robust weights of the last Hessian
+  double *DIJ;    //steepest descent images
+  double *Is;     //smoothed images used to build the pyramid, 2*size
+  double *Ip;     //copy of the image being differentiated or warped, with
+                  //a replicated border (see padded_image.h)
+  double *partials; //partial sums of the threads
+  std::vector<int> x; //selected pixels, empty if all are used
+  std::vector<int> xs;//pixels drawn in each iteration, in stochastic mode
+  std::vector<int> xa;//pixels that are not outliers, between full checks
+
+  double **I1s;   //pyramid of the first image
+  double **I2s;   //pyramid of the second image
+  double **ps;    //transform at each scale
+  int *nx;        //number of columns at each scale
+  int *ny;        //number of rows at each scale
+  int *scale_size;//capacity of each scale of the pyramid
+  int levels;     //number of scales built by the last call
+  int rolled;     //scales of the pyramid of the next first image in I1s
+};
+
+
+/**
+ *
+ *  Initialize an empty workspace, without allocating memory
+ *
+ */
+void workspace_init(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Make room for images of size values and for sd_size values of the
+ *  steepest descent images (zero in the matrix-free mode). If only a
+ *  subset of the pixels is used, it is called after reserving x, xs and xa
+ *
+ */
+void workspace_reserve(
+  IcaWorkspace &ws, //workspace
+  int size,         //number of values of the images
+  int sd_size       //number of values of the steepest descent images
+);
+
+
+/**
+ *
+ *  Make room for the copy of an image of nx x ny pixels with a replicated
+ *  border
+ *
+ */
+void workspace_reserve_padded(
+  IcaWorkspace &ws, //workspace
+  int nx,           //image width
+  int ny            //image height
+);
+
+
+/**
+ *
+ *  Make room for a pyramid of nscales scales, computing the size of each
+ *  scale. The first scale is not stored: it points to the input images
+ *
+ */
+void workspace_reserve_pyramid(
+  IcaWorkspace &ws, //workspace
+  int nxx,          //image width
+  int nyy,          //image height
+  int nscales,      //number of scales
+  double nu         //downsampling factor
+);
+
+
+/**
+ *
+ *  Keep the pyramid of the second image of the last call as the pyramid
+ *  of the first image of the next one, for consecutive frames of a
+ *  sequence. The next call must take the second image of the last call
+ *  as its first image, with the same size and zoom factor and at most
+ *  the same number of scales
+ *
+ */
+void workspace_roll_pyramid(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Release the memory of the workspace
+ *
+ */
+void workspace_free(
+  IcaWorkspace &ws //workspace
+);
+
+
+/**
+ *
+ *  Number of heap allocations done by the workspaces since the start of
+ *  the program. It is used to check that the buffers are reused
+ *
+ */
+long workspace_allocations();
+
+#endif